@@ -0,0 +1,52 @@
+#include <cassert>
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "grid.hpp"
+#include "kd_tree.hpp"
+#include "quantized_bvh.hpp"
+#include "wide_bvh.hpp"
+
+const Accelerator* Accelerator::Build(AccelType type,
+                                      const std::vector<const SceneObject*>& objs,
+                                      const BVH* bvh,
+                                      int n_threads)
+{
+    assert(bvh || !NeedsBVH(type));
+
+    switch (type) {
+    case ACCEL_BVH4:
+        return new BVH4(*bvh);
+    case ACCEL_BVH8:
+        return new BVH8(*bvh);
+    case ACCEL_QBVH4:
+        return new QuantizedBVH4(*bvh);
+    case ACCEL_KDTREE:
+        return new KdTree(objs);
+    case ACCEL_GRID:
+        return new Grid(objs, n_threads);
+    default:
+        return bvh;
+    }
+}
+
+void Accelerator::IntersectPacket(const Ray3D* rays, int n,
+                                  std::vector<SceneObjectIntersection>& hits) const
+{
+    hits.clear();
+    for (int i = 0; i < n; i++) {
+        hits.push_back(Intersects(rays[i], INFINITY));
+    }
+}
+
+SceneObjectIntersection Accelerator::FinalizeHit(const SceneObject* obj, const Ray3D& ray,
+                                                 const PrimHit& hit)
+{
+    if (!obj) {
+        SceneObjectIntersection miss(nullptr, false, ray);
+        miss.dist = INFINITY;
+        return miss;
+    }
+
+    return obj->Finalize(ray, hit);
+}
@@ -0,0 +1,106 @@
+#ifndef ACCELERATOR_HPP_
+#define ACCELERATOR_HPP_
+
+#include <cmath>
+#include <vector>
+#include <stddef.h>
+
+#include "intersection.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+
+class BVH;
+
+/* Spatial structures the scene can use to find ray hits */
+enum AccelType {
+    ACCEL_BVH = 0,    /* binary BVH */
+    ACCEL_BVH4,       /* binary BVH collapsed into 4-wide nodes */
+    ACCEL_BVH8,       /* binary BVH collapsed into 8-wide nodes */
+    ACCEL_QBVH4,      /* ACCEL_BVH4 with quantized child bounds */
+    ACCEL_KDTREE,     /* SAH kd-tree */
+    ACCEL_GRID,       /* two-level uniform grid */
+    N_ACCEL_TYPES
+};
+
+/* Size of an accelerator, for reporting */
+struct AccelStats {
+    size_t n_nodes;
+
+    /* Object references held by leaves; may exceed the number of
+       objects when objects are referenced from several leaves */
+    size_t n_refs;
+
+    /* Memory used by nodes and references */
+    size_t bytes;
+};
+
+class Accelerator {
+public:
+    virtual ~Accelerator()
+    {
+    }
+
+    /* Get a record of closest object intersected by the given ray */
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist = INFINITY) const = 0;
+
+    /* Is anything hit by the ray closer than max_dist? This stops at
+       the first hit found, e.g. for shadow rays. */
+    virtual bool Occluded(const Ray3D& ray, double max_dist) const = 0;
+
+    /* Closest hits of n rays, e.g. camera rays through neighbouring
+       pixels, which mostly visit the same nodes. Structures that can
+       trace such a bundle together override this; by default each ray
+       is traced on its own. hits is overwritten with one record per
+       ray. */
+    virtual void IntersectPacket(const Ray3D* rays, int n,
+                                 std::vector<SceneObjectIntersection>& hits) const;
+
+    /* Most rays IntersectPacket is meant to be given at once */
+    static const int MAX_PACKET_SIZE = 16;
+
+    virtual AccelStats GetStats() const = 0;
+
+    /* Build an accelerator of the given type over objs. Types that are
+       made from a binary BVH (see NeedsBVH) are made from bvh, and for
+       ACCEL_BVH that is bvh itself, not a copy. */
+    static const Accelerator* Build(AccelType type,
+                                    const std::vector<const SceneObject*>& objs,
+                                    const BVH* bvh,
+                                    int n_threads = 1);
+
+    static inline bool NeedsBVH(AccelType type) {
+        return type == ACCEL_BVH || type == ACCEL_BVH4 || type == ACCEL_BVH8 ||
+            type == ACCEL_QBVH4;
+    }
+
+    /* Human-readable name of an accelerator, e.g. for command line
+       flags */
+    static inline const char* TypeName(AccelType type) {
+        switch (type) {
+        case ACCEL_BVH:
+            return "bvh";
+        case ACCEL_BVH4:
+            return "bvh4";
+        case ACCEL_BVH8:
+            return "bvh8";
+        case ACCEL_QBVH4:
+            return "qbvh4";
+        case ACCEL_KDTREE:
+            return "kdtree";
+        case ACCEL_GRID:
+            return "grid";
+        default:
+            return "unknown";
+        }
+    }
+
+protected:
+    /* Traversals only call SceneObject::Hit(), and build a record for
+       the closest hit at the end: this one, where obj was hit, or a
+       miss if obj is null */
+    static SceneObjectIntersection FinalizeHit(const SceneObject* obj, const Ray3D& ray,
+                                               const PrimHit& hit);
+};
+
+#endif
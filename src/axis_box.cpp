@@ -0,0 +1,71 @@
+#include <cmath>
+
+#include "axis_box.hpp"
+#include "intersection.hpp"
+
+Vector3D box_normal(const Vector3D& lo, const Vector3D& hi, const Vector3D& pt)
+{
+    int best_axis = AXIS_X;
+    double best = -1, sign = 1;
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        double center = (lo.GetValue(axis) + hi.GetValue(axis)) / 2,
+            half = (hi.GetValue(axis) - lo.GetValue(axis)) / 2;
+        double rel = (pt.GetValue(axis) - center) / half;
+
+        if (std::abs(rel) > best) {
+            best_axis = axis;
+            best = std::abs(rel);
+            sign = rel < 0 ? -1 : 1;
+        }
+    }
+
+    double n[N_AXES] = {0, 0, 0};
+    n[best_axis] = sign;
+    return Vector3D(n[AXIS_X], n[AXIS_Y], n[AXIS_Z]);
+}
+
+AxisBox::AxisBox(const Vector3D& lo, const Vector3D& hi, const Material& mat) :
+    SceneObject((lo + hi) / 2, mat),
+    lo(lo),
+    hi(hi)
+{
+}
+
+AxisBox::~AxisBox()
+{
+}
+
+bool AxisBox::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    Vector3D origin = ray.GetOrigin(), dir = ray.GetDir();
+    double o[N_AXES], d[N_AXES], lo[N_AXES], hi[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        o[axis] = origin.GetValue(axis);
+        d[axis] = dir.GetValue(axis);
+        lo[axis] = this->lo.GetValue(axis);
+        hi[axis] = this->hi.GetValue(axis);
+    }
+
+    if (!hit_box(o, d, lo, hi, max_dist, hit.dist)) {
+        return false;
+    }
+
+    hit.part = this;
+    return true;
+}
+
+SceneObjectIntersection AxisBox::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    return this->FinalizeSolid(ray, hit);
+}
+
+SceneObjectIntersection AxisBox::Intersects(const Ray3D& ray, double max_dist) const
+{
+    return this->HitThenFinalize(ray, max_dist);
+}
+
+Box AxisBox::GetBoundingBox() const
+{
+    return Box(this->lo, this->hi);
+}
@@ -0,0 +1,76 @@
+#ifndef AXIS_BOX_HPP_
+#define AXIS_BOX_HPP_
+
+#include <algorithm>
+#include <cmath>
+
+#include "box.hpp"
+#include "helper.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "vector.hpp"
+
+/* Slab test of the ray with origin o and direction d against the box
+   from lo to hi, as a solid. On a hit no further than max_dist, sets t
+   to where the ray enters the box, or to where it leaves if it starts
+   inside or too close to the surface to tell from it. */
+inline bool hit_box(const double o[N_AXES], const double d[N_AXES],
+                    const double lo[N_AXES], const double hi[N_AXES],
+                    double max_dist, double& t)
+{
+    double t_in = -INFINITY, t_out = INFINITY;
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        double inv = 1 / d[axis];
+        double t0 = (lo[axis] - o[axis]) * inv, t1 = (hi[axis] - o[axis]) * inv;
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+
+        /* Written so that NaNs (0 * inf), from rays in the plane of a
+           face, leave the interval alone */
+        t_in = t0 > t_in ? t0 : t_in;
+        t_out = t1 < t_out ? t1 : t_out;
+    }
+
+    if (t_in > t_out) {
+        return false;
+    }
+
+    t = t_in >= EPSILON ? t_in : t_out;
+    return t >= EPSILON && t <= max_dist;
+}
+
+/* Outward normal of the face of the box from lo to hi closest to pt,
+   measured relative to the box's size along each axis. The box must
+   not be flat. */
+Vector3D box_normal(const Vector3D& lo, const Vector3D& hi, const Vector3D& pt);
+
+/* A solid box with faces along the axes, e.g. a crate or a wall with
+ * thickness: twelve triangles' worth in one primitive, which is
+ * exactly its own bounding box. It must have some extent along every
+ * axis; flat ones are quads. */
+class AxisBox : public SceneObject {
+public:
+    AxisBox(const Vector3D& lo, const Vector3D& hi, const Material& mat);
+    virtual ~AxisBox();
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray, double max_dist) const override;
+
+    /* The hit point and normal wait for Finalize() */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
+    virtual Box GetBoundingBox() const override;
+
+private:
+    Vector3D lo, hi;
+
+    virtual inline Vector3D NormalAtPoint(const Vector3D& v) const override
+    {
+        return box_normal(this->lo, this->hi, v);
+    };
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef BOUNDS_HPP_
+#define BOUNDS_HPP_
+
+#include <algorithm>
+#include <cmath>
+
+#include "box.hpp"
+#include "ray.hpp"
+#include "vector.hpp"
+
+/* Round a double to a float that is no greater (resp. no smaller)
+   than it, so float bounds always enclose the double ones. */
+inline float round_down(double d)
+{
+    float f = d;
+    return f > d ? std::nextafter(f, -INFINITY) : f;
+}
+
+inline float round_up(double d)
+{
+    float f = d;
+    return f < d ? std::nextafter(f, INFINITY) : f;
+}
+
+/* Slack applied to the far distance of a float slab test to make up
+   for its rounding error (pbrt's 1 + 2 * gamma(3)). */
+const float SLAB_EPSILON = 1 + 2 * (3 * 0.5f * 1.19209290e-7f);
+
+/* Plain axis-aligned bounds used while building acceleration
+ * structures. Unlike Box, this is a POD with no vtable and no cached
+ * vector norms, and a default-constructed Bounds is truly empty, so it
+ * can be grown from single points (e.g. centroids) without surprises.
+ */
+struct Bounds {
+    Bounds()
+    {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            lo[axis] = INFINITY;
+            hi[axis] = -INFINITY;
+        }
+    }
+
+    explicit Bounds(const Box& box)
+    {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            lo[axis] = box.GetExtent(BE_MIN_EXTENT).GetValue(axis);
+            hi[axis] = box.GetExtent(BE_MAX_EXTENT).GetValue(axis);
+        }
+    }
+
+    inline bool IsEmpty() const {
+        return lo[AXIS_X] > hi[AXIS_X];
+    }
+
+    inline void Expand(const Bounds& b) {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            lo[axis] = std::min(lo[axis], b.lo[axis]);
+            hi[axis] = std::max(hi[axis], b.hi[axis]);
+        }
+    }
+
+    inline void Expand(const double* pt) {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            lo[axis] = std::min(lo[axis], pt[axis]);
+            hi[axis] = std::max(hi[axis], pt[axis]);
+        }
+    }
+
+    /* Shrink to the overlap with b, which may leave this empty */
+    inline void Intersect(const Bounds& b) {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            lo[axis] = std::max(lo[axis], b.lo[axis]);
+            hi[axis] = std::min(hi[axis], b.hi[axis]);
+            if (lo[axis] > hi[axis]) {
+                *this = Bounds();
+                return;
+            }
+        }
+    }
+
+    inline double Center(int axis) const {
+        return 0.5 * (lo[axis] + hi[axis]);
+    }
+
+    inline double Extent(int axis) const {
+        return hi[axis] - lo[axis];
+    }
+
+    inline double SurfaceArea() const {
+        if (IsEmpty()) {
+            return 0;
+        }
+
+        double dx = Extent(AXIS_X), dy = Extent(AXIS_Y), dz = Extent(AXIS_Z);
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    inline int LongestAxis() const {
+        double dx = Extent(AXIS_X), dy = Extent(AXIS_Y), dz = Extent(AXIS_Z);
+        return dx > dy ? (dz > dx ? AXIS_Z : AXIS_X) : (dz > dy ? AXIS_Z : AXIS_Y);
+    }
+
+    /* Where the ray is inside these bounds before max_dist, if
+       anywhere */
+    inline bool Clip(const Ray3D& ray, double max_dist,
+                     double* t_min, double* t_max) const {
+        if (IsEmpty()) {
+            return false;
+        }
+
+        Vector3D o = ray.GetOrigin(), inv = ray.GetInvDir();
+        double t0 = 0, t1 = max_dist;
+
+        /* A ray with NaNs in it, e.g. a failed refraction, hits
+           nothing, though every test below would let it through */
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            if (std::isnan(o.GetValue(axis)) || std::isnan(inv.GetValue(axis))) {
+                return false;
+            }
+        }
+
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            double t_near = (lo[axis] - o.GetValue(axis)) * inv.GetValue(axis);
+            double t_far = (hi[axis] - o.GetValue(axis)) * inv.GetValue(axis);
+            if (t_near > t_far) {
+                std::swap(t_near, t_far);
+            }
+
+            /* Written so that NaNs (0 * inf) leave the interval alone */
+            t0 = t_near > t0 ? t_near : t0;
+            t1 = t_far < t1 ? t_far : t1;
+
+            if (t0 > t1) {
+                return false;
+            }
+        }
+
+        *t_min = t0;
+        *t_max = t1;
+        return true;
+    }
+
+    inline Box ToBox() const {
+        return Box(Vector3D(lo[AXIS_X], lo[AXIS_Y], lo[AXIS_Z]),
+                   Vector3D(hi[AXIS_X], hi[AXIS_Y], hi[AXIS_Z]));
+    }
+
+    double lo[N_AXES], hi[N_AXES];
+};
+
+#endif
@@ -85,6 +85,11 @@ int Box::LongestAxis() const
         .LongestAxis();
 }
 
+const Vector3D& Box::GetExtent(int extent) const
+{
+    return extents[extent];
+}
+
 bool Box::Engulfs (const Box& box) const
 {
     return extents[BE_MIN_EXTENT] <= box.extents[BE_MIN_EXTENT]
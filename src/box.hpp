@@ -37,6 +37,9 @@ public:
     void Expand(const Box& box);
     int LongestAxis() const;
 
+    /* Corner of the box given by a BoxExtent */
+    const Vector3D& GetExtent(int extent) const;
+
     /* b is engulfed by this box if it is contained completely within
        it. */
     bool Engulfs (const Box& b) const;
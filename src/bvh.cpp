@@ -1,153 +1,1446 @@
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <cmath>
+#include <deque>
+#include <queue>
+#include <thread>
+#include <utility>
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#include "bounds.hpp"
 #include "box.hpp"
 #include "bvh.hpp"
+#include "bvh_traversal.hpp"
+#include "helper.hpp"
 #include "scene_object.hpp"
-#include "zbuffer.hpp"
+#include "slab_test.hpp"
+
+BVHRay::BVHRay(const Ray3D& ray)
+{
+    Vector3D o = ray.GetOrigin(), inv = ray.GetInvDir();
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        float lo = round_down(o.GetValue(axis)), hi = round_up(o.GetValue(axis));
+        inv_dir[axis] = inv.GetValue(axis);
+        dir_neg[axis] = inv_dir[axis] < 0;
+        near_origin[axis] = dir_neg[axis] ? lo : hi;
+        far_origin[axis] = dir_neg[axis] ? hi : lo;
+    }
+}
+
+/* A packet of rays in SoA form. Unused lanes have a negative t_max so
+   they never hit anything. */
+struct PacketRays {
+    float near_origin[N_AXES][Accelerator::MAX_PACKET_SIZE];
+    float far_origin[N_AXES][Accelerator::MAX_PACKET_SIZE];
+    float inv_dir[N_AXES][Accelerator::MAX_PACKET_SIZE];
+    float t_max[Accelerator::MAX_PACKET_SIZE];
+};
+
+/* Range of a packet's origins and reciprocal directions per axis */
+struct PacketFrustum {
+    float origin_lo[N_AXES], origin_hi[N_AXES];
+    float inv_lo[N_AXES], inv_hi[N_AXES];
+};
+
+/* Slab test of rays base to base + 3 of a coherent packet against a
+   node's box. All of them enter the box through the same planes.
+   Returns a bit mask of the rays that hit. */
+static inline int packet_slab_test4(const LinearBVHNode& node,
+                                    const int dir_neg[N_AXES],
+                                    const PacketRays& packet,
+                                    int base)
+{
+#if defined(__SSE__)
+    __m128 t0 = _mm_setzero_ps(), t1 = _mm_loadu_ps(packet.t_max + base),
+        eps = _mm_set1_ps(SLAB_EPSILON);
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        __m128 o_near = _mm_loadu_ps(packet.near_origin[axis] + base),
+            o_far = _mm_loadu_ps(packet.far_origin[axis] + base),
+            inv = _mm_loadu_ps(packet.inv_dir[axis] + base),
+            near = _mm_set1_ps(node.bounds[dir_neg[axis]][axis]),
+            far = _mm_set1_ps(node.bounds[1 - dir_neg[axis]][axis]);
+        __m128 t_near = _mm_mul_ps(_mm_sub_ps(near, o_near), inv);
+        __m128 t_far = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(far, o_far), inv), eps);
+
+        /* max/min return their second operand for NaNs (0 * inf),
+           which leaves the interval alone */
+        t0 = _mm_max_ps(t_near, t0);
+        t1 = _mm_min_ps(t_far, t1);
+    }
+
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+
+    for (int i = base; i < base + 4; i++) {
+        float t0 = 0, t1 = packet.t_max[i];
+
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            float t_near = (node.bounds[dir_neg[axis]][axis] - packet.near_origin[axis][i])
+                * packet.inv_dir[axis][i];
+            float t_far = (node.bounds[1 - dir_neg[axis]][axis] - packet.far_origin[axis][i])
+                * packet.inv_dir[axis][i] * SLAB_EPSILON;
+            t0 = t_near > t0 ? t_near : t0;
+            t1 = t_far < t1 ? t_far : t1;
+        }
+
+        mask |= (t0 <= t1) << (i - base);
+    }
+
+    return mask;
+#endif
+}
+
+/* Can any ray of a coherent packet hit a node's box before t_max?
+   Interval arithmetic over the frustum gives the earliest any ray
+   could enter the box and the latest any could leave it. Float
+   subtraction and multiplication round monotonically, so the bounds
+   hold for the rounded per-ray distances too. */
+static inline bool frustum_intersects(const LinearBVHNode& node,
+                                      const int dir_neg[N_AXES],
+                                      const PacketFrustum& f,
+                                      float t_max)
+{
+    float t0 = 0, t1 = t_max;
 
-BVHNode::BVHNode() :
-    objs(),
-    bounding_box()
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        float near = node.bounds[dir_neg[axis]][axis],
+            far = node.bounds[1 - dir_neg[axis]][axis];
+
+        float a = near - f.origin_hi[axis], b = near - f.origin_lo[axis];
+        float t_near = std::min(std::min(a * f.inv_lo[axis], a * f.inv_hi[axis]),
+                                std::min(b * f.inv_lo[axis], b * f.inv_hi[axis]));
+
+        float c = far - f.origin_hi[axis], d = far - f.origin_lo[axis];
+        float t_far = std::max(std::max(c * f.inv_lo[axis], c * f.inv_hi[axis]),
+                               std::max(d * f.inv_lo[axis], d * f.inv_hi[axis]))
+            * SLAB_EPSILON;
+
+        t0 = t_near > t0 ? t_near : t0;
+        t1 = t_far < t1 ? t_far : t1;
+        if (t0 > t1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void set_bounds(BVHNodeArray& nodes, uint32_t index,
+                       const Bounds& b)
+{
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        nodes[index].bounds[BE_MIN_EXTENT][axis] = round_down(b.lo[axis]);
+        nodes[index].bounds[BE_MAX_EXTENT][axis] = round_up(b.hi[axis]);
+    }
+}
+
+static void make_leaf(BVHNodeArray& nodes, uint32_t index,
+                      size_t start, size_t end)
 {
+    nodes[index].offset = start;
+    nodes[index].count = end - start;
 }
 
-void BVHNode::AddObject(const SceneObject* obj)
+/* Append a pair of sibling nodes and return the first's index */
+static uint32_t add_children(BVHNodeArray& nodes, uint32_t parent)
 {
-    objs.push_back(obj);
-    bounding_box.Expand(obj->GetBoundingBox());
+    uint32_t first = nodes.size();
+    nodes.resize(first + 2);
+
+    nodes[parent].offset = first;
+    nodes[parent].count = 0;
+
+    return first;
+}
+
+/* Spread the low 21 bits of x out so there are two zero bits between
+   each of them */
+static inline uint64_t spread_bits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8) & 0x100f00f00f00f00fULL;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2) & 0x1249249249249249ULL;
+    return x;
+}
+
+/* 63-bit Morton code of a point, quantized to 21 bits per axis
+   within the given bounds */
+static inline uint64_t morton_code(const double* pt, const Bounds& bounds)
+{
+    const double cells = 1 << 21;
+    uint64_t code = 0;
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        double extent = bounds.Extent(axis);
+        double q = extent > 0 ? (pt[axis] - bounds.lo[axis]) / extent * cells : 0;
+        uint64_t cell = std::min(std::max(q, 0.0), cells - 1);
+        code |= spread_bits(cell) << (N_AXES - 1 - axis);
+    }
+
+    return code;
 }
 
-inline int left_child(int index)
+/* LSD radix sort of (code, index) pairs, 8 bits per pass. Each pass
+   counts digits per chunk in parallel, then scatters every chunk to
+   its precomputed offsets in parallel. */
+static void radix_sort(std::vector<std::pair<uint64_t, uint32_t> >& items,
+                       int n_threads)
 {
-    return 2 * index + 1;
+    const int DIGIT_BITS = 8, N_DIGITS = 1 << DIGIT_BITS;
+    std::vector<std::pair<uint64_t, uint32_t> > scratch(items.size());
+    std::vector<size_t> counts(n_threads * N_DIGITS);
+
+    for (int shift = 0; shift < 64; shift += DIGIT_BITS) {
+        std::fill(counts.begin(), counts.end(), 0);
+
+        parallel_for(0, items.size(), n_threads, [&](size_t b, size_t e, int chunk) {
+                size_t* hist = &counts[chunk * N_DIGITS];
+                for (size_t i = b; i < e; i++) {
+                    hist[(items[i].first >> shift) & (N_DIGITS - 1)]++;
+                }
+            });
+
+        /* Turn the counts into starting offsets, digit-major so each
+           chunk's items land after the previous chunks' */
+        size_t offset = 0;
+        for (int digit = 0; digit < N_DIGITS; digit++) {
+            for (int chunk = 0; chunk < n_threads; chunk++) {
+                size_t count = counts[chunk * N_DIGITS + digit];
+                counts[chunk * N_DIGITS + digit] = offset;
+                offset += count;
+            }
+        }
+
+        parallel_for(0, items.size(), n_threads, [&](size_t b, size_t e, int chunk) {
+                size_t* next = &counts[chunk * N_DIGITS];
+                for (size_t i = b; i < e; i++) {
+                    scratch[next[(items[i].first >> shift) & (N_DIGITS - 1)]++] = items[i];
+                }
+            });
+
+        items.swap(scratch);
+    }
+}
+
+/* Which of n_bins equal bins along axis a centroid falls in */
+static inline int centroid_bin(const double* centroid, const Bounds& centroid_bounds,
+                               int axis, int n_bins)
+{
+    double extent = centroid_bounds.Extent(axis);
+    if (extent <= 0) {
+        return 0;
+    }
+
+    int bin = (centroid[axis] - centroid_bounds.lo[axis]) * (n_bins / extent);
+    return std::min(bin, n_bins - 1);
+}
+
+void BVH::BuildChildren(BuildFn build, std::vector<BuildPrimitive>& prims,
+                        size_t start, size_t split, size_t end,
+                        uint32_t index, int depth, int n_threads,
+                        BVHNodeArray& out)
+{
+    uint32_t child = add_children(out, index);
+
+    if (n_threads < 2 || end - start < PARALLEL_MIN_OBJS) {
+        (this->*build)(prims, start, split, child, depth + 1, 1, out);
+        (this->*build)(prims, split, end, child + 1, depth + 1, 1, out);
+        return;
+    }
+
+    /* The two halves touch disjoint ranges of prims, so the second can
+       be built on its own thread into a private array rooted at 0. */
+    int right_threads = n_threads / 2;
+    BVHNodeArray right(1);
+    right.reserve(2 * (end - split));
+
+    std::thread worker([&]() {
+            (this->*build)(prims, split, end, 0, depth + 1, right_threads, right);
+        });
+    (this->*build)(prims, start, split, child, depth + 1,
+                   n_threads - right_threads, out);
+    worker.join();
+
+    /* Splice it in: the root takes the reserved sibling slot and the
+       rest is appended, so private index k > 0 becomes base + k. */
+    uint32_t base = out.size() - 1;
+    for (auto& node : right) {
+        if (!node.IsLeaf()) {
+            node.offset += base;
+        }
+    }
+
+    out[child + 1] = right[0];
+    out.insert(out.end(), right.begin() + 1, right.end());
+}
+
+void BVH::BuildMean(std::vector<BuildPrimitive>& prims,
+                    size_t start, size_t end,
+                    uint32_t index, int depth, int n_threads,
+                    BVHNodeArray& out)
+{
+    Bounds node_bounds;
+    for (size_t i = start; i < end; i++) {
+        node_bounds.Expand(prims[i].bounds);
+    }
+    set_bounds(out, index, node_bounds);
+
+    /* No need to subdivide if this node is small enough */
+    if (end - start <= std::max<size_t>(MAX_OBJS, leaf_fill) || depth >= MAX_DEPTH - 1) {
+        make_leaf(out, index, start, end);
+        return;
+    }
+
+    /* If we do have enough objects to divide, split along the mean
+       position along the longest axis. */
+    int longest_axis = node_bounds.LongestAxis();
+
+    double midpoint = 0;
+    for (size_t i = start; i < end; i++) {
+        midpoint += prims[i].centroid[longest_axis];
+    }
+    midpoint /= end - start;
+
+    auto mid = std::partition(prims.begin() + start, prims.begin() + end,
+                              [=](const BuildPrimitive& p) {
+                                  return p.centroid[longest_axis] < midpoint;
+                              });
+    size_t split = mid - prims.begin();
+
+    /* Every object sits at the same position; nothing to gain from
+       splitting further. */
+    if (split == start || split == end) {
+        make_leaf(out, index, start, end);
+        return;
+    }
+
+    BuildChildren(&BVH::BuildMean, prims, start, split, end,
+                  index, depth, n_threads, out);
+}
+
+BVH::Split BVH::FindObjectSplit(const std::vector<BuildPrimitive>& prims,
+                                size_t start, size_t end,
+                                const Bounds& centroid_bounds, int n_threads) const
+{
+    /* Bin the centroids along every axis and sweep the bins to find
+       the cheapest split plane. */
+    struct Bin {
+        Bounds bounds;
+        size_t count = 0;
+    };
+
+    struct AxisBins {
+        Bin bins[N_AXES][SAH_BINS];
+
+        void Merge(const AxisBins& other) {
+            for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                for (int b = 0; b < SAH_BINS; b++) {
+                    bins[axis][b].count += other.bins[axis][b].count;
+                    bins[axis][b].bounds.Expand(other.bins[axis][b].bounds);
+                }
+            }
+        }
+    };
+
+    auto bin_range = [&](size_t b, size_t e, AxisBins& axis_bins) {
+        for (size_t i = b; i < e; i++) {
+            for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                int bin = centroid_bin(prims[i].centroid, centroid_bounds, axis, SAH_BINS);
+                axis_bins.bins[axis][bin].count++;
+                axis_bins.bins[axis][bin].bounds.Expand(prims[i].bounds);
+            }
+        }
+    };
+
+    AxisBins all_bins;
+    if (n_threads > 1) {
+        std::vector<AxisBins> chunk_bins(n_threads);
+        parallel_for(start, end, n_threads, [&](size_t b, size_t e, int chunk) {
+                bin_range(b, e, chunk_bins[chunk]);
+            });
+
+        for (int chunk = 0; chunk < n_threads; chunk++) {
+            all_bins.Merge(chunk_bins[chunk]);
+        }
+    } else {
+        bin_range(start, end, all_bins);
+    }
+
+    Split best;
+    size_t n_prims = end - start;
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        if (centroid_bounds.Extent(axis) <= 0) {
+            continue;
+        }
+
+        const Bin* bins = all_bins.bins[axis];
+
+        /* Sweep from the right to get the cost of everything above
+           each candidate plane... */
+        Bounds right_bounds[SAH_BINS];
+        size_t right_count[SAH_BINS];
+        Bounds acc;
+        size_t count = 0;
+        for (int b = SAH_BINS - 1; b > 0; b--) {
+            acc.Expand(bins[b].bounds);
+            count += bins[b].count;
+            right_bounds[b] = acc;
+            right_count[b] = count;
+        }
+
+        /* ...then from the left, combining the two. Plane b lies
+           between bin b - 1 and bin b. */
+        acc = Bounds();
+        count = 0;
+        for (int b = 1; b < SAH_BINS; b++) {
+            acc.Expand(bins[b - 1].bounds);
+            count += bins[b - 1].count;
+
+            if (count == 0 || count == n_prims) {
+                continue;
+            }
+
+            double cost = acc.SurfaceArea() * LeafBlocks(count)
+                + right_bounds[b].SurfaceArea() * LeafBlocks(right_count[b]);
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = b;
+                best.left = acc;
+                best.right = right_bounds[b];
+                best.left_count = count;
+                best.right_count = right_count[b];
+            }
+        }
+    }
+
+    return best;
 }
 
-inline int right_child(int index)
+void BVH::BuildSAH(std::vector<BuildPrimitive>& prims,
+                   size_t start, size_t end,
+                   uint32_t index, int depth, int n_threads,
+                   BVHNodeArray& out)
 {
-    return 2 * index + 2;
+    size_t n_prims = end - start;
+
+    /* Only near the root is there enough work to be worth spreading
+       the binning passes over several threads. */
+    int bin_threads = n_prims >= PARALLEL_MIN_OBJS ? n_threads : 1;
+
+    auto bound_range = [&](size_t b, size_t e, Bounds& bounds, Bounds& centroids) {
+        for (size_t i = b; i < e; i++) {
+            bounds.Expand(prims[i].bounds);
+            centroids.Expand(prims[i].centroid);
+        }
+    };
+
+    Bounds node_bounds, centroid_bounds;
+    if (bin_threads > 1) {
+        std::vector<Bounds> chunk_bounds(bin_threads), chunk_centroids(bin_threads);
+        parallel_for(start, end, bin_threads, [&](size_t b, size_t e, int chunk) {
+                bound_range(b, e, chunk_bounds[chunk], chunk_centroids[chunk]);
+            });
+
+        for (int chunk = 0; chunk < bin_threads; chunk++) {
+            node_bounds.Expand(chunk_bounds[chunk]);
+            centroid_bounds.Expand(chunk_centroids[chunk]);
+        }
+    } else {
+        bound_range(start, end, node_bounds, centroid_bounds);
+    }
+    set_bounds(out, index, node_bounds);
+
+    if (n_prims <= leaf_fill || depth >= MAX_DEPTH - 1) {
+        make_leaf(out, index, start, end);
+        return;
+    }
+
+    Split best = FindObjectSplit(prims, start, end, centroid_bounds, bin_threads);
+
+    /* All centroids coincide, so no plane separates them. */
+    if (best.axis < 0) {
+        make_leaf(out, index, start, end);
+        return;
+    }
+
+    double parent_area = node_bounds.SurfaceArea();
+    double split_cost = SAH_TRAVERSAL_COST;
+    if (parent_area > 0) {
+        split_cost += SAH_INTERSECT_COST * best.cost / parent_area;
+    }
+    double leaf_cost = SAH_INTERSECT_COST * LeafBlocks(n_prims);
+
+    if (n_prims <= SAH_MAX_LEAF_OBJS && leaf_cost <= split_cost) {
+        make_leaf(out, index, start, end);
+        return;
+    }
+
+    auto mid = std::partition(prims.begin() + start, prims.begin() + end,
+                              [&](const BuildPrimitive& p) {
+                                  return centroid_bin(p.centroid, centroid_bounds,
+                                                      best.axis, SAH_BINS) < best.bin;
+                              });
+    size_t split = mid - prims.begin();
+
+    BuildChildren(&BVH::BuildSAH, prims, start, split, end,
+                  index, depth, n_threads, out);
 }
 
-inline int parent(int index)
+void BVH::SortMorton(std::vector<BuildPrimitive>& prims, int n_threads)
 {
-    return (index - 1) / 2;
+    Bounds centroid_bounds;
+    for (auto& prim : prims) {
+        centroid_bounds.Expand(prim.centroid);
+    }
+
+    std::vector<std::pair<uint64_t, uint32_t> > keys(prims.size());
+    parallel_for(0, prims.size(), n_threads, [&](size_t b, size_t e, int) {
+            for (size_t i = b; i < e; i++) {
+                prims[i].code = morton_code(prims[i].centroid, centroid_bounds);
+                keys[i] = std::make_pair(prims[i].code, i);
+            }
+        });
+
+    radix_sort(keys, n_threads);
+
+    std::vector<BuildPrimitive> sorted(prims.size());
+    parallel_for(0, prims.size(), n_threads, [&](size_t b, size_t e, int) {
+            for (size_t i = b; i < e; i++) {
+                sorted[i] = prims[keys[i].second];
+            }
+        });
+    prims.swap(sorted);
 }
 
-void BVH::Subdivide()
+void BVH::BuildLBVH(std::vector<BuildPrimitive>& prims,
+                    size_t start, size_t end,
+                    uint32_t index, int depth, int n_threads,
+                    BVHNodeArray& out)
 {
-    /* Stack of child nodes to subdivide */
-    std::vector<int> node_index_stack;
-    node_index_stack.push_back(0);
+    /* The range is sorted by Morton code, so its first and last codes
+       differ in the highest bit any two codes in it differ in. */
+    uint64_t diff = prims[start].code ^ prims[end - 1].code;
 
-    /* Reserve enough space for the entire tree */
+    if (end - start <= std::max<size_t>(LBVH_MAX_LEAF_OBJS, leaf_fill) ||
+        diff == 0 || depth >= MAX_DEPTH - 1) {
+        Bounds leaf_bounds;
+        for (size_t i = start; i < end; i++) {
+            leaf_bounds.Expand(prims[i].bounds);
+        }
+        set_bounds(out, index, leaf_bounds);
+        make_leaf(out, index, start, end);
+        return;
+    }
 
-    while (!node_index_stack.empty()) {
-        int curr_index = node_index_stack.back();
-        node_index_stack.pop_back();
+    /* Split where that bit turns on */
+    int bit = 63 - __builtin_clzll(diff);
+    auto mid = std::partition_point(prims.begin() + start, prims.begin() + end,
+                                    [=](const BuildPrimitive& p) {
+                                        return !((p.code >> bit) & 1);
+                                    });
+    size_t split = mid - prims.begin();
 
-        BVHNode* curr_node = &nodes[curr_index];
+    BuildChildren(&BVH::BuildLBVH, prims, start, split, end,
+                  index, depth, n_threads, out);
 
-        /* No need to subdivide if this node is small enough */
-        if (curr_node->objs.size() <= MAX_OBJS ||
-            right_child(curr_index) > nodes.size()) {
+    /* Bounds come bottom-up from the children so the whole build stays
+       linear in the number of objects. */
+    uint32_t child = out[index].offset;
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        out[index].bounds[BE_MIN_EXTENT][axis] =
+            std::min(out[child].bounds[BE_MIN_EXTENT][axis],
+                     out[child + 1].bounds[BE_MIN_EXTENT][axis]);
+        out[index].bounds[BE_MAX_EXTENT][axis] =
+            std::max(out[child].bounds[BE_MAX_EXTENT][axis],
+                     out[child + 1].bounds[BE_MAX_EXTENT][axis]);
+    }
+}
+
+BVH::Split BVH::FindSpatialSplit(const BVHPrimitives& source,
+                                 const std::vector<BuildPrimitive>& refs,
+                                 const Bounds& node_bounds) const
+{
+    /* Bins count the references entering and leaving them, and hold
+       the bounds of the pieces of references clipped to them. */
+    struct Bin {
+        Bounds bounds;
+        size_t entries = 0, exits = 0;
+    };
+
+    Split best;
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        double lo = node_bounds.lo[axis], extent = node_bounds.Extent(axis);
+        if (extent <= 0) {
             continue;
         }
 
-        /* If we do have enough objects to divide, split along the mean
-           position along the longest axis. */
-        int longest_axis = curr_node->bounding_box.LongestAxis();
+        double width = extent / SAH_BINS;
+        auto bin_of = [&](double x) {
+            return std::min(std::max(int((x - lo) / width), 0), SAH_BINS - 1);
+        };
+
+        Bin bins[SAH_BINS];
+        for (auto& ref : refs) {
+            int first = bin_of(ref.bounds.lo[axis]), last = bin_of(ref.bounds.hi[axis]);
+            bins[first].entries++;
+            bins[last].exits++;
+
+            /* Chop the reference at every bin boundary it straddles */
+            Bounds rest = ref.bounds;
+            for (int b = first; b < last; b++) {
+                Bounds below, above;
+                source.SplitBounds(ref.index, axis, lo + (b + 1) * width, below, above);
+                below.Intersect(rest);
+                above.Intersect(rest);
+
+                bins[b].bounds.Expand(below);
+                rest = above;
+            }
+            bins[last].bounds.Expand(rest);
+        }
+
+        Bounds right_bounds[SAH_BINS];
+        size_t right_count[SAH_BINS];
+        Bounds acc;
+        size_t count = 0;
+        for (int b = SAH_BINS - 1; b > 0; b--) {
+            acc.Expand(bins[b].bounds);
+            count += bins[b].exits;
+            right_bounds[b] = acc;
+            right_count[b] = count;
+        }
+
+        acc = Bounds();
+        count = 0;
+        for (int b = 1; b < SAH_BINS; b++) {
+            acc.Expand(bins[b - 1].bounds);
+            count += bins[b - 1].entries;
+
+            if (count == 0 || right_count[b] == 0) {
+                continue;
+            }
+
+            double cost = acc.SurfaceArea() * LeafBlocks(count)
+                + right_bounds[b].SurfaceArea() * LeafBlocks(right_count[b]);
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.pos = lo + b * width;
+                best.left = acc;
+                best.right = right_bounds[b];
+                best.left_count = count;
+                best.right_count = right_count[b];
+            }
+        }
+    }
+
+    return best;
+}
+
+void BVH::BuildSBVH(const BVHPrimitives& source,
+                    std::vector<BuildPrimitive>& refs,
+                    uint32_t index, int depth,
+                    double root_area, size_t& n_refs, size_t max_refs,
+                    BVHNodeArray& out)
+{
+    size_t n_prims = refs.size();
+
+    Bounds node_bounds, centroid_bounds;
+    for (auto& ref : refs) {
+        node_bounds.Expand(ref.bounds);
+        centroid_bounds.Expand(ref.centroid);
+    }
+    set_bounds(out, index, node_bounds);
+
+    auto leaf = [&]() {
+        out[index].offset = indices.size();
+        out[index].count = n_prims;
+        for (auto& ref : refs) {
+            indices.push_back(ref.index);
+        }
+    };
+
+    if (n_prims <= leaf_fill || depth >= MAX_DEPTH - 1) {
+        leaf();
+        return;
+    }
+
+    Split best = FindObjectSplit(refs, 0, n_prims, centroid_bounds, 1);
+    bool spatial = false;
+
+    /* Clipping is only worth its cost where the object split leaves
+       children that overlap noticeably, and only while the reference
+       budget lasts. */
+    Bounds overlap = best.left;
+    overlap.Intersect(best.right);
+    if (best.axis < 0 || overlap.SurfaceArea() > SBVH_MIN_OVERLAP * root_area) {
+        Split spatial_split = FindSpatialSplit(source, refs, node_bounds);
+        size_t extra = spatial_split.left_count + spatial_split.right_count - n_prims;
+
+        if (spatial_split.cost < best.cost && n_refs + extra <= max_refs) {
+            best = spatial_split;
+            spatial = true;
+        }
+    }
+
+    if (best.axis < 0) {
+        leaf();
+        return;
+    }
+
+    double parent_area = node_bounds.SurfaceArea();
+    double split_cost = SAH_TRAVERSAL_COST;
+    if (parent_area > 0) {
+        split_cost += SAH_INTERSECT_COST * best.cost / parent_area;
+    }
+    double leaf_cost = SAH_INTERSECT_COST * LeafBlocks(n_prims);
+
+    if (n_prims <= SAH_MAX_LEAF_OBJS && leaf_cost <= split_cost) {
+        leaf();
+        return;
+    }
+
+    std::vector<BuildPrimitive> left, right;
+    int axis = best.axis;
+
+    if (!spatial) {
+        for (auto& ref : refs) {
+            if (centroid_bin(ref.centroid, centroid_bounds, axis, SAH_BINS) < best.bin) {
+                left.push_back(ref);
+            } else {
+                right.push_back(ref);
+            }
+        }
+    } else {
+        double area_l = best.left.SurfaceArea(), area_r = best.right.SurfaceArea();
+        size_t n_l = best.left_count, n_r = best.right_count;
+
+        for (auto& ref : refs) {
+            if (ref.bounds.hi[axis] <= best.pos) {
+                left.push_back(ref);
+                continue;
+            } else if (ref.bounds.lo[axis] >= best.pos) {
+                right.push_back(ref);
+                continue;
+            }
+
+            /* Reference unsplitting: keep a straddling reference
+               whole on one side if that is cheaper than clipping it */
+            Bounds grown_l = best.left, grown_r = best.right;
+            grown_l.Expand(ref.bounds);
+            grown_r.Expand(ref.bounds);
+
+            double split_cost = area_l * n_l + area_r * n_r;
+            double left_cost = grown_l.SurfaceArea() * n_l + area_r * (n_r - 1);
+            double right_cost = area_l * (n_l - 1) + grown_r.SurfaceArea() * n_r;
+
+            BuildPrimitive below = ref, above = ref;
+            source.SplitBounds(ref.index, axis, best.pos, below.bounds, above.bounds);
+            below.bounds.Intersect(ref.bounds);
+            above.bounds.Intersect(ref.bounds);
+
+            if (left_cost < split_cost && left_cost <= right_cost) {
+                left.push_back(ref);
+            } else if (right_cost < split_cost || below.bounds.IsEmpty()) {
+                right.push_back(ref);
+            } else if (above.bounds.IsEmpty()) {
+                left.push_back(ref);
+            } else {
+                for (int a = AXIS_X; a < N_AXES; a++) {
+                    below.centroid[a] = below.bounds.Center(a);
+                    above.centroid[a] = above.bounds.Center(a);
+                }
+                left.push_back(below);
+                right.push_back(above);
+                n_refs++;
+            }
+        }
+    }
+
+    /* Clipping can collapse a side to nothing after all */
+    if (left.empty() || right.empty()) {
+        leaf();
+        return;
+    }
+
+    std::vector<BuildPrimitive>().swap(refs);
+
+    uint32_t child = add_children(out, index);
+    BuildSBVH(source, left, child, depth + 1, root_area, n_refs, max_refs, out);
+    BuildSBVH(source, right, child + 1, depth + 1, root_area, n_refs, max_refs, out);
+}
+
+void BVHPrimitives::GetPos(uint32_t i, double pos[N_AXES]) const
+{
+    Bounds bounds = GetBounds(i);
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        pos[axis] = bounds.Center(axis);
+    }
+}
+
+void BVHPrimitives::SplitBounds(uint32_t i, int axis, double pos,
+                                Bounds& below, Bounds& above) const
+{
+    below = above = GetBounds(i);
+    below.hi[axis] = std::min(below.hi[axis], pos);
+    above.lo[axis] = std::max(above.lo[axis], pos);
+}
+
+/* Scene objects seen as indexed primitives */
+class ObjectPrimitives : public BVHPrimitives {
+public:
+    ObjectPrimitives(const std::vector<const SceneObject*>& objs) : objs(objs) {}
+
+    size_t Size() const {
+        return objs.size();
+    }
+
+    Bounds GetBounds(uint32_t i) const {
+        return Bounds(objs[i]->GetBoundingBox());
+    }
+
+    /* The mean split has always used the objects' reference
+       positions rather than their box centers. */
+    void GetPos(uint32_t i, double pos[N_AXES]) const {
+        Vector3D p = objs[i]->GetPos();
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            pos[axis] = p.GetValue(axis);
+        }
+    }
+
+    void SplitBounds(uint32_t i, int axis, double pos,
+                     Bounds& below, Bounds& above) const {
+        objs[i]->SplitBounds(axis, pos, below, above);
+    }
+
+private:
+    const std::vector<const SceneObject*>& objs;
+};
+
+BVH::BVH(std::vector<const SceneObject*>& objs, const BVHOptions& options) :
+    nodes(1),
+    prims(),
+    ref_count(0),
+    build_cost(0),
+    leaf_block(1),
+    leaf_fill(1)
+{
+    Build(ObjectPrimitives(objs), options);
+
+    std::vector<const SceneObject*> leaf_objs(indices.size());
+    parallel_for(0, indices.size(), std::max(1, options.n_threads),
+                 [&](size_t b, size_t e, int) {
+            for (size_t i = b; i < e; i++) {
+                leaf_objs[i] = objs[indices[i]];
+            }
+        });
+    prims = PrimitiveList(leaf_objs);
+}
+
+BVH::BVH(const BVHPrimitives& source, const BVHOptions& options) :
+    nodes(1),
+    prims(),
+    ref_count(0),
+    build_cost(0),
+    leaf_block(1),
+    leaf_fill(1)
+{
+    Build(source, options);
+}
+
+void BVH::Build(const BVHPrimitives& source, const BVHOptions& options)
+{
+    BVHBuilder builder = options.builder;
+    int n_threads = std::max(1, options.n_threads);
+    size_t n_objs = source.Size();
+    leaf_block = std::max(1, options.leaf_block);
+    leaf_fill = std::max(1, options.leaf_fill);
+
+    std::vector<BuildPrimitive> build_prims(n_objs);
+    parallel_for(0, n_objs, n_threads, [&](size_t b, size_t e, int) {
+            for (size_t i = b; i < e; i++) {
+                build_prims[i].index = i;
+                build_prims[i].bounds = source.GetBounds(i);
+
+                if (builder == BVH_BUILD_MEAN) {
+                    source.GetPos(i, build_prims[i].centroid);
+                    continue;
+                }
+                for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                    build_prims[i].centroid[axis] = build_prims[i].bounds.Center(axis);
+                }
+            }
+        });
+
+    if (n_objs == 0) {
+        /* Leave a single empty leaf behind for traversal to reject */
+        set_bounds(nodes, 0, Bounds());
+        make_leaf(nodes, 0, 0, 0);
+        return;
+    }
+
+    /* A binary tree with n leaves has at most 2n - 1 nodes */
+    nodes.reserve(2 * n_objs - 1);
+
+    if (builder == BVH_BUILD_SBVH) {
+        /* Spatial splits duplicate references, so leaves are written
+           out as they are made rather than as ranges of build_prims. */
+        size_t n_refs = n_objs;
+        size_t max_refs = n_refs + n_refs * std::max(0.0, options.max_duplication);
+        indices.reserve(max_refs);
+
+        Bounds root_bounds;
+        for (auto& prim : build_prims) {
+            root_bounds.Expand(prim.bounds);
+        }
+
+        BuildSBVH(source, build_prims, 0, 0, root_bounds.SurfaceArea(),
+                  n_refs, max_refs, nodes);
+        nodes.shrink_to_fit();
+        indices.shrink_to_fit();
+        ref_count = indices.size();
+        Reorder(options.layout);
+        build_cost = SAHCost();
+        return;
+    }
+
+    BuildFn build;
+    switch (builder) {
+    case BVH_BUILD_MEAN:
+        build = &BVH::BuildMean;
+        break;
+    case BVH_BUILD_LBVH:
+        SortMorton(build_prims, n_threads);
+        build = &BVH::BuildLBVH;
+        break;
+    default:
+        build = &BVH::BuildSAH;
+        break;
+    }
+
+    (this->*build)(build_prims, 0, build_prims.size(), 0, 0, n_threads, nodes);
+
+    indices.resize(build_prims.size());
+    parallel_for(0, build_prims.size(), n_threads, [&](size_t b, size_t e, int) {
+            for (size_t i = b; i < e; i++) {
+                indices[i] = build_prims[i].index;
+            }
+        });
+    ref_count = indices.size();
+
+    /* Leaves holding several objects leave much of the reserve above
+       unused */
+    nodes.shrink_to_fit();
+    Reorder(options.layout);
+    build_cost = SAHCost();
+}
+
+void BVH::OrderVEB(uint32_t first, int levels, const std::vector<int>& heights,
+                   std::vector<uint32_t>& order) const
+{
+    if (levels <= 1) {
+        order.push_back(first);
+        return;
+    }
+
+    /* The top half of the levels goes first, then each subtree
+       hanging off its bottom, each laid out the same way */
+    int top = levels / 2, bottom = levels - top;
+    OrderVEB(first, top, heights, order);
+
+    std::vector<uint32_t> frontier(1, first), next;
+    for (int level = 0; level < top; level++) {
+        next.clear();
+        for (uint32_t pair : frontier) {
+            for (uint32_t i = pair; i < pair + 2; i++) {
+                if (!nodes[i].IsLeaf()) {
+                    next.push_back(nodes[i].offset);
+                }
+            }
+        }
+        frontier.swap(next);
+    }
+
+    for (uint32_t pair : frontier) {
+        int height = 1 + std::max(heights[pair], heights[pair + 1]);
+        OrderVEB(pair, std::min(bottom, height), heights, order);
+    }
+}
+
+void BVH::OrderTreelets(std::vector<uint32_t>& order) const
+{
+    /* A pair is visited about as often as its parent, whose chance of
+       being visited is proportional to its area. Each treelet grows
+       from its root by the likeliest pair below it until it is full;
+       the pairs left over root later treelets. */
+    typedef std::pair<double, uint32_t> Candidate;
+    std::deque<Candidate> roots(1, Candidate(nodes[0].SurfaceArea(), nodes[0].offset));
+
+    while (!roots.empty()) {
+        std::priority_queue<Candidate> treelet;
+        treelet.push(roots.front());
+        roots.pop_front();
+
+        for (size_t n = 0; n < TREELET_PAIRS && !treelet.empty(); n++) {
+            uint32_t pair = treelet.top().second;
+            treelet.pop();
+            order.push_back(pair);
+
+            for (uint32_t i = pair; i < pair + 2; i++) {
+                if (!nodes[i].IsLeaf()) {
+                    treelet.push(Candidate(nodes[i].SurfaceArea(), nodes[i].offset));
+                }
+            }
+        }
+
+        while (!treelet.empty()) {
+            roots.push_back(treelet.top());
+            treelet.pop();
+        }
+    }
+}
+
+void BVH::Reorder(BVHLayout layout)
+{
+    if (layout == BVH_LAYOUT_DEPTH_FIRST || ref_count == 0 || nodes[0].IsLeaf()) {
+        return;
+    }
+
+    /* Sibling pairs, by the index of their first node, in their new
+       order */
+    std::vector<uint32_t> order;
+    order.reserve(nodes.size() / 2);
+
+    if (layout == BVH_LAYOUT_VEB) {
+        /* Children always follow their parents, so heights can be
+           filled in back to front */
+        std::vector<int> heights(nodes.size(), 0);
+        for (size_t i = nodes.size(); i-- > 0;) {
+            if (!nodes[i].IsLeaf()) {
+                uint32_t child = nodes[i].offset;
+                heights[i] = 1 + std::max(heights[child], heights[child + 1]);
+            }
+        }
+        OrderVEB(nodes[0].offset, heights[0], heights, order);
+    } else {
+        OrderTreelets(order);
+    }
+
+    assert(2 * order.size() + 1 == nodes.size());
 
-        double midpoint = 0;
-        for (auto obj : curr_node->objs) {
-            midpoint += obj->GetPos().GetValue(longest_axis);
+    /* Every order above puts a pair after its parent's pair, so the
+       root stays first and children still follow their parents */
+    std::vector<uint32_t> moved_to(nodes.size());
+    BVHNodeArray reordered(nodes.size());
+    reordered[0] = nodes[0];
+    for (size_t i = 0; i < order.size(); i++) {
+        moved_to[order[i]] = 2 * i + 1;
+        reordered[2 * i + 1] = nodes[order[i]];
+        reordered[2 * i + 2] = nodes[order[i] + 1];
+    }
+
+    for (auto& node : reordered) {
+        if (!node.IsLeaf()) {
+            node.offset = moved_to[node.offset];
         }
-        midpoint /= curr_node->objs.size();
+    }
+
+    nodes.swap(reordered);
+}
+
+BVH::BVH(const std::vector<const SceneObject*>& objs,
+         const LinearBVHNode* node_data, size_t n_nodes,
+         const uint32_t* indices, size_t n_indices) :
+    nodes(node_data, node_data + n_nodes),
+    prims(),
+    indices(indices, indices + n_indices),
+    ref_count(n_indices),
+    build_cost(0),
+    leaf_block(1),
+    leaf_fill(1)
+{
+    std::vector<const SceneObject*> leaf_objs(n_indices);
+    for (size_t i = 0; i < n_indices; i++) {
+        leaf_objs[i] = objs[indices[i]];
+    }
+    prims = PrimitiveList(leaf_objs);
+
+    build_cost = SAHCost();
+}
 
-        /* Add new child nodes */
-        nodes[right_child(curr_index)] = BVHNode();
-        nodes[left_child(curr_index)] = BVHNode();
+BVH::BVH(const LinearBVHNode* node_data, size_t n_nodes,
+         const uint32_t* indices, size_t n_indices) :
+    nodes(node_data, node_data + n_nodes),
+    prims(),
+    indices(indices, indices + n_indices),
+    ref_count(n_indices),
+    build_cost(0),
+    leaf_block(1),
+    leaf_fill(1)
+{
+    build_cost = SAHCost();
+}
 
-        while (!curr_node->objs.empty()) {
-            auto obj = curr_node->objs.back();
-            curr_node->objs.pop_back();
+void BVH::RefitNode(uint32_t index, const BVHPrimitives* source, int n_threads)
+{
+    LinearBVHNode& node = nodes[index];
 
-            if (obj->GetPos().GetValue(longest_axis) < midpoint) {
-                nodes[left_child(curr_index)].AddObject(obj);
+    if (node.IsLeaf()) {
+        Bounds leaf_bounds;
+        for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+            if (!source) {
+                leaf_bounds.Expand(Bounds(prims[i]->GetBoundingBox()));
             } else {
-                nodes[right_child(curr_index)].AddObject(obj);
+                leaf_bounds.Expand(source->GetBounds(indices.empty() ? i : indices[i]));
             }
         }
+        set_bounds(nodes, index, leaf_bounds);
+        return;
+    }
+
+    /* Sibling subtrees are disjoint, so split them between threads
+       near the root just like the builders do. */
+    uint32_t child = node.offset;
+    if (n_threads > 1) {
+        int right_threads = n_threads / 2;
+        std::thread worker(&BVH::RefitNode, this, child + 1, source, right_threads);
+        RefitNode(child, source, n_threads - right_threads);
+        worker.join();
+    } else {
+        RefitNode(child, source, 1);
+        RefitNode(child + 1, source, 1);
+    }
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        node.bounds[BE_MIN_EXTENT][axis] =
+            std::min(nodes[child].bounds[BE_MIN_EXTENT][axis],
+                     nodes[child + 1].bounds[BE_MIN_EXTENT][axis]);
+        node.bounds[BE_MAX_EXTENT][axis] =
+            std::max(nodes[child].bounds[BE_MAX_EXTENT][axis],
+                     nodes[child + 1].bounds[BE_MAX_EXTENT][axis]);
+    }
+}
+
+void BVH::Refit(int n_threads)
+{
+    if (prims.Size() == 0) {
+        return;
+    }
+
+    prims.Update();
+    RefitNode(0, nullptr, std::max(1, n_threads));
+}
 
-        node_index_stack.push_back(right_child(curr_index));
-        node_index_stack.push_back(left_child(curr_index));
+void BVH::Refit(const BVHPrimitives& source, int n_threads)
+{
+    if (ref_count == 0) {
+        return;
+    }
+
+    RefitNode(0, &source, std::max(1, n_threads));
+}
+
+void BVH::DropIndices()
+{
+    std::vector<uint32_t>().swap(indices);
+}
+
+double BVH::SAHCost() const
+{
+    double root_area = nodes[0].SurfaceArea();
+    if (ref_count == 0 || root_area <= 0) {
+        return 0;
     }
+
+    /* Each node is visited with probability proportional to its
+       area, relative to the root's. */
+    double cost = 0;
+    for (auto& node : nodes) {
+        double p = node.SurfaceArea() / root_area;
+        cost += node.IsLeaf() ? p * SAH_INTERSECT_COST * LeafBlocks(node.count)
+            : p * SAH_TRAVERSAL_COST;
+    }
+
+    return cost;
 }
 
-Intersection BVHNode::Intersects(const Ray3D& ray,
-                                 double max_dist) const
+AccelStats BVH::GetStats() const
 {
-    /* Check if we intersect the bounding box */
-    return bounding_box.Intersects(ray, max_dist);
+    AccelStats stats;
+    stats.n_nodes = nodes.size();
+    stats.n_refs = ref_count;
+    stats.bytes = nodes.size() * sizeof(LinearBVHNode)
+        + prims.Bytes()
+        + indices.size() * sizeof(uint32_t);
+    return stats;
 }
 
-BVH::BVH(std::vector<const SceneObject*>& objs) :
-    nodes(2 * objs.size())
+const char* BVH::BuilderName(BVHBuilder builder)
 {
-    /* Construct the root node of the BVH, stored at the first index
-       of the array. */
-    nodes[0] = BVHNode();
+    switch (builder) {
+    case BVH_BUILD_MEAN:
+        return "mean";
+    case BVH_BUILD_SAH:
+        return "sah";
+    case BVH_BUILD_LBVH:
+        return "lbvh";
+    case BVH_BUILD_SBVH:
+        return "sbvh";
+    default:
+        return "unknown";
+    }
+}
 
-    /* Make sure the root box contains every object */
-    for (auto obj : objs) {
-        nodes[0].AddObject(obj);
+const char* BVH::LayoutName(BVHLayout layout)
+{
+    switch (layout) {
+    case BVH_LAYOUT_DEPTH_FIRST:
+        return "dfs";
+    case BVH_LAYOUT_VEB:
+        return "veb";
+    case BVH_LAYOUT_TREELET:
+        return "treelet";
+    default:
+        return "unknown";
     }
+}
+
+bool BVH::Occluded(const Ray3D& ray, double max_dist) const
+{
+    TriangleRay tri_ray(ray);
 
-    /* Do a somewhat balanced subdivision of the root, recursively. */
-    Subdivide();
+    return TraverseAny(ray, max_dist, [&](uint32_t first, uint32_t count) {
+            for (uint32_t i = first; i < first + count; i++) {
+                if (prims.Occludes(i, ray, tri_ray, max_dist)) {
+                    return true;
+                }
+            }
+            return false;
+        });
 }
 
 SceneObjectIntersection BVH::Intersects(const Ray3D &ray, double max_dist) const
 {
-    /* This is essentially a stack holding nodes to do intersection
-       checks on. */
-    std::vector<int> to_check;
-    to_check.push_back(0);
+    PrimHit hit;
+    const SceneObject* obj = ClosestFrom(0, ray, max_dist, hit);
+    return FinalizeHit(obj, ray, hit);
+}
+
+const SceneObject* BVH::ClosestFrom(uint32_t root, const Ray3D& ray,
+                                    double max_dist, PrimHit& hit) const
+{
+    const SceneObject* closest = nullptr;
+    hit.dist = INFINITY;
 
-    size_t curr_node_index;
-    Intersection curr_intersect(nullptr, false, ray);
-    SceneObjectIntersection closest_obj_intersect(nullptr, false, ray);
-    closest_obj_intersect.dist = INFINITY;
+    TriangleRay tri_ray(ray);
 
-    while (!to_check.empty()) {
-        curr_node_index = to_check.back();
-        to_check.pop_back();
+    TraverseClosest(root, ray, max_dist, [&](uint32_t first, uint32_t count, double& max_dist) {
+            bool found = false;
+            for (uint32_t i = first; i < first + count; i++) {
+                PrimHit prim_hit;
+                if (!prims.Hit(i, ray, tri_ray, max_dist, prim_hit) || !(prim_hit.dist < hit.dist)) {
+                    continue;
+                }
 
-        if (curr_node_index >= nodes.size()) {
+                closest = prims[i];
+                hit = prim_hit;
+                max_dist = hit.dist;
+                found = true;
+            }
+            return found;
+        });
+
+    return closest;
+}
+
+void BVH::IntersectPacket(const Ray3D* rays, int n,
+                          std::vector<SceneObjectIntersection>& hits) const
+{
+    hits.clear();
+
+    /* Rays only share entry planes, and so the frustum test, when
+       their directions agree in sign */
+    int dir_neg[N_AXES];
+    bool coherent = n > 1 && n <= MAX_PACKET_SIZE && ref_count > 0;
+    bool finite = true;
+
+    PacketRays packet;
+    PacketFrustum frustum;
+    double max_dist[MAX_PACKET_SIZE];
+
+    /* Closest object hit by each ray so far, and the hit */
+    const SceneObject* closest[MAX_PACKET_SIZE];
+    PrimHit best[MAX_PACKET_SIZE];
+    TriangleRay tri_rays[MAX_PACKET_SIZE];
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        dir_neg[axis] = 0;
+        frustum.origin_lo[axis] = frustum.inv_lo[axis] = INFINITY;
+        frustum.origin_hi[axis] = frustum.inv_hi[axis] = -INFINITY;
+    }
+
+    for (int i = 0; i < MAX_PACKET_SIZE && coherent; i++) {
+        if (i >= n) {
+            for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                packet.near_origin[axis][i] = packet.far_origin[axis][i] = 0;
+                packet.inv_dir[axis][i] = 1;
+            }
+            packet.t_max[i] = -1;
             continue;
         }
 
-        auto curr_node = &nodes[curr_node_index];
+        BVHRay bvh_ray(rays[i]);
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            float o_near = bvh_ray.near_origin[axis], o_far = bvh_ray.far_origin[axis],
+                inv = bvh_ray.inv_dir[axis];
+            packet.near_origin[axis][i] = o_near;
+            packet.far_origin[axis][i] = o_far;
+            packet.inv_dir[axis][i] = inv;
 
-        Intersection curr_intersect = curr_node->Intersects(ray, max_dist);
+            if (i == 0) {
+                dir_neg[axis] = bvh_ray.dir_neg[axis];
+            } else if (dir_neg[axis] != bvh_ray.dir_neg[axis]) {
+                coherent = false;
+            }
+
+            frustum.origin_lo[axis] = std::min(frustum.origin_lo[axis], std::min(o_near, o_far));
+            frustum.origin_hi[axis] = std::max(frustum.origin_hi[axis], std::max(o_near, o_far));
+            frustum.inv_lo[axis] = std::min(frustum.inv_lo[axis], inv);
+            frustum.inv_hi[axis] = std::max(frustum.inv_hi[axis], inv);
+            finite = finite && std::isfinite(inv);
+        }
+
+        tri_rays[i] = TriangleRay(rays[i]);
+        max_dist[i] = INFINITY;
+        packet.t_max[i] = INFINITY;
+        closest[i] = nullptr;
+        best[i].dist = INFINITY;
+    }
+
+    if (!coherent) {
+        for (int i = 0; i < n; i++) {
+            hits.push_back(Intersects(rays[i], INFINITY));
+        }
+        return;
+    }
+
+    /* Nodes still to visit, with the rays that hit their parent */
+    struct StackEntry {
+        uint32_t node;
+        uint32_t active;
+    } to_check[MAX_DEPTH + 1];
+    int stack_size = 0;
 
-        /* Continue if no intersection. */
-        if (!curr_intersect.intersected) {
+    to_check[stack_size++] = {0, (1u << n) - 1};
+
+    while (stack_size > 0) {
+        StackEntry entry = to_check[--stack_size];
+        const LinearBVHNode& node = nodes[entry.node];
+
+        float t_max = -INFINITY;
+        for (int i = 0; i < n; i++) {
+            if (entry.active & (1u << i)) {
+                t_max = std::max(t_max, packet.t_max[i]);
+            }
+        }
+
+        /* Cheap rejection of nodes off to the side of the whole
+           packet; infinite reciprocals would make it NaN */
+        if (finite && !frustum_intersects(node, dir_neg, frustum, t_max)) {
+            continue;
+        }
+
+        uint32_t active = 0;
+        for (int base = 0; base < n; base += 4) {
+            active |= packet_slab_test4(node, dir_neg, packet, base) << base;
+        }
+        active &= entry.active;
+
+        if (!active) {
             continue;
         }
 
-        /* If this is a leaf node (i.e. this box references some
-           objects), check intersection with that object and add to
-           the z-buffer if successful */
-        if (!curr_node->objs.empty()) {
-            for (auto obj : curr_node->objs) {
-                auto obj_intersect = obj->Intersects(ray, max_dist);
-                if (obj_intersect.intersected &&
-                    obj_intersect.dist < closest_obj_intersect.dist) {
-                    closest_obj_intersect = obj_intersect;
+        if (!node.IsLeaf() && std::bitset<32>(active).count() <= PACKET_MIN_ACTIVE) {
+            for (int i = 0; i < n; i++) {
+                if (!(active & (1u << i))) {
+                    continue;
+                }
+
+                PrimHit hit;
+                const SceneObject* obj = ClosestFrom(entry.node, rays[i], max_dist[i], hit);
+                if (obj && hit.dist < best[i].dist) {
+                    closest[i] = obj;
+                    best[i] = hit;
+                    max_dist[i] = hit.dist;
+                    packet.t_max[i] = round_up(max_dist[i]);
                 }
             }
+            continue;
         }
 
-        to_check.push_back(left_child(curr_node_index));
-        to_check.push_back(right_child(curr_node_index));
+        if (node.IsLeaf()) {
+            for (int i = 0; i < n; i++) {
+                if (!(active & (1u << i))) {
+                    continue;
+                }
+
+                for (uint32_t j = node.offset; j < node.offset + node.count; j++) {
+                    PrimHit hit;
+                    if (prims.Hit(j, rays[i], tri_rays[i], max_dist[i], hit)
+                        && hit.dist < best[i].dist) {
+                        closest[i] = prims[j];
+                        best[i] = hit;
+                        max_dist[i] = hit.dist;
+                        packet.t_max[i] = round_up(max_dist[i]);
+                    }
+                }
+            }
+            continue;
+        }
+
+        /* Visit the child nearer along the packet's direction first:
+           push it last. Children are told apart along the axis their
+           centers are furthest apart on. */
+        uint32_t near = node.offset, far = near + 1;
+        int split_axis = AXIS_X;
+        float split_dist = -1;
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            float d = std::abs((nodes[far].bounds[BE_MIN_EXTENT][axis] +
+                                nodes[far].bounds[BE_MAX_EXTENT][axis]) -
+                               (nodes[near].bounds[BE_MIN_EXTENT][axis] +
+                                nodes[near].bounds[BE_MAX_EXTENT][axis]));
+            if (d > split_dist) {
+                split_axis = axis;
+                split_dist = d;
+            }
+        }
+
+        float near_center = nodes[near].bounds[BE_MIN_EXTENT][split_axis] +
+            nodes[near].bounds[BE_MAX_EXTENT][split_axis];
+        float far_center = nodes[far].bounds[BE_MIN_EXTENT][split_axis] +
+            nodes[far].bounds[BE_MAX_EXTENT][split_axis];
+        if ((far_center < near_center) != (bool) dir_neg[split_axis]) {
+            std::swap(near, far);
+        }
+
+        to_check[stack_size++] = {far, active};
+        to_check[stack_size++] = {near, active};
     }
 
-    return closest_obj_intersect;
+    for (int i = 0; i < n; i++) {
+        hits.push_back(FinalizeHit(closest[i], rays[i], best[i]));
+    }
 }
@@ -1,46 +1,458 @@
 #ifndef BVH_HPP_
 #define BVH_HPP_
 
-#include <queue>
+#include <cstdlib>
+#include <new>
 #include <vector>
+#include <stdint.h>
 
+#include "accelerator.hpp"
+#include "bounds.hpp"
 #include "box.hpp"
 #include "intersection.hpp"
+#include "primitive_list.hpp"
 #include "ray.hpp"
 #include "scene_object.hpp"
 
-/* The BVH here is very simple; it's just a binary tree of BVHNodes,
- * each of which reference a scene object and its bounding box. A
- * child node's bounding box is completely enclosed by its parent's
- * bounding box.
+/* The BVH is a binary tree stored as a flat array of LinearBVHNodes
+ * in depth-first order. A child node's bounding box is completely
+ * enclosed by its parent's bounding box. Leaves reference a
+ * contiguous range of the BVH's reordered object array rather than
+ * owning their objects.
  */
 
-class BVHNode {
+/* Strategies for splitting a node during construction */
+enum BVHBuilder {
+    BVH_BUILD_MEAN = 0,   /* mean centroid along the longest axis */
+    BVH_BUILD_SAH,        /* binned surface area heuristic */
+    BVH_BUILD_LBVH,       /* linear BVH over sorted Morton codes */
+    BVH_BUILD_SBVH,       /* binned SAH with spatial splits */
+    N_BVH_BUILDERS
+};
+
+/* Orders for the nodes of a finished BVH. Sibling pairs always stay
+   together and parents always come before their children. */
+enum BVHLayout {
+    BVH_LAYOUT_DEPTH_FIRST = 0, /* as built: left subtree, then right */
+    BVH_LAYOUT_VEB,             /* van Emde Boas: recursively split by height */
+    BVH_LAYOUT_TREELET,         /* page-sized clusters grown by surface area */
+    N_BVH_LAYOUTS
+};
+
+/* How to build a BVH */
+struct BVHOptions {
+    BVHBuilder builder = BVH_BUILD_SAH;
+
+    /* Threads to build with */
+    int n_threads = 1;
+
+    /* SBVH only: how many extra object references spatial splits may
+       create, as a fraction of the number of objects */
+    double max_duplication = 1.0;
+
+    /* Node order to lay the finished tree out in */
+    BVHLayout layout = BVH_LAYOUT_DEPTH_FIRST;
+
+    /* SAH builders: how many primitives the tree's owner tests at
+       once, so that a leaf costs as much as the blocks of that size
+       it takes, not as its primitives */
+    int leaf_block = 1;
+
+    /* Ranges of at most this many primitives always become leaves,
+       for owners that pay for every leaf */
+    int leaf_fill = 1;
+};
+
+/* Primitives a BVH can be built over by index, for objects that keep
+ * many primitives in their own arrays instead of as SceneObjects.
+ * Such a BVH's leaves refer to primitives only by index (GetIndices()),
+ * and whoever owns the primitives traverses it with TraverseClosest()
+ * and TraverseAny().
+ */
+class BVHPrimitives {
 public:
-    BVHNode();
+    virtual ~BVHPrimitives() {}
+
+    virtual size_t Size() const = 0;
 
-    /* Check whether the given ray intersects this node. */
-    Intersection Intersects(const Ray3D& ray,
-                            double max_dist = INFINITY) const;
+    virtual Bounds GetBounds(uint32_t i) const = 0;
 
-    std::vector<const SceneObject*> objs;
-    Box bounding_box;
+    /* Where the mean builder places primitive i: by default, the
+       center of its bounds */
+    virtual void GetPos(uint32_t i, double pos[N_AXES]) const;
 
-    void AddObject(const SceneObject*);
+    /* As SceneObject::SplitBounds, for primitive i. This default just
+       cuts its bounds in two. */
+    virtual void SplitBounds(uint32_t i, int axis, double pos,
+                             Bounds& below, Bounds& above) const;
 };
 
-class BVH {
+/* Compact traversal node. Bounds are single precision, rounded
+ * outward so they stay conservative. The two children of an interior
+ * node are always stored next to each other, at an odd index, so with
+ * BVHNodeArray's alignment a sibling pair fills exactly one 64-byte
+ * cache line. */
+struct LinearBVHNode {
+    float bounds[N_EXTENTS][N_AXES];
+
+    /* Leaves: index of the first object. Interior nodes: index of
+       the first child; the second child follows it. */
+    uint32_t offset;
+
+    /* Number of objects in a leaf; zero for interior nodes */
+    uint32_t count;
+
+    inline bool IsLeaf() const {
+        return count > 0;
+    }
+
+    inline double SurfaceArea() const {
+        double dx = bounds[BE_MAX_EXTENT][AXIS_X] - bounds[BE_MIN_EXTENT][AXIS_X],
+            dy = bounds[BE_MAX_EXTENT][AXIS_Y] - bounds[BE_MIN_EXTENT][AXIS_Y],
+            dz = bounds[BE_MAX_EXTENT][AXIS_Z] - bounds[BE_MIN_EXTENT][AXIS_Z];
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+/* Allocates arrays whose element 1, rather than element 0, starts a
+ * cache line. The root is the only node without a sibling, so this
+ * lines up every sibling pair after it with a cache line. */
+template <class T>
+struct SiblingPairAllocator {
+    typedef T value_type;
+
+    static const size_t CACHE_LINE = 64;
+    static_assert(sizeof(T) <= CACHE_LINE, "elements must fit in a cache line");
+
+    SiblingPairAllocator() {}
+
+    template <class U>
+    SiblingPairAllocator(const SiblingPairAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        void* mem;
+        if (posix_memalign(&mem, CACHE_LINE, n * sizeof(T) + CACHE_LINE) != 0) {
+            throw std::bad_alloc();
+        }
+        return reinterpret_cast<T*>(static_cast<char*>(mem) + CACHE_LINE - sizeof(T));
+    }
+
+    void deallocate(T* p, size_t) {
+        std::free(reinterpret_cast<char*>(p) - (CACHE_LINE - sizeof(T)));
+    }
+};
+
+template <class T, class U>
+inline bool operator==(const SiblingPairAllocator<T>&, const SiblingPairAllocator<U>&)
+{
+    return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const SiblingPairAllocator<T>&, const SiblingPairAllocator<U>&)
+{
+    return false;
+}
+
+typedef std::vector<LinearBVHNode, SiblingPairAllocator<LinearBVHNode> > BVHNodeArray;
+
+/* Ray data in the form the slab test wants it, computed once per
+ * traversal instead of once per box. */
+struct BVHRay {
+    BVHRay(const Ray3D& ray);
+
+    /* The origin rounded to a float both ways: near planes are
+       measured from whichever rounding can only bring them closer,
+       far planes from the other, so a ray never misses a box it
+       touches in double precision. */
+    float near_origin[N_AXES];
+    float far_origin[N_AXES];
+    float inv_dir[N_AXES];
+
+    /* Which extent is hit first along each axis */
+    int dir_neg[N_AXES];
+};
+
+class BVH : public Accelerator {
 public:
-    BVH(std::vector<const SceneObject*>& objs);
+    BVH(std::vector<const SceneObject*>& objs,
+        const BVHOptions& options = BVHOptions());
+
+    /* A tree over indexed primitives. Intersects() and Occluded()
+       don't work on it, having no objects to call; see BVHPrimitives. */
+    BVH(const BVHPrimitives& source, const BVHOptions& options = BVHOptions());
+
+    /* Adopt a tree built earlier, e.g. read back from a cache: nodes
+       as GetNodes() had them, and indices as GetIndices() had them.
+       The data must describe a valid tree. */
+    BVH(const std::vector<const SceneObject*>& objs,
+        const LinearBVHNode* node_data, size_t n_nodes,
+        const uint32_t* indices, size_t n_indices);
+    BVH(const LinearBVHNode* node_data, size_t n_nodes,
+        const uint32_t* indices, size_t n_indices);
 
     /* Get a record of closest object intersected by the given ray */
-    SceneObjectIntersection Intersects(const Ray3D& ray, double max_dist) const;
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    virtual bool Occluded(const Ray3D& ray, double max_dist) const override;
+
+    /* Rays sharing the sign of each direction component are traced
+       as one packet: a node is first tested against the bounding
+       frustum of the packet, then against each ray still active, four
+       at a time. Subtrees that only a few rays reach are traced one
+       ray at a time, as are packets that aren't coherent at all. */
+    virtual void IntersectPacket(const Ray3D* rays, int n,
+                                 std::vector<SceneObjectIntersection>& hits) const override;
+
+    virtual AccelStats GetStats() const override;
+
+    /* Closest object hit by the ray, with the hit for its Finalize();
+       null if nothing is hit. For BVHs nested inside other objects. */
+    inline const SceneObject* ClosestHit(const Ray3D& ray, double max_dist,
+                                         PrimHit& hit) const {
+        return ClosestFrom(0, ray, max_dist, hit);
+    }
+
+    /* Human-readable name of a builder, e.g. for command line flags */
+    static const char* BuilderName(BVHBuilder builder);
+
+    static const char* LayoutName(BVHLayout layout);
+
+    /* Raw tree data, e.g. for collapsing into wider trees */
+    inline const BVHNodeArray& GetNodes() const {
+        return nodes;
+    }
+
+    inline const std::vector<const SceneObject*>& GetObjects() const {
+        return prims.GetObjects();
+    }
+
+    inline const PrimitiveList& GetPrimitives() const {
+        return prims;
+    }
+
+    /* For each object reference of the leaves, the index of the
+       object or primitive in the list the tree was built over. Empty
+       once DropIndices() is called. */
+    inline const std::vector<uint32_t>& GetIndices() const {
+        return indices;
+    }
+
+    /* Number of object or primitive references in the leaves */
+    inline size_t NumRefs() const {
+        return ref_count;
+    }
+
+    /* For a tree over indexed primitives whose owner has since put
+       them in reference order, so reference i is to primitive i: free
+       GetIndices(), which would map each to itself. The tree can't be
+       cached after this. */
+    void DropIndices();
+
+    /* Visit the leaves the ray reaches before max_dist, nearest first.
+       leaf(first, count, max_dist) tests the primitives GetIndices()
+       [first] to [first + count - 1] and, if one is hit closer than
+       max_dist, records the hit, lowers max_dist to it and returns
+       true. Returns whether leaf ever did. Defined in
+       bvh_traversal.hpp. */
+    template <class LeafFn>
+    bool TraverseClosest(uint32_t root, const Ray3D& ray, double max_dist,
+                         LeafFn leaf) const;
+
+    /* Whether leaf(first, count) holds for any leaf the ray reaches
+       before max_dist, stopping at the first that does */
+    template <class LeafFn>
+    bool TraverseAny(const Ray3D& ray, double max_dist, LeafFn leaf) const;
+
+    /* Recompute every node's bounds bottom-up from the objects'
+       current bounding boxes, keeping the tree's topology. This is
+       linear in the size of the tree, for animations where objects
+       move but are neither added nor removed. Trees over indexed
+       primitives are left alone. */
+    void Refit(int n_threads = 1);
+
+    /* The same for a tree over indexed primitives, from the current
+       bounds of the primitives in source, numbered as they were when
+       the tree was built, or by reference once the indices are
+       dropped */
+    void Refit(const BVHPrimitives& source, int n_threads = 1);
+
+    /* Expected cost of tracing a ray through the tree according to
+       the surface area heuristic, in primitive intersection tests */
+    double SAHCost() const;
+
+    /* SAHCost() as of the last full build */
+    inline double GetBuildCost() const {
+        return build_cost;
+    }
+
+    /* Refitting lets boxes grow and overlap; once the cost has grown
+       by this factor over a fresh build, it's time to rebuild. */
+    static constexpr double REFIT_MAX_COST_RATIO = 1.5;
+
+    /* Whether refitting has degraded the tree that far */
+    inline bool NeedsRebuild() const {
+        return SAHCost() > build_cost * REFIT_MAX_COST_RATIO;
+    }
+
+    /* Builders never produce trees deeper than this, so traversal
+       can use a fixed-size stack. */
+    static const int MAX_DEPTH = 64;
 
 private:
     static const int MAX_OBJS = 10;
 
-    void Subdivide();
-    std::vector<BVHNode> nodes;
+    /* Binned SAH parameters. Costs are relative to one primitive
+       intersection test. */
+    static const int SAH_BINS = 16;
+    static const int SAH_MAX_LEAF_OBJS = 4;
+    static constexpr double SAH_TRAVERSAL_COST = 0.125;
+    static constexpr double SAH_INTERSECT_COST = 1.0;
+
+    /* LBVH ranges at most this big become leaves */
+    static const int LBVH_MAX_LEAF_OBJS = 4;
+
+    /* Nodes with fewer objects than this are built on one thread */
+    static const size_t PARALLEL_MIN_OBJS = 4096;
+
+    /* Spatial splits are only tried when the children of the best
+       object split overlap by more than this fraction of the root's
+       area (the SBVH paper's alpha). */
+    static constexpr double SBVH_MIN_OVERLAP = 1e-5;
+
+    /* Per-object data cached while building */
+    struct BuildPrimitive {
+        uint32_t index;
+        Bounds bounds;
+        double centroid[N_AXES];
+
+        /* Morton code of the centroid; only used by the LBVH */
+        uint64_t code;
+    };
+
+    /* Cheapest split plane found for a node. cost is the sum over
+       both sides of surface area times LeafBlocks() of the object
+       count. */
+    struct Split {
+        double cost = INFINITY;
+        int axis = -1;
+
+        /* Object splits: the plane lies before this centroid bin.
+           Spatial splits: the plane's position. */
+        int bin = -1;
+        double pos = 0;
+
+        Bounds left, right;
+        size_t left_count = 0, right_count = 0;
+    };
+
+    /* Blocks of leaf_block primitives that n primitives take */
+    inline size_t LeafBlocks(size_t n) const {
+        return (n + leaf_block - 1) / leaf_block;
+    }
+
+    /* Binned object split of prims[start, end) */
+    Split FindObjectSplit(const std::vector<BuildPrimitive>& prims,
+                          size_t start, size_t end,
+                          const Bounds& centroid_bounds, int n_threads) const;
+
+    /* Binned spatial split of refs, clipping them against the planes */
+    Split FindSpatialSplit(const BVHPrimitives& source,
+                           const std::vector<BuildPrimitive>& refs,
+                           const Bounds& node_bounds) const;
+
+    typedef void (BVH::*BuildFn)(std::vector<BuildPrimitive>& prims,
+                                 size_t start, size_t end,
+                                 uint32_t index, int depth, int n_threads,
+                                 BVHNodeArray& out);
+
+    /* Build the subtree over prims[start, end) into out[index] using
+       up to n_threads threads */
+    void BuildMean(std::vector<BuildPrimitive>& prims,
+                   size_t start, size_t end,
+                   uint32_t index, int depth, int n_threads,
+                   BVHNodeArray& out);
+    void BuildSAH(std::vector<BuildPrimitive>& prims,
+                  size_t start, size_t end,
+                  uint32_t index, int depth, int n_threads,
+                  BVHNodeArray& out);
+    void BuildLBVH(std::vector<BuildPrimitive>& prims,
+                   size_t start, size_t end,
+                   uint32_t index, int depth, int n_threads,
+                   BVHNodeArray& out);
+
+    /* Build out[index] from refs, which it consumes, appending leaf
+       objects to indices. Spatial splits may only grow the total
+       number of references, n_refs, up to max_refs. */
+    void BuildSBVH(const BVHPrimitives& source,
+                   std::vector<BuildPrimitive>& refs,
+                   uint32_t index, int depth,
+                   double root_area, size_t& n_refs, size_t max_refs,
+                   BVHNodeArray& out);
+
+    /* Build the tree over source into nodes and indices */
+    void Build(const BVHPrimitives& source, const BVHOptions& options);
+
+    /* Subtrees that at most this many rays of a packet reach are
+       traced one ray at a time */
+    static const int PACKET_MIN_ACTIVE = 2;
+
+    /* Closest object hit by ray within the subtree rooted at
+       nodes[root], and the hit; null if there is none */
+    const SceneObject* ClosestFrom(uint32_t root, const Ray3D& ray,
+                                   double max_dist, PrimHit& hit) const;
+
+    /* Treelet layout: sibling pairs per cluster, so a cluster fills
+       a 4 KB page */
+    static const size_t TREELET_PAIRS = 4096 / (2 * sizeof(LinearBVHNode));
+
+    /* Append to order, in van Emde Boas order, the first levels
+       levels of sibling pairs of the subtree whose top pair starts at
+       nodes[first]. heights holds each node's height in pairs. */
+    void OrderVEB(uint32_t first, int levels, const std::vector<int>& heights,
+                  std::vector<uint32_t>& order) const;
+
+    /* Append the sibling pairs to order in treelet order */
+    void OrderTreelets(std::vector<uint32_t>& order) const;
+
+    /* Move the nodes into the given layout */
+    void Reorder(BVHLayout layout);
+
+    /* Refit the subtree rooted at nodes[index], from source if given
+       and from the objects otherwise */
+    void RefitNode(uint32_t index, const BVHPrimitives* source, int n_threads);
+
+    /* Compute Morton codes and sort prims by them, for the LBVH */
+    void SortMorton(std::vector<BuildPrimitive>& prims, int n_threads);
+
+    /* Give out[index] children built from prims[start, split) and
+       prims[split, end), handing the second one to another thread if
+       there are threads to spare */
+    void BuildChildren(BuildFn build, std::vector<BuildPrimitive>& prims,
+                       size_t start, size_t split, size_t end,
+                       uint32_t index, int depth, int n_threads,
+                       BVHNodeArray& out);
+
+    BVHNodeArray nodes;
+
+    /* Objects reordered so each leaf's objects are contiguous. With
+       spatial splits an object can appear in several leaves, so this
+       may be longer than the object list the tree was built from.
+       Empty for trees over indexed primitives. */
+    PrimitiveList prims;
+
+    /* The same references, as indices into the list of objects or
+       primitives the tree was built over */
+    std::vector<uint32_t> indices;
+    size_t ref_count;
+
+    double build_cost;
+
+    /* BVHOptions::leaf_block and leaf_fill of the build */
+    size_t leaf_block, leaf_fill;
 };
 
 #endif
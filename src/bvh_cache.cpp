@@ -0,0 +1,231 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bvh.hpp"
+#include "bvh_cache.hpp"
+#include "helper.hpp"
+
+/* Bump the last character whenever the layout changes */
+static const char CACHE_MAGIC[8] = {'P', 'T', 'B', 'V', 'H', 0, 0, '1'};
+
+BVHCache::BVHCache(const std::string& path, uint64_t key) :
+    path(path),
+    key(key),
+    data(nullptr),
+    size(0),
+    n_pending(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size = st.st_size;
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = nullptr;
+            size = 0;
+        }
+    }
+    close(fd);
+
+    if (data) {
+        Parse();
+    }
+}
+
+BVHCache::~BVHCache()
+{
+    if (data) {
+        munmap(data, size);
+    }
+}
+
+uint64_t BVHCache::Key(uint64_t geometry_hash, const BVHOptions& options)
+{
+    /* The thread count doesn't change the tree */
+    uint64_t h = fnv1a(&geometry_hash, sizeof(geometry_hash));
+    h = fnv1a(&options.builder, sizeof(options.builder), h);
+    h = fnv1a(&options.max_duplication, sizeof(options.max_duplication), h);
+    return fnv1a(&options.layout, sizeof(options.layout), h);
+}
+
+void BVHCache::Parse()
+{
+    const char* bytes = static_cast<const char*>(data);
+    size_t pos = sizeof(Header);
+
+    Header header;
+    if (size < pos) {
+        return;
+    }
+    std::memcpy(&header, bytes, sizeof(header));
+
+    if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        header.key != key ||
+        header.node_size != sizeof(LinearBVHNode)) {
+        return;
+    }
+
+    std::vector<Tree> found;
+    for (uint32_t i = 0; i < header.n_trees; i++) {
+        Tree tree;
+        if (size - pos < sizeof(TreeHeader)) {
+            return;
+        }
+        std::memcpy(&tree.header, bytes + pos, sizeof(TreeHeader));
+        pos += sizeof(TreeHeader);
+
+        /* Everything is a multiple of four bytes long and the mapping
+           is page aligned, so the arrays can be used in place. */
+        size_t node_bytes = (size_t) tree.header.n_nodes * sizeof(LinearBVHNode),
+            index_bytes = (size_t) tree.header.n_indices * sizeof(uint32_t);
+        if (tree.header.n_nodes == 0 || size - pos < node_bytes + index_bytes) {
+            return;
+        }
+
+        tree.nodes = reinterpret_cast<const LinearBVHNode*>(bytes + pos);
+        tree.indices = reinterpret_cast<const uint32_t*>(bytes + pos + node_bytes);
+        pos += node_bytes + index_bytes;
+        found.push_back(tree);
+    }
+
+    trees.swap(found);
+}
+
+bool BVHCache::Valid(size_t i, size_t n_prims) const
+{
+    if (i >= trees.size()) {
+        return false;
+    }
+
+    /* The key should rule out a mismatch, but a bad file must not
+       send traversal off the end of an array or around in circles */
+    const Tree& tree = trees[i];
+    if (tree.header.n_indices == 0 && tree.header.n_nodes != 1) {
+        return false;
+    }
+
+    /* Empty trees are a lone empty leaf, which looks like an interior
+       node but is never entered */
+    for (uint32_t n = tree.header.n_indices == 0 ? 1 : 0; n < tree.header.n_nodes; n++) {
+        const LinearBVHNode& node = tree.nodes[n];
+        if (node.IsLeaf() ?
+            (uint64_t) node.offset + node.count > tree.header.n_indices :
+            node.offset <= n || (uint64_t) node.offset + 1 >= tree.header.n_nodes) {
+            return false;
+        }
+    }
+
+    /* Traversal stacks are only as deep as the builders' trees, and
+       refitting and collapsing recurse, so the nodes must also form a
+       single tree no deeper than that. Children come after their
+       parent, so one pass in order sees every parent before its
+       children. */
+    std::vector<int> depth(tree.header.n_nodes, -1);
+    depth[0] = 0;
+    for (uint32_t n = 0; tree.header.n_indices > 0 && n < tree.header.n_nodes; n++) {
+        const LinearBVHNode& node = tree.nodes[n];
+        if (depth[n] < 0) {
+            return false;
+        }
+        if (node.IsLeaf()) {
+            continue;
+        }
+
+        for (uint32_t child = node.offset; child < node.offset + 2; child++) {
+            if (depth[child] >= 0 || depth[n] + 1 > BVH::MAX_DEPTH - 1) {
+                return false;
+            }
+            depth[child] = depth[n] + 1;
+        }
+    }
+
+    for (uint32_t n = 0; n < tree.header.n_indices; n++) {
+        if (tree.indices[n] >= n_prims) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+BVH* BVHCache::Load(size_t i, const std::vector<const SceneObject*>& objs) const
+{
+    if (!Valid(i, objs.size())) {
+        return nullptr;
+    }
+
+    const Tree& tree = trees[i];
+    return new BVH(objs, tree.nodes, tree.header.n_nodes,
+                   tree.indices, tree.header.n_indices);
+}
+
+BVH* BVHCache::Load(size_t i, size_t n_prims) const
+{
+    if (!Valid(i, n_prims)) {
+        return nullptr;
+    }
+
+    const Tree& tree = trees[i];
+    return new BVH(tree.nodes, tree.header.n_nodes,
+                   tree.indices, tree.header.n_indices);
+}
+
+void BVHCache::Add(const BVH& bvh)
+{
+    const BVHNodeArray& nodes = bvh.GetNodes();
+    const std::vector<uint32_t>& indices = bvh.GetIndices();
+    assert(indices.size() == bvh.NumRefs());
+
+    TreeHeader tree_header;
+    tree_header.n_nodes = nodes.size();
+    tree_header.n_indices = indices.size();
+
+    const char* header_bytes = reinterpret_cast<const char*>(&tree_header);
+    const char* node_bytes = reinterpret_cast<const char*>(nodes.data());
+    const char* index_bytes = reinterpret_cast<const char*>(indices.data());
+    pending.insert(pending.end(), header_bytes, header_bytes + sizeof(tree_header));
+    pending.insert(pending.end(), node_bytes,
+                   node_bytes + nodes.size() * sizeof(LinearBVHNode));
+    pending.insert(pending.end(), index_bytes,
+                   index_bytes + indices.size() * sizeof(uint32_t));
+
+    n_pending++;
+}
+
+bool BVHCache::Write()
+{
+    Header header;
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.key = key;
+    header.node_size = sizeof(LinearBVHNode);
+    header.n_trees = n_pending;
+
+    /* Write next to the file and move it into place, so a reader never
+       sees half a cache */
+    std::string tmp_path = path + ".tmp";
+    FILE* f = std::fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1 &&
+        std::fwrite(pending.data(), 1, pending.size(), f) == pending.size();
+    ok = std::fclose(f) == 0 && ok;
+
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
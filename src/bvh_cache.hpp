@@ -0,0 +1,88 @@
+#ifndef BVH_CACHE_HPP_
+#define BVH_CACHE_HPP_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "bvh.hpp"
+#include "scene_object.hpp"
+
+/* A file of prebuilt BVHs, so static scenes that are rendered over and
+ * over don't pay for building the same trees every time. The file holds
+ * each tree's nodes and, for each of its object references, the index
+ * of the object in the list the tree was built over. It is tagged with
+ * a key derived from the scene's geometry and the build options, and
+ * is ignored when the key doesn't match.
+ */
+class BVHCache {
+public:
+    /* Map the cache file at path, if there is one */
+    BVHCache(const std::string& path, uint64_t key);
+    ~BVHCache();
+
+    /* Key for a scene with the given geometry hash built with the
+       given options */
+    static uint64_t Key(uint64_t geometry_hash, const BVHOptions& options);
+
+    /* Number of trees in the file; zero if it is missing, damaged or
+       was written for another key */
+    inline size_t Size() const {
+        return trees.size();
+    }
+
+    /* Tree i over objs, or nullptr if it doesn't fit them */
+    BVH* Load(size_t i, const std::vector<const SceneObject*>& objs) const;
+
+    /* Tree i over n_prims indexed primitives, or nullptr if it doesn't
+       fit them */
+    BVH* Load(size_t i, size_t n_prims) const;
+
+    /* Queue a tree to be written */
+    void Add(const BVH& bvh);
+
+    /* Replace the file with the trees added so far, in the order they
+       were added. Returns false if it couldn't be written. */
+    bool Write();
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t key;
+        uint32_t node_size;
+        uint32_t n_trees;
+    };
+
+    struct TreeHeader {
+        uint32_t n_nodes;
+        uint32_t n_indices;
+    };
+
+    /* A tree in the mapped file */
+    struct Tree {
+        const LinearBVHNode* nodes;
+        const uint32_t* indices;
+        TreeHeader header;
+    };
+
+    /* Read the tree table of the mapped file, leaving it empty if the
+       file is no good */
+    void Parse();
+
+    /* Whether tree i is well formed and refers to at most n_prims
+       objects or primitives */
+    bool Valid(size_t i, size_t n_prims) const;
+
+    std::string path;
+    uint64_t key;
+
+    void* data;
+    size_t size;
+    std::vector<Tree> trees;
+
+    /* Serialized trees waiting to be written */
+    std::vector<char> pending;
+    uint32_t n_pending;
+};
+
+#endif
@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+#include <utility>
+
+#include "bounds.hpp"
+#include "bvh.hpp"
+#include "bvh_report.hpp"
+
+/* A node's box as plain bounds */
+static Bounds node_bounds(const LinearBVHNode& node)
+{
+    Bounds b;
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        b.lo[axis] = node.bounds[BE_MIN_EXTENT][axis];
+        b.hi[axis] = node.bounds[BE_MAX_EXTENT][axis];
+    }
+    return b;
+}
+
+BVHReport::BVHReport(const BVH& bvh) :
+    n_nodes(bvh.GetNodes().size()),
+    n_leaves(0),
+    n_empty_leaves(0),
+    n_unused_slots(bvh.GetNodes().capacity() - bvh.GetNodes().size()),
+    n_refs(bvh.NumRefs()),
+    n_objects(0),
+    mean_leaf_depth(0),
+    sah_cost(bvh.SAHCost()),
+    overlap_ratio(0)
+{
+    const BVHNodeArray& nodes = bvh.GetNodes();
+    const std::vector<const SceneObject*>& objs = bvh.GetObjects();
+    const std::vector<uint32_t>& indices = bvh.GetIndices();
+
+    /* A tree without indices refers to each primitive once, in order */
+    n_objects = indices.empty() ? n_refs :
+        std::unordered_set<uint32_t>(indices.begin(), indices.end()).size();
+
+    bytes = bvh.GetStats().bytes;
+    unused_bytes = n_unused_slots * sizeof(LinearBVHNode)
+        + (objs.capacity() - objs.size()) * sizeof(const SceneObject*)
+        + (indices.capacity() - indices.size()) * sizeof(uint32_t);
+
+    double overlap_area = 0, parent_area = 0;
+    size_t depth_sum = 0;
+
+    /* The empty tree's root is an interior-looking node with no
+       children */
+    if (n_refs == 0) {
+        n_leaves = n_empty_leaves = 1;
+        leaf_sizes.assign(1, 1);
+        leaf_depths.assign(1, 1);
+        return;
+    }
+
+    std::vector<std::pair<uint32_t, int> > to_check(1, std::make_pair(0, 0));
+    while (!to_check.empty()) {
+        uint32_t index = to_check.back().first;
+        int depth = to_check.back().second;
+        to_check.pop_back();
+
+        const LinearBVHNode& node = nodes[index];
+        if (node.IsLeaf()) {
+            n_leaves++;
+            depth_sum += depth;
+
+            if (leaf_sizes.size() <= node.count) {
+                leaf_sizes.resize(node.count + 1);
+            }
+            leaf_sizes[node.count]++;
+
+            if (leaf_depths.size() <= (size_t) depth) {
+                leaf_depths.resize(depth + 1);
+            }
+            leaf_depths[depth]++;
+            continue;
+        }
+
+        Bounds overlap = node_bounds(nodes[node.offset]);
+        overlap.Intersect(node_bounds(nodes[node.offset + 1]));
+        overlap_area += overlap.SurfaceArea();
+        parent_area += node.SurfaceArea();
+
+        to_check.push_back(std::make_pair(node.offset, depth + 1));
+        to_check.push_back(std::make_pair(node.offset + 1, depth + 1));
+    }
+
+    mean_leaf_depth = n_leaves > 0 ? (double) depth_sum / n_leaves : 0;
+    overlap_ratio = parent_area > 0 ? overlap_area / parent_area : 0;
+}
+
+/* Print hist as "k: count" lines, skipping zero counts */
+static void print_histogram(FILE* f, const char* title,
+                            const std::vector<size_t>& hist)
+{
+    std::fprintf(f, "  %s:\n", title);
+    size_t max_count = *std::max_element(hist.begin(), hist.end());
+
+    for (size_t k = 0; k < hist.size(); k++) {
+        if (hist[k] == 0) {
+            continue;
+        }
+
+        /* Bars are scaled to 40 columns */
+        int bar = max_count > 0 ? (int) (40.0 * hist[k] / max_count + 0.5) : 0;
+        std::fprintf(f, "    %4zu: %10zu %s\n", k, hist[k], std::string(bar, '#').c_str());
+    }
+}
+
+void BVHReport::PrintText(FILE* f) const
+{
+    std::fprintf(f, "BVH report:\n");
+    std::fprintf(f, "  nodes:            %zu (%zu leaves, %zu empty)\n",
+                 n_nodes, n_leaves, n_empty_leaves);
+    std::fprintf(f, "  unused slots:     %zu\n", n_unused_slots);
+    std::fprintf(f, "  references:       %zu to %zu objects\n", n_refs, n_objects);
+    std::fprintf(f, "  leaf depth:       %.2lf mean, %zu max\n",
+                 mean_leaf_depth, leaf_depths.size() - 1);
+    std::fprintf(f, "  SAH cost:         %.3lf\n", sah_cost);
+    std::fprintf(f, "  sibling overlap:  %.4lf\n", overlap_ratio);
+    std::fprintf(f, "  memory:           %.2lf MB (%.2lf MB allocated but unused)\n",
+                 bytes / 1048576.0, unused_bytes / 1048576.0);
+    print_histogram(f, "objects per leaf", leaf_sizes);
+    print_histogram(f, "leaves per depth", leaf_depths);
+}
+
+static void print_json_array(FILE* f, const std::vector<size_t>& values)
+{
+    std::fprintf(f, "[");
+    for (size_t i = 0; i < values.size(); i++) {
+        std::fprintf(f, "%s%zu", i > 0 ? ", " : "", values[i]);
+    }
+    std::fprintf(f, "]");
+}
+
+void BVHReport::PrintJSON(FILE* f, int indent) const
+{
+    int in = indent + 2;
+    std::fprintf(f, "{\n");
+    std::fprintf(f, "%*s\"nodes\": %zu,\n", in, "", n_nodes);
+    std::fprintf(f, "%*s\"leaves\": %zu,\n", in, "", n_leaves);
+    std::fprintf(f, "%*s\"empty_leaves\": %zu,\n", in, "", n_empty_leaves);
+    std::fprintf(f, "%*s\"unused_slots\": %zu,\n", in, "", n_unused_slots);
+    std::fprintf(f, "%*s\"references\": %zu,\n", in, "", n_refs);
+    std::fprintf(f, "%*s\"objects\": %zu,\n", in, "", n_objects);
+    std::fprintf(f, "%*s\"mean_leaf_depth\": %.6lf,\n", in, "", mean_leaf_depth);
+    std::fprintf(f, "%*s\"sah_cost\": %.6lf,\n", in, "", sah_cost);
+    std::fprintf(f, "%*s\"overlap_ratio\": %.6lf,\n", in, "", overlap_ratio);
+    std::fprintf(f, "%*s\"bytes\": %zu,\n", in, "", bytes);
+    std::fprintf(f, "%*s\"unused_bytes\": %zu,\n", in, "", unused_bytes);
+    std::fprintf(f, "%*s\"leaf_size_histogram\": ", in, "");
+    print_json_array(f, leaf_sizes);
+    std::fprintf(f, ",\n%*s\"leaf_depth_histogram\": ", in, "");
+    print_json_array(f, leaf_depths);
+    std::fprintf(f, "\n%*s}", indent, "");
+}
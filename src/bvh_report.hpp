@@ -0,0 +1,58 @@
+#ifndef BVH_REPORT_HPP_
+#define BVH_REPORT_HPP_
+
+#include <cstdio>
+#include <vector>
+#include <stddef.h>
+
+#include "bvh.hpp"
+
+/* Statistics describing the shape and expected quality of a BVH, for
+ * telling whether a slow render is the tree's fault and for comparing
+ * builders on the same scene.
+ */
+struct BVHReport {
+    explicit BVHReport(const BVH& bvh);
+
+    size_t n_nodes;
+    size_t n_leaves;
+
+    /* Leaves without objects; only the root of an empty tree should
+       be one */
+    size_t n_empty_leaves;
+
+    /* Node slots allocated but not holding a node */
+    size_t n_unused_slots;
+
+    /* Object references in leaves, and distinct objects among them */
+    size_t n_refs;
+    size_t n_objects;
+
+    /* leaf_sizes[k] leaves hold k objects; leaf_depths[d] leaves are
+       d levels below the root */
+    std::vector<size_t> leaf_sizes;
+    std::vector<size_t> leaf_depths;
+    double mean_leaf_depth;
+
+    /* Expected cost per ray, in primitive intersection tests */
+    double sah_cost;
+
+    /* Surface area of the overlap of each pair of siblings, summed
+       over the tree and divided by the summed area of their parents.
+       Zero means siblings never overlap. */
+    double overlap_ratio;
+
+    /* Memory held by nodes and object references, and how much of it
+       is allocated but unused */
+    size_t bytes;
+    size_t unused_bytes;
+
+    void PrintText(FILE* f) const;
+
+    /* Print the report as a JSON object, its lines but the first
+       indented by indent spaces, without a newline after it, so it
+       can be nested in another */
+    void PrintJSON(FILE* f, int indent = 0) const;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef BVH_TRAVERSAL_HPP_
+#define BVH_TRAVERSAL_HPP_
+
+#include <utility>
+
+#include "bvh.hpp"
+#include "slab_test.hpp"
+
+/* The scalar traversals, as templates over what a leaf's primitives
+   are so BVH's own objects and indexed primitives share them */
+
+template <class LeafFn>
+bool BVH::TraverseClosest(uint32_t root, const Ray3D& ray, double max_dist,
+                          LeafFn leaf) const
+{
+    bool found = false;
+
+    BVHRay bvh_ray(ray);
+    float t_max = round_up(max_dist), t_entry;
+
+    if (!node_intersects(nodes[root], bvh_ray, t_max, &t_entry)) {
+        return found;
+    }
+
+    /* Far children still to visit, along with where the ray enters
+       them so they can be skipped once something closer is hit. */
+    struct StackEntry {
+        uint32_t node;
+        float t_entry;
+    } to_check[MAX_DEPTH];
+    int stack_size = 0;
+
+    uint32_t curr_node_index = root;
+
+    while (true) {
+        const LinearBVHNode& curr_node = nodes[curr_node_index];
+
+        if (curr_node.IsLeaf()) {
+            if (leaf(curr_node.offset, curr_node.count, max_dist)) {
+                /* Nothing further away than this can matter now */
+                found = true;
+                t_max = round_up(max_dist);
+            }
+        } else {
+            /* Visit the nearer child first and defer the other */
+            uint32_t left = curr_node.offset, right = left + 1;
+            float t_left, t_right;
+            bool hit_left = node_intersects(nodes[left], bvh_ray, t_max, &t_left),
+                hit_right = node_intersects(nodes[right], bvh_ray, t_max, &t_right);
+
+            if (hit_left && hit_right) {
+                if (t_right < t_left) {
+                    std::swap(left, right);
+                    std::swap(t_left, t_right);
+                }
+
+                to_check[stack_size].node = right;
+                to_check[stack_size].t_entry = t_right;
+                stack_size++;
+                curr_node_index = left;
+                continue;
+            } else if (hit_left) {
+                curr_node_index = left;
+                continue;
+            } else if (hit_right) {
+                curr_node_index = right;
+                continue;
+            }
+        }
+
+        /* Pop the next node that could still hold a closer hit */
+        do {
+            if (stack_size == 0) {
+                return found;
+            }
+            stack_size--;
+        } while (to_check[stack_size].t_entry > t_max);
+
+        curr_node_index = to_check[stack_size].node;
+    }
+}
+
+template <class LeafFn>
+bool BVH::TraverseAny(const Ray3D& ray, double max_dist, LeafFn leaf) const
+{
+    BVHRay bvh_ray(ray);
+    float t_max = round_up(max_dist), t_entry;
+
+    /* Any hit will do, so there's no need to order the children or to
+       remember where the ray enters them. */
+    uint32_t to_check[MAX_DEPTH];
+    int stack_size = 0;
+
+    to_check[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        const LinearBVHNode& node = nodes[to_check[--stack_size]];
+
+        if (!node_intersects(node, bvh_ray, t_max, &t_entry)) {
+            continue;
+        }
+
+        if (node.IsLeaf()) {
+            if (leaf(node.offset, node.count)) {
+                return true;
+            }
+        } else {
+            to_check[stack_size++] = node.offset + 1;
+            to_check[stack_size++] = node.offset;
+        }
+    }
+
+    return false;
+}
+
+#endif
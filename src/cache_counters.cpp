@@ -0,0 +1,136 @@
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "cache_counters.hpp"
+
+#if defined(__linux__)
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    /* This process and its future threads, on any CPU */
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cache_config(uint64_t cache, uint64_t result)
+{
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+#endif
+
+CacheCounters::CacheCounters()
+{
+    for (int i = 0; i < N_CACHE_EVENTS; i++) {
+        fds[i] = -1;
+        counts[i] = 0;
+    }
+}
+
+CacheCounters::~CacheCounters()
+{
+#if defined(__linux__)
+    for (int i = 0; i < N_CACHE_EVENTS; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+#endif
+}
+
+bool CacheCounters::Start()
+{
+    bool any = false;
+
+#if defined(__linux__)
+    /* The L2 has no generic event, so besides the L1 there is only the
+       last level cache */
+    fds[CC_L1D_ACCESSES] = open_counter(PERF_TYPE_HW_CACHE,
+        cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS));
+    fds[CC_L1D_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+        cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS));
+    fds[CC_LLC_ACCESSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+    fds[CC_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    for (int i = 0; i < N_CACHE_EVENTS; i++) {
+        counts[i] = 0;
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+            any = true;
+        }
+    }
+#endif
+
+    return any;
+}
+
+void CacheCounters::Stop()
+{
+#if defined(__linux__)
+    for (int i = 0; i < N_CACHE_EVENTS; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) {
+            counts[i] = 0;
+        }
+    }
+#endif
+}
+
+void CacheCounters::Print(FILE* f) const
+{
+    for (int i = 0; i < N_CACHE_EVENTS; i++) {
+        if (Available((Event) i)) {
+            std::fprintf(f, "%-14s %llu\n", EventName((Event) i),
+                         (unsigned long long) counts[i]);
+        }
+    }
+
+    const struct {
+        const char* name;
+        Event accesses, misses;
+    } rates[] = {
+        {"L1D miss rate", CC_L1D_ACCESSES, CC_L1D_MISSES},
+        {"LLC miss rate", CC_LLC_ACCESSES, CC_LLC_MISSES},
+    };
+
+    for (auto& rate : rates) {
+        if (Available(rate.accesses) && Available(rate.misses) && counts[rate.accesses] > 0) {
+            std::fprintf(f, "%-14s %.2f%%\n", rate.name,
+                         100.0 * counts[rate.misses] / counts[rate.accesses]);
+        }
+    }
+}
+
+const char* CacheCounters::EventName(Event event)
+{
+    switch (event) {
+    case CC_L1D_ACCESSES:
+        return "L1D reads";
+    case CC_L1D_MISSES:
+        return "L1D misses";
+    case CC_LLC_ACCESSES:
+        return "LLC references";
+    case CC_LLC_MISSES:
+        return "LLC misses";
+    default:
+        return "unknown";
+    }
+}
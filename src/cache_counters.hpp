@@ -0,0 +1,55 @@
+#ifndef CACHE_COUNTERS_HPP_
+#define CACHE_COUNTERS_HPP_
+
+#include <cstdio>
+#include <stdint.h>
+
+/* Hardware counts of cache accesses and misses made by this process
+ * between Start() and Stop(), including threads started in between,
+ * read through Linux's perf_event_open. Counters the CPU, kernel or
+ * permissions don't allow are left out; elsewhere nothing is counted.
+ */
+class CacheCounters {
+public:
+    enum Event {
+        CC_L1D_ACCESSES = 0,  /* level 1 data cache reads */
+        CC_L1D_MISSES,
+        CC_LLC_ACCESSES,      /* last level cache references */
+        CC_LLC_MISSES,
+        N_CACHE_EVENTS
+    };
+
+    CacheCounters();
+    ~CacheCounters();
+
+    CacheCounters(const CacheCounters&) = delete;
+    CacheCounters& operator=(const CacheCounters&) = delete;
+
+    /* Start counting; false if no counter could be opened */
+    bool Start();
+
+    /* Stop counting. Threads started since Start() should have been
+       joined, so their counts are included. */
+    void Stop();
+
+    /* Whether event was counted, and its count */
+    inline bool Available(Event event) const {
+        return fds[event] >= 0;
+    }
+
+    inline uint64_t Count(Event event) const {
+        return counts[event];
+    }
+
+    /* Print each available count, and miss rates where both halves
+       were counted */
+    void Print(FILE* f) const;
+
+    static const char* EventName(Event event);
+
+private:
+    int fds[N_CACHE_EVENTS];
+    uint64_t counts[N_CACHE_EVENTS];
+};
+
+#endif
@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <cmath>
+
+#include "cylinder.hpp"
+#include "disk.hpp"
+#include "helper.hpp"
+#include "intersection.hpp"
+
+/* Directions too close to these to divide by */
+static const double PARALLEL_EPSILON = 1e-12;
+
+Cylinder::Cylinder(const Vector3D& base, const Vector3D& top, double radius,
+                   const Material& mat) :
+    SceneObject((base + top) / 2, mat),
+    base(base),
+    top(top),
+    length(base.To(top).Norm()),
+    radius(radius)
+{
+    /* Normalized() leaves vectors within EPSILON of unit length alone,
+       which is too loose to measure distances from the axis with */
+    this->axis = base.To(top) / this->length;
+}
+
+Cylinder::~Cylinder()
+{
+}
+
+bool Cylinder::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    Vector3D dir = ray.GetDir(), rel = this->base.To(ray.GetOrigin());
+    double d_axis = dir.Dot(this->axis), o_axis = rel.Dot(this->axis);
+
+    /* Where the ray is within radius of the axis: solve
+       |perp(rel + t dir)|^2 = radius^2, perp() dropping the part along
+       the axis */
+    double t_in = -INFINITY, t_out = INFINITY;
+    double a = dir.Dot(dir) - d_axis * d_axis,
+        b = rel.Dot(dir) - o_axis * d_axis,
+        c = rel.Dot(rel) - o_axis * o_axis - this->radius * this->radius;
+    if (a > PARALLEL_EPSILON) {
+        double det = b * b - a * c;
+        if (det < 0) {
+            return false;
+        }
+
+        double s = std::sqrt(det);
+        t_in = (-b - s) / a;
+        t_out = (-b + s) / a;
+    } else if (c > 0) {
+        /* Parallel to the axis, and outside */
+        return false;
+    }
+
+    /* ...and between the caps */
+    if (std::abs(d_axis) > PARALLEL_EPSILON) {
+        double t0 = -o_axis / d_axis, t1 = (this->length - o_axis) / d_axis;
+        t_in = std::max(t_in, std::min(t0, t1));
+        t_out = std::min(t_out, std::max(t0, t1));
+    } else if (o_axis < 0 || o_axis > this->length) {
+        return false;
+    }
+
+    if (t_in > t_out) {
+        return false;
+    }
+
+    /* From inside, or too close to the surface to tell from it, the
+       ray leaves through the far side */
+    double t = t_in >= EPSILON ? t_in : t_out;
+    if (!(t >= EPSILON && t <= max_dist)) {
+        return false;
+    }
+
+    hit.dist = t;
+    hit.part = this;
+    return true;
+}
+
+SceneObjectIntersection Cylinder::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    return this->FinalizeSolid(ray, hit);
+}
+
+SceneObjectIntersection Cylinder::Intersects(const Ray3D& ray, double max_dist) const
+{
+    return this->HitThenFinalize(ray, max_dist);
+}
+
+Vector3D Cylinder::NormalAtPoint(const Vector3D& v) const
+{
+    Vector3D rel = this->base.To(v);
+    double along = rel.Dot(this->axis);
+    Vector3D out = rel - this->axis * along;
+    double out_norm = out.Norm();
+
+    double to_side = std::abs(this->radius - out_norm),
+        to_base = std::abs(along),
+        to_top = std::abs(this->length - along);
+
+    if (to_side < to_base && to_side < to_top && out_norm > 0) {
+        return out / out_norm;
+    }
+    return to_base < to_top ? -this->axis : this->axis;
+}
+
+Box Cylinder::GetBoundingBox() const
+{
+    Vector3D extent(disk_extent(this->axis, this->radius, AXIS_X),
+                    disk_extent(this->axis, this->radius, AXIS_Y),
+                    disk_extent(this->axis, this->radius, AXIS_Z));
+    return Box(Vector3D::MinCombination(this->base, this->top) - extent,
+               Vector3D::MaxCombination(this->base, this->top) + extent);
+}
@@ -0,0 +1,42 @@
+#ifndef CYLINDER_HPP_
+#define CYLINDER_HPP_
+
+#include "box.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "vector.hpp"
+
+/* The solid cylinder of the given radius around the segment from base
+ * to top, capped at both ends, e.g. a pipe or a pillar. Like a sphere
+ * it has an inside, so rays leaving it through glass refract back
+ * out. */
+class Cylinder : public SceneObject {
+public:
+    Cylinder(const Vector3D& base, const Vector3D& top, double radius,
+             const Material& mat);
+    virtual ~Cylinder();
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray, double max_dist) const override;
+
+    /* The hit point and normal wait for Finalize() */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
+    /* The extent of the two caps, which is all of the cylinder's */
+    virtual Box GetBoundingBox() const override;
+
+private:
+    Vector3D base, top;
+
+    /* Unit vector from base to top, and the distance between them */
+    Vector3D axis;
+    double length;
+
+    double radius;
+
+    /* Outward normal of the side or cap closest to v */
+    virtual Vector3D NormalAtPoint(const Vector3D& v) const override;
+};
+
+#endif
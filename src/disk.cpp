@@ -0,0 +1,36 @@
+#include <algorithm>
+#include <cmath>
+
+#include "disk.hpp"
+#include "intersection.hpp"
+#include "ray.hpp"
+#include "vector.hpp"
+
+Disk::Disk(const Vector3D& center, const Vector3D& normal, double radius,
+           const Material& mat) :
+    Plane(center, normal, mat),
+    radius(radius)
+{
+}
+
+Disk::~Disk()
+{
+}
+
+bool Disk::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    if (!Plane::Hit(ray, max_dist, hit)) {
+        return false;
+    }
+
+    Vector3D rel = this->pos.To(ray.Point(hit.dist));
+    return rel.Dot(rel) <= this->radius * this->radius;
+}
+
+Box Disk::GetBoundingBox() const
+{
+    Vector3D extent(disk_extent(this->normal, this->radius, AXIS_X),
+                    disk_extent(this->normal, this->radius, AXIS_Y),
+                    disk_extent(this->normal, this->radius, AXIS_Z));
+    return Box(this->pos - extent, this->pos + extent);
+}
@@ -0,0 +1,40 @@
+#ifndef DISK_HPP_
+#define DISK_HPP_
+
+#include <algorithm>
+#include <cmath>
+
+#include "box.hpp"
+#include "plane.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "vector.hpp"
+
+/* The flat disk of the given radius around center, facing along
+ * normal, e.g. a cylinder's cap or a lamp. Two-sided, like a
+ * triangle. */
+class Disk : public Plane {
+public:
+    Disk(const Vector3D& center, const Vector3D& normal, double radius,
+         const Material& mat);
+    virtual ~Disk();
+
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+
+    /* The disk's own extent along each axis, not that of the square
+       around it */
+    virtual Box GetBoundingBox() const override;
+
+private:
+    double radius;
+};
+
+/* Distance from center to the edge of a disk or cylinder cap of the
+   given radius, facing along normal, in the direction of axis */
+inline double disk_extent(const Vector3D& normal, double radius, int axis)
+{
+    double n = normal.GetValue(axis) / normal.Norm();
+    return radius * std::sqrt(std::max(0.0, 1 - n * n));
+}
+
+#endif
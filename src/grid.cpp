@@ -0,0 +1,352 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+
+#include "bounds.hpp"
+#include "grid.hpp"
+#include "helper.hpp"
+
+/* Cell along axis that holds x, clamped to the grid */
+static inline int cell_of(const double* lo, const double* cell_size, const int* res,
+                          int axis, double x)
+{
+    if (cell_size[axis] <= 0) {
+        return 0;
+    }
+
+    double c = (x - lo[axis]) / cell_size[axis];
+    return c <= 0 ? 0 : std::min(int(c), res[axis] - 1);
+}
+
+Grid::Grid(const std::vector<const SceneObject*>& objs, int n_threads) :
+    objects(objs),
+    object_bounds(objs.size())
+{
+    n_threads = std::max(1, n_threads);
+
+    Bounds bounds;
+    for (size_t i = 0; i < objs.size(); i++) {
+        object_bounds[i] = Bounds(objs[i]->GetBoundingBox());
+        bounds.Expand(object_bounds[i]);
+    }
+
+    std::vector<uint32_t> obj_nums(objs.size());
+    for (size_t i = 0; i < objs.size(); i++) {
+        obj_nums[i] = i;
+    }
+
+    std::vector<uint32_t> nums = BuildLevel(top, bounds, obj_nums, n_threads);
+    size_t n_cells = top.cell_start.size() - 1;
+
+    /* Give crowded cells a grid of their own. Those grids are
+       independent, so they are built in parallel. */
+    std::vector<uint32_t> dense;
+    for (size_t cell = 0; cell < n_cells; cell++) {
+        if (top.cell_start[cell + 1] - top.cell_start[cell] > SUBGRID_MIN_OBJS) {
+            dense.push_back(cell);
+        }
+    }
+
+    top.sub.assign(n_cells, nullptr);
+
+    parallel_for(0, dense.size(), n_threads, [&](size_t b, size_t e, int) {
+            for (size_t i = b; i < e; i++) {
+                uint32_t cell = dense[i];
+                int idx[N_AXES] = {int(cell % top.res[AXIS_X]),
+                                   int(cell / top.res[AXIS_X] % top.res[AXIS_Y]),
+                                   int(cell / top.res[AXIS_X] / top.res[AXIS_Y])};
+
+                Bounds cell_bounds;
+                for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                    cell_bounds.lo[axis] = top.bounds.lo[axis] + idx[axis] * top.cell_size[axis];
+                    cell_bounds.hi[axis] = idx[axis] == top.res[axis] - 1 ?
+                        top.bounds.hi[axis] :
+                        top.bounds.lo[axis] + (idx[axis] + 1) * top.cell_size[axis];
+                }
+
+                std::vector<uint32_t> cell_nums(nums.begin() + top.cell_start[cell],
+                                                nums.begin() + top.cell_start[cell + 1]);
+
+                Level* level = new Level();
+                std::vector<uint32_t> sub_nums = BuildLevel(*level, cell_bounds, cell_nums, 1);
+                if (sub_nums.size() > SUBGRID_MAX_REFS_PER_OBJ * cell_nums.size()) {
+                    delete level;
+                    continue;
+                }
+
+                level->refs.resize(sub_nums.size());
+                for (size_t r = 0; r < sub_nums.size(); r++) {
+                    level->refs[r] = objects[sub_nums[r]];
+                }
+                top.sub[cell] = level;
+            }
+        });
+
+    /* The top level only keeps the objects of cells without a grid */
+    std::vector<uint32_t> cell_start(n_cells + 1);
+    for (size_t cell = 0; cell < n_cells; cell++) {
+        cell_start[cell] = top.refs.size();
+        if (!top.sub[cell]) {
+            for (uint32_t r = top.cell_start[cell]; r < top.cell_start[cell + 1]; r++) {
+                top.refs.push_back(objects[nums[r]]);
+            }
+        }
+    }
+    cell_start[n_cells] = top.refs.size();
+    top.cell_start.swap(cell_start);
+}
+
+Grid::~Grid()
+{
+    for (auto level : top.sub) {
+        delete level;
+    }
+}
+
+std::vector<uint32_t> Grid::BuildLevel(Level& level, const Bounds& bounds,
+                                       const std::vector<uint32_t>& obj_nums,
+                                       int n_threads) const
+{
+    level.bounds = bounds;
+
+    /* Choose cubic-ish cells so there are about DENSITY cells per
+       object. Flat axes are padded so the volume isn't zero. */
+    double max_extent = 0;
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        max_extent = std::max(max_extent, bounds.IsEmpty() ? 0 : bounds.Extent(axis));
+    }
+
+    double volume = 1;
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        volume *= std::max(bounds.IsEmpty() ? 0 : bounds.Extent(axis), 1e-3 * max_extent);
+    }
+
+    double cells_per_unit = max_extent > 0 ?
+        std::cbrt(DENSITY * obj_nums.size() / volume) : 0;
+
+    size_t n_cells = 1;
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        double extent = bounds.IsEmpty() ? 0 : bounds.Extent(axis);
+        level.res[axis] = std::max(1, std::min((int) MAX_RES, int(std::ceil(extent * cells_per_unit))));
+        level.cell_size[axis] = extent / level.res[axis];
+        n_cells *= level.res[axis];
+    }
+
+    /* Count each cell's objects, turn the counts into offsets, then
+       drop the objects in. Both passes go over objects in parallel. */
+    auto for_cells = [&](uint32_t num, const std::function<void(size_t)>& fn) {
+        const Bounds& b = object_bounds[num];
+        int lo[N_AXES], hi[N_AXES];
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            lo[axis] = cell_of(level.bounds.lo, level.cell_size, level.res, axis, b.lo[axis]);
+            hi[axis] = cell_of(level.bounds.lo, level.cell_size, level.res, axis, b.hi[axis]);
+        }
+
+        for (int z = lo[AXIS_Z]; z <= hi[AXIS_Z]; z++) {
+            for (int y = lo[AXIS_Y]; y <= hi[AXIS_Y]; y++) {
+                for (int x = lo[AXIS_X]; x <= hi[AXIS_X]; x++) {
+                    fn(x + level.res[AXIS_X] * (y + (size_t) level.res[AXIS_Y] * z));
+                }
+            }
+        }
+    };
+
+    std::vector<std::atomic<uint32_t> > counts(n_cells);
+    for (auto& count : counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+
+    parallel_for(0, obj_nums.size(), n_threads, [&](size_t b, size_t e, int) {
+            for (size_t i = b; i < e; i++) {
+                for_cells(obj_nums[i], [&](size_t cell) {
+                        counts[cell].fetch_add(1, std::memory_order_relaxed);
+                    });
+            }
+        });
+
+    level.cell_start.resize(n_cells + 1);
+    uint32_t offset = 0;
+    for (size_t cell = 0; cell < n_cells; cell++) {
+        level.cell_start[cell] = offset;
+        offset += counts[cell].load(std::memory_order_relaxed);
+        counts[cell].store(level.cell_start[cell], std::memory_order_relaxed);
+    }
+    level.cell_start[n_cells] = offset;
+
+    std::vector<uint32_t> nums(offset);
+    parallel_for(0, obj_nums.size(), n_threads, [&](size_t b, size_t e, int) {
+            for (size_t i = b; i < e; i++) {
+                for_cells(obj_nums[i], [&](size_t cell) {
+                        nums[counts[cell].fetch_add(1, std::memory_order_relaxed)] = obj_nums[i];
+                    });
+            }
+        });
+
+    /* Threads fill cells in no particular order; sort them so every
+       build gives the same grid */
+    if (n_threads > 1) {
+        parallel_for(0, n_cells, n_threads, [&](size_t b, size_t e, int) {
+                for (size_t cell = b; cell < e; cell++) {
+                    std::sort(nums.begin() + level.cell_start[cell],
+                              nums.begin() + level.cell_start[cell + 1]);
+                }
+            });
+    }
+
+    return nums;
+}
+
+template <typename Fn>
+bool Grid::Walk(const Level& level, const Ray3D& ray,
+                double t_enter, double t_exit, Fn visit) const
+{
+    Vector3D ray_o = ray.GetOrigin(), ray_d = ray.GetDir(), ray_inv = ray.GetInvDir();
+    double o[N_AXES], inv[N_AXES];
+    int cell[N_AXES], step[N_AXES], out[N_AXES];
+    double t_next[N_AXES];
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        o[axis] = ray_o.GetValue(axis);
+        inv[axis] = ray_inv.GetValue(axis);
+
+        double d = ray_d.GetValue(axis);
+        cell[axis] = cell_of(level.bounds.lo, level.cell_size, level.res, axis,
+                             o[axis] + d * t_enter);
+
+        if (d > 0 && level.cell_size[axis] > 0) {
+            step[axis] = 1;
+            out[axis] = level.res[axis];
+        } else if (d < 0 && level.cell_size[axis] > 0) {
+            step[axis] = -1;
+            out[axis] = -1;
+        } else {
+            /* Never leaves its slab of cells along this axis */
+            step[axis] = 0;
+            out[axis] = -1;
+        }
+    }
+
+    /* Distance to the next cell boundary along an axis, from the
+       origin each time so errors don't build up */
+    auto boundary = [&](int axis) {
+        if (step[axis] == 0) {
+            return (double) INFINITY;
+        }
+        double plane = level.bounds.lo[axis]
+            + (cell[axis] + (step[axis] > 0)) * level.cell_size[axis];
+        return (plane - o[axis]) * inv[axis];
+    };
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        t_next[axis] = boundary(axis);
+    }
+
+    double t = t_enter;
+    while (true) {
+        int axis = t_next[AXIS_X] < t_next[AXIS_Y] ?
+            (t_next[AXIS_X] < t_next[AXIS_Z] ? AXIS_X : AXIS_Z) :
+            (t_next[AXIS_Y] < t_next[AXIS_Z] ? AXIS_Y : AXIS_Z);
+        double t_cell_exit = std::min(t_next[axis], t_exit);
+
+        size_t index = cell[AXIS_X]
+            + level.res[AXIS_X] * (cell[AXIS_Y] + (size_t) level.res[AXIS_Y] * cell[AXIS_Z]);
+        if (visit(level, index, t, t_cell_exit)) {
+            return true;
+        }
+
+        if (t_next[axis] >= t_exit) {
+            return false;
+        }
+
+        cell[axis] += step[axis];
+        if (cell[axis] == out[axis]) {
+            return false;
+        }
+
+        t = t_next[axis];
+        t_next[axis] = boundary(axis);
+    }
+}
+
+SceneObjectIntersection Grid::Intersects(const Ray3D& ray, double max_dist) const
+{
+    const SceneObject* closest = nullptr;
+    PrimHit hit;
+    hit.dist = INFINITY;
+
+    double t_min, t_max;
+    if (!top.bounds.Clip(ray, max_dist, &t_min, &t_max)) {
+        return FinalizeHit(closest, ray, hit);
+    }
+
+    /* Cells are visited front to back, so a hit inside the current
+       cell can't be beaten by anything in a later one */
+    auto leaf = [&](const Level& level, size_t cell, double, double t_exit) {
+        for (uint32_t i = level.cell_start[cell]; i < level.cell_start[cell + 1]; i++) {
+            PrimHit prim_hit;
+            if (level.refs[i]->Hit(ray, max_dist, prim_hit) && prim_hit.dist < hit.dist) {
+                closest = level.refs[i];
+                hit = prim_hit;
+                max_dist = hit.dist;
+            }
+        }
+        return closest && hit.dist <= t_exit;
+    };
+
+    Walk(top, ray, t_min, t_max, [&](const Level& level, size_t cell,
+                                     double t_enter, double t_exit) {
+            if (top.sub[cell]) {
+                return Walk(*top.sub[cell], ray, t_enter, t_exit, leaf);
+            }
+            return leaf(level, cell, t_enter, t_exit);
+        });
+
+    return FinalizeHit(closest, ray, hit);
+}
+
+bool Grid::Occluded(const Ray3D& ray, double max_dist) const
+{
+    double t_min, t_max;
+    if (!top.bounds.Clip(ray, max_dist, &t_min, &t_max)) {
+        return false;
+    }
+
+    auto leaf = [&](const Level& level, size_t cell, double, double) {
+        for (uint32_t i = level.cell_start[cell]; i < level.cell_start[cell + 1]; i++) {
+            if (level.refs[i]->Occludes(ray, max_dist)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    return Walk(top, ray, t_min, t_max, [&](const Level& level, size_t cell,
+                                            double t_enter, double t_exit) {
+            if (top.sub[cell]) {
+                return Walk(*top.sub[cell], ray, t_enter, t_exit, leaf);
+            }
+            return leaf(level, cell, t_enter, t_exit);
+        });
+}
+
+AccelStats Grid::GetStats() const
+{
+    AccelStats stats;
+    stats.n_nodes = top.cell_start.size() - 1;
+    stats.n_refs = top.refs.size();
+    stats.bytes = top.cell_start.size() * sizeof(uint32_t)
+        + top.sub.size() * sizeof(const Level*)
+        + top.refs.size() * sizeof(const SceneObject*);
+
+    for (auto level : top.sub) {
+        if (level) {
+            stats.n_nodes += level->cell_start.size() - 1;
+            stats.n_refs += level->refs.size();
+            stats.bytes += sizeof(Level) + level->cell_start.size() * sizeof(uint32_t)
+                + level->refs.size() * sizeof(const SceneObject*);
+        }
+    }
+
+    return stats;
+}
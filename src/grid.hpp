@@ -0,0 +1,77 @@
+#ifndef GRID_HPP_
+#define GRID_HPP_
+
+#include <vector>
+#include <stdint.h>
+
+#include "accelerator.hpp"
+#include "bounds.hpp"
+#include "intersection.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+
+/* A two-level grid for dense scenes of similar-size objects. The top
+ * level is a uniform grid sized from the object density; cells that
+ * still hold many objects get a finer grid of their own. Each object
+ * is listed in every cell its bounding box overlaps. Rays step from
+ * cell to cell with a 3D-DDA and stop at the first cell that contains
+ * a hit.
+ */
+class Grid : public Accelerator {
+public:
+    Grid(const std::vector<const SceneObject*>& objs, int n_threads = 1);
+    virtual ~Grid();
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    virtual bool Occluded(const Ray3D& ray, double max_dist) const override;
+
+    virtual AccelStats GetStats() const override;
+
+private:
+    /* Cells per object in a grid, and the most cells along an axis */
+    static constexpr double DENSITY = 2.0;
+    static const int MAX_RES = 256;
+
+    /* Top-level cells with more objects than this get their own grid */
+    static const uint32_t SUBGRID_MIN_OBJS = 16;
+
+    /* Objects too big for a cell's grid land in many of its cells; such
+       grids are dropped if they hold more than this many references
+       per object */
+    static const uint32_t SUBGRID_MAX_REFS_PER_OBJ = 4;
+
+    struct Level {
+        Bounds bounds;
+        int res[N_AXES];
+        double cell_size[N_AXES];
+
+        /* Objects in cell i are refs[cell_start[i], cell_start[i + 1]) */
+        std::vector<uint32_t> cell_start;
+        std::vector<const SceneObject*> refs;
+
+        /* Top level only: the finer grid of each cell, or null */
+        std::vector<const Level*> sub;
+    };
+
+    /* Size level's cells and sort the objects numbered in obj_nums
+       into them. Returns the object numbers laid out like refs. */
+    std::vector<uint32_t> BuildLevel(Level& level, const Bounds& bounds,
+                                     const std::vector<uint32_t>& obj_nums,
+                                     int n_threads) const;
+
+    /* Step the ray through level's cells from t_enter to t_exit,
+       calling visit(level, cell, t_cell_enter, t_cell_exit) on each
+       until it returns true. Returns whether it did. */
+    template <typename Fn>
+    bool Walk(const Level& level, const Ray3D& ray,
+              double t_enter, double t_exit, Fn visit) const;
+
+    std::vector<const SceneObject*> objects;
+    std::vector<Bounds> object_bounds;
+
+    Level top;
+};
+
+#endif
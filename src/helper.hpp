@@ -1,11 +1,13 @@
 #ifndef _HELPER_HPP
 #define _HELPER_HPP
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <functional>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <sys/stat.h>
@@ -76,4 +78,43 @@ inline double range(std::vector<double> data)
     return max - min;
 }
 
+/* 64-bit FNV-1a hash of n bytes, continuing from h */
+const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+
+inline uint64_t fnv1a(const void* data, size_t n, uint64_t h = FNV_OFFSET_BASIS)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Split [start, end) into up to n_threads contiguous chunks and call
+   fn(chunk_start, chunk_end, chunk_index) on each in parallel. The
+   first chunk runs on the calling thread. */
+template <typename Fn>
+inline void parallel_for(size_t start, size_t end, int n_threads, Fn fn)
+{
+    size_t n = end - start;
+    if (n_threads < 2 || n < 2) {
+        fn(start, end, 0);
+        return;
+    }
+
+    size_t chunk = (n + n_threads - 1) / n_threads;
+    std::vector<std::thread> threads;
+
+    for (int t = 1; t < n_threads && start + t * chunk < end; t++) {
+        threads.push_back(std::thread(fn, start + t * chunk,
+                                      std::min(start + (t + 1) * chunk, end), t));
+    }
+
+    fn(start, std::min(start + chunk, end), 0);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
 #endif
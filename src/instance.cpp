@@ -0,0 +1,79 @@
+#include "instance.hpp"
+#include "intersection.hpp"
+#include "material.hpp"
+#include "mesh.hpp"
+#include "transform.hpp"
+
+Instance::Instance(const Mesh* mesh, const Transform& to_world) :
+    SceneObject(to_world.Point(Vector3D()), DEFAULT_MAT),
+    mesh(mesh),
+    to_world(to_world),
+    to_object(to_world.Inverse())
+{
+}
+
+Instance::~Instance()
+{
+}
+
+bool Instance::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    /* Ray3D normalizes its direction, so distances along the object
+       space ray are scaled by the length of the transformed direction */
+    Vector3D obj_dir = to_object.Vector(ray.GetDir());
+    Ray3D obj_ray(to_object.Point(ray.GetOrigin()), obj_dir);
+    double scale = obj_dir.Norm();
+
+    const SceneObject* part = mesh->ClosestHit(obj_ray, max_dist * scale, hit);
+    if (!part) {
+        return false;
+    }
+
+    hit.dist /= scale;
+    hit.part = part;
+    return true;
+}
+
+SceneObjectIntersection Instance::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    Vector3D obj_dir = to_object.Vector(ray.GetDir());
+    Ray3D obj_ray(to_object.Point(ray.GetOrigin()), obj_dir);
+
+    PrimHit obj_hit = hit;
+    obj_hit.dist = hit.dist * obj_dir.Norm();
+    auto obj_intersect = hit.part->Finalize(obj_ray, obj_hit);
+
+    /* The inverse transpose keeps normals perpendicular to the
+       surface, and preserves which side the ray came from */
+    return SceneObjectIntersection(obj_intersect.GetObject(),
+                                   true,
+                                   ray,
+                                   obj_intersect.inc,
+                                   to_world.Point(obj_intersect.point),
+                                   to_world.Normal(obj_intersect.norm.GetDir()));
+}
+
+SceneObjectIntersection Instance::Intersects(const Ray3D& ray, double max_dist) const
+{
+    return this->HitThenFinalize(ray, max_dist);
+}
+
+bool Instance::Occludes(const Ray3D& ray, double max_dist) const
+{
+    Vector3D obj_dir = to_object.Vector(ray.GetDir());
+    Ray3D obj_ray(to_object.Point(ray.GetOrigin()), obj_dir);
+
+    return mesh->Occluded(obj_ray, max_dist * obj_dir.Norm());
+}
+
+Box Instance::GetBoundingBox() const
+{
+    return to_world.Apply(mesh->GetBoundingBox());
+}
+
+void Instance::SetTransform(const Transform& to_world)
+{
+    this->to_world = to_world;
+    this->to_object = to_world.Inverse();
+    this->pos = to_world.Point(Vector3D());
+}
@@ -0,0 +1,53 @@
+#ifndef INSTANCE_HPP_
+#define INSTANCE_HPP_
+
+#include "box.hpp"
+#include "intersection.hpp"
+#include "mesh.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "transform.hpp"
+
+/* One placement of a Mesh in the scene. Instances only hold a pointer
+ * to the shared mesh and a transform, so the top-level BVH is built
+ * over instances while each mesh's own BVH is shared by all of them.
+ * Rays are taken into object space to traverse the mesh, and hits are
+ * brought back into world space.
+ */
+class Instance : public SceneObject {
+public:
+    Instance(const Mesh* mesh, const Transform& to_world);
+    virtual ~Instance();
+
+    /* The hit record names the mesh object that was hit, not the
+       instance, so shading uses that object's material. */
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    /* Hits are found in object space; only Finalize() brings the
+       closest one back into world space. hit.part is the mesh object
+       that was hit. */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
+    virtual bool Occludes(const Ray3D& ray, double max_dist) const override;
+
+    virtual Box GetBoundingBox() const override;
+
+    /* Move the instance; the top-level BVH must then be updated */
+    void SetTransform(const Transform& to_world);
+
+private:
+    const Mesh* mesh;
+    Transform to_world, to_object;
+
+    /* Normals are only known per mesh object and are reported by
+       Intersects, so there is nothing sensible to return here. */
+    virtual inline Vector3D NormalAtPoint(const Vector3D& v) const override
+    {
+        return Vector3D();
+    };
+};
+
+#endif
@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <cmath>
+
+#include "bounds.hpp"
+#include "kd_tree.hpp"
+
+KdTree::KdTree(const std::vector<const SceneObject*>& objs) :
+    bounds(),
+    nodes(),
+    objects(objs),
+    object_bounds(objs.size()),
+    prims()
+{
+    /* Bounds are rounded out to floats up front, so every candidate
+       plane is exactly the float stored in the node */
+    for (size_t i = 0; i < objs.size(); i++) {
+        Bounds b(objs[i]->GetBoundingBox());
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            b.lo[axis] = round_down(b.lo[axis]);
+            b.hi[axis] = round_up(b.hi[axis]);
+        }
+        object_bounds[i] = b;
+        bounds.Expand(b);
+    }
+
+    std::vector<uint32_t> obj_nums(objs.size());
+    for (size_t i = 0; i < objs.size(); i++) {
+        obj_nums[i] = i;
+    }
+
+    int max_depth = objs.empty() ? 0 :
+        std::min((int) MAX_DEPTH, (int) std::lround(8 + 1.3 * std::log2(objs.size())));
+    Build(obj_nums, bounds, max_depth, 0);
+    prims.Finish();
+}
+
+void KdTree::MakeLeaf(uint32_t index, const std::vector<uint32_t>& obj_nums)
+{
+    nodes[index].offset = prims.Size();
+    nodes[index].flags = LEAF | (obj_nums.size() << 2);
+
+    for (auto num : obj_nums) {
+        prims.Add(objects[num]);
+    }
+}
+
+void KdTree::Build(std::vector<uint32_t>& obj_nums, const Bounds& node_bounds,
+                   int depth, int bad_refines)
+{
+    uint32_t index = nodes.size();
+    nodes.push_back(Node());
+
+    size_t n_objs = obj_nums.size();
+    if (n_objs <= MAX_LEAF_OBJS || depth == 0) {
+        MakeLeaf(index, obj_nums);
+        return;
+    }
+
+    /* Sweep the sorted object edges along the longest axis, trying the
+       others if no plane there falls inside the node */
+    double total_area = node_bounds.SurfaceArea();
+    double inv_total_area = total_area > 0 ? 1 / total_area : 0;
+    double old_cost = INTERSECT_COST * n_objs;
+
+    double best_cost = INFINITY;
+    int best_axis = -1;
+    size_t best_offset = 0;
+
+    std::vector<Edge> edges(2 * n_objs), best_edges;
+    int axis = node_bounds.LongestAxis();
+
+    for (int tries = 0; tries < N_AXES && best_axis < 0; tries++) {
+        for (size_t i = 0; i < n_objs; i++) {
+            const Bounds& b = object_bounds[obj_nums[i]];
+            edges[2 * i] = {b.lo[axis], obj_nums[i], true};
+            edges[2 * i + 1] = {b.hi[axis], obj_nums[i], false};
+        }
+        std::sort(edges.begin(), edges.end());
+
+        int other0 = (axis + 1) % N_AXES, other1 = (axis + 2) % N_AXES;
+        double d0 = node_bounds.Extent(other0), d1 = node_bounds.Extent(other1);
+        size_t n_below = 0, n_above = n_objs;
+
+        for (size_t i = 0; i < 2 * n_objs; i++) {
+            if (!edges[i].start) {
+                n_above--;
+            }
+
+            double t = edges[i].pos;
+            if (t > node_bounds.lo[axis] && t < node_bounds.hi[axis]) {
+                double below_area = 2 * (d0 * d1 + (t - node_bounds.lo[axis]) * (d0 + d1));
+                double above_area = 2 * (d0 * d1 + (node_bounds.hi[axis] - t) * (d0 + d1));
+                double bonus = (n_below == 0 || n_above == 0) ? EMPTY_BONUS : 0;
+                double cost = TRAVERSAL_COST + INTERSECT_COST * (1 - bonus)
+                    * (below_area * inv_total_area * n_below
+                       + above_area * inv_total_area * n_above);
+
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_offset = i;
+                }
+            }
+
+            if (edges[i].start) {
+                n_below++;
+            }
+        }
+
+        if (best_axis >= 0) {
+            break;
+        }
+        axis = (axis + 1) % N_AXES;
+    }
+
+    if (best_cost > old_cost) {
+        bad_refines++;
+    }
+
+    if ((best_cost > 4 * old_cost && n_objs < 16) || best_axis < 0 ||
+        bad_refines == MAX_BAD_REFINES) {
+        MakeLeaf(index, obj_nums);
+        return;
+    }
+
+    /* Objects starting before the plane go below, objects ending after
+       it go above; straddlers go to both */
+    std::vector<uint32_t> below, above;
+    for (size_t i = 0; i < best_offset; i++) {
+        if (edges[i].start) {
+            below.push_back(edges[i].obj);
+        }
+    }
+    for (size_t i = best_offset + 1; i < 2 * n_objs; i++) {
+        if (!edges[i].start) {
+            above.push_back(edges[i].obj);
+        }
+    }
+
+    double split = edges[best_offset].pos;
+    std::vector<uint32_t>().swap(obj_nums);
+    std::vector<Edge>().swap(edges);
+
+    Bounds below_bounds = node_bounds, above_bounds = node_bounds;
+    below_bounds.hi[best_axis] = split;
+    above_bounds.lo[best_axis] = split;
+
+    Build(below, below_bounds, depth - 1, bad_refines);
+
+    nodes[index].split = split;
+    nodes[index].flags = best_axis | (nodes.size() << 2);
+    Build(above, above_bounds, depth - 1, bad_refines);
+}
+
+SceneObjectIntersection KdTree::Intersects(const Ray3D& ray, double max_dist) const
+{
+    const SceneObject* closest = nullptr;
+    PrimHit hit;
+    hit.dist = INFINITY;
+
+    double t_min, t_max;
+    if (nodes.empty() || !bounds.Clip(ray, max_dist, &t_min, &t_max)) {
+        return FinalizeHit(closest, ray, hit);
+    }
+
+    Vector3D o = ray.GetOrigin(), dir = ray.GetDir(), inv = ray.GetInvDir();
+    TriangleRay tri_ray(ray);
+
+    /* Far children still to visit and the stretch of the ray in them */
+    struct StackEntry {
+        uint32_t node;
+        double t_min, t_max;
+    } to_check[MAX_DEPTH];
+    int stack_size = 0;
+
+    uint32_t index = 0;
+
+    while (true) {
+        const Node& node = nodes[index];
+
+        if (!node.IsLeaf()) {
+            int axis = node.Axis();
+            double origin = o.GetValue(axis);
+            double t_plane = (node.split - origin) * inv.GetValue(axis);
+
+            bool below_first = origin < node.split ||
+                (origin == node.split && dir.GetValue(axis) <= 0);
+            uint32_t first = below_first ? index + 1 : node.AboveChild(),
+                second = below_first ? node.AboveChild() : index + 1;
+
+            /* The ray may only pass through one side. NaNs come from
+               rays running along the plane. */
+            if (t_plane > t_max || t_plane <= 0 || std::isnan(t_plane)) {
+                index = first;
+            } else if (t_plane < t_min) {
+                index = second;
+            } else {
+                to_check[stack_size++] = {second, t_plane, t_max};
+                index = first;
+                t_max = t_plane;
+            }
+            continue;
+        }
+
+        for (uint32_t i = node.offset; i < node.offset + node.Count(); i++) {
+            PrimHit prim_hit;
+            if (prims.Hit(i, ray, tri_ray, max_dist, prim_hit) && prim_hit.dist < hit.dist) {
+                closest = prims[i];
+                hit = prim_hit;
+                max_dist = hit.dist;
+            }
+        }
+
+        /* Nodes are visited front to back, so once the closest hit is
+           before the next node nothing further can beat it */
+        do {
+            if (stack_size == 0) {
+                return FinalizeHit(closest, ray, hit);
+            }
+            stack_size--;
+        } while (to_check[stack_size].t_min > max_dist);
+
+        index = to_check[stack_size].node;
+        t_min = to_check[stack_size].t_min;
+        t_max = to_check[stack_size].t_max;
+    }
+}
+
+bool KdTree::Occluded(const Ray3D& ray, double max_dist) const
+{
+    double t_min, t_max;
+    if (nodes.empty() || !bounds.Clip(ray, max_dist, &t_min, &t_max)) {
+        return false;
+    }
+
+    Vector3D o = ray.GetOrigin(), dir = ray.GetDir(), inv = ray.GetInvDir();
+    TriangleRay tri_ray(ray);
+
+    struct StackEntry {
+        uint32_t node;
+        double t_min, t_max;
+    } to_check[MAX_DEPTH];
+    int stack_size = 0;
+
+    uint32_t index = 0;
+
+    while (true) {
+        const Node& node = nodes[index];
+
+        if (!node.IsLeaf()) {
+            int axis = node.Axis();
+            double origin = o.GetValue(axis);
+            double t_plane = (node.split - origin) * inv.GetValue(axis);
+
+            bool below_first = origin < node.split ||
+                (origin == node.split && dir.GetValue(axis) <= 0);
+            uint32_t first = below_first ? index + 1 : node.AboveChild(),
+                second = below_first ? node.AboveChild() : index + 1;
+
+            if (t_plane > t_max || t_plane <= 0 || std::isnan(t_plane)) {
+                index = first;
+            } else if (t_plane < t_min) {
+                index = second;
+            } else {
+                to_check[stack_size++] = {second, t_plane, t_max};
+                index = first;
+                t_max = t_plane;
+            }
+            continue;
+        }
+
+        for (uint32_t i = node.offset; i < node.offset + node.Count(); i++) {
+            if (prims.Occludes(i, ray, tri_ray, max_dist)) {
+                return true;
+            }
+        }
+
+        if (stack_size == 0) {
+            return false;
+        }
+
+        stack_size--;
+        index = to_check[stack_size].node;
+        t_min = to_check[stack_size].t_min;
+        t_max = to_check[stack_size].t_max;
+    }
+}
+
+AccelStats KdTree::GetStats() const
+{
+    AccelStats stats;
+    stats.n_nodes = nodes.size();
+    stats.n_refs = prims.Size();
+    stats.bytes = nodes.size() * sizeof(Node) + prims.Bytes();
+    return stats;
+}
@@ -0,0 +1,104 @@
+#ifndef KD_TREE_HPP_
+#define KD_TREE_HPP_
+
+#include <vector>
+#include <stdint.h>
+
+#include "accelerator.hpp"
+#include "bounds.hpp"
+#include "intersection.hpp"
+#include "primitive_list.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+
+/* A kd-tree built with the surface area heuristic, after pbrt's. Each
+ * interior node splits space with an axis-aligned plane; objects that
+ * straddle it are referenced from both sides. Nodes are 8 bytes and
+ * stored depth first, so an interior node's below child directly
+ * follows it. Rays walk the tree front to back with a short stack of
+ * far children, and stop as soon as the closest hit lies before the
+ * next node.
+ */
+class KdTree : public Accelerator {
+public:
+    KdTree(const std::vector<const SceneObject*>& objs);
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    virtual bool Occluded(const Ray3D& ray, double max_dist) const override;
+
+    virtual AccelStats GetStats() const override;
+
+private:
+    /* SAH parameters, in units of one traversal step */
+    static constexpr double TRAVERSAL_COST = 1.0;
+    static constexpr double INTERSECT_COST = 80.0;
+    static constexpr double EMPTY_BONUS = 0.5;
+    static const int MAX_LEAF_OBJS = 1;
+
+    /* Splits that don't pay off are tolerated this many times on a
+       path before giving up and making a leaf */
+    static const int MAX_BAD_REFINES = 3;
+
+    static const int MAX_DEPTH = 64;
+
+    static const uint32_t LEAF = 3;
+
+    struct Node {
+        /* Interior nodes: where the plane is. Leaves: index of the first
+           object in prims. */
+        union {
+            float split;
+            uint32_t offset;
+        };
+
+        /* Low two bits: the split axis, or LEAF. The rest: index of the
+           above child, or the leaf's object count. */
+        uint32_t flags;
+
+        inline bool IsLeaf() const {
+            return (flags & 3) == LEAF;
+        }
+
+        inline int Axis() const {
+            return flags & 3;
+        }
+
+        inline uint32_t Count() const {
+            return flags >> 2;
+        }
+
+        inline uint32_t AboveChild() const {
+            return flags >> 2;
+        }
+    };
+
+    /* Start or end of an object's bounds along an axis */
+    struct Edge {
+        double pos;
+        uint32_t obj;
+        bool start;
+
+        inline bool operator< (const Edge& e) const {
+            return pos == e.pos ? start && !e.start : pos < e.pos;
+        }
+    };
+
+    /* Build a subtree over the objects numbered in obj_nums, which it
+       consumes */
+    void Build(std::vector<uint32_t>& obj_nums, const Bounds& node_bounds,
+               int depth, int bad_refines);
+
+    void MakeLeaf(uint32_t index, const std::vector<uint32_t>& obj_nums);
+
+    Bounds bounds;
+    std::vector<Node> nodes;
+
+    /* Objects by number, and the leaves' references to them */
+    std::vector<const SceneObject*> objects;
+    std::vector<Bounds> object_bounds;
+    PrimitiveList prims;
+};
+
+#endif
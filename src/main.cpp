@@ -1,19 +1,31 @@
 #include <chrono>
 #include <cstdio>
 #include <iostream>
+#include <memory>
 #include <thread>
 #include <vector>
 #include <stdlib.h>
 
+#include "axis_box.hpp"
+#include "bvh_report.hpp"
+#include "cache_counters.hpp"
 #include "color.hpp"
+#include "cylinder.hpp"
+#include "disk.hpp"
 #include "helper.hpp"
+#include "instance.hpp"
 #include "material.hpp"
-#include "normal_triangle.hpp"
+#include "mesh.hpp"
+#include "oriented_box.hpp"
+#include "plane.hpp"
+#include "quad.hpp"
 #include "scene.hpp"
 #include "scene_object.hpp"
 #include "scene_parser.hpp"
 #include "sphere.hpp"
-#include "triangle.hpp"
+#include "sphere_set.hpp"
+#include "transform.hpp"
+#include "triangle_mesh.hpp"
 #include "vector.hpp"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -24,13 +36,48 @@
 /* Print usage. */
 void usage(char* prog)
 {
-    std::printf("USAGE: %s [-t <NUM>] [-o <PATH>] -s <PATH>\n"
+    std::printf("USAGE: %s [-t <NUM>] [-b <BUILDER>] [-d <RATIO>] [-l <LAYOUT>] [-a <ACCEL>] [-c <PATH>] [-r <PATH>] [-p] [-w] [-m] [-q] [-f <NUM>] [-o <PATH>] -s <PATH>\n"
                 "-t <NUM>: render using NUM threads (default is 4)\n"
+                "-b <BUILDER>: BVH builder, \"sah\", \"sbvh\", \"lbvh\" or \"mean\" (default is \"sah\")\n"
+                "-d <RATIO>: let the sbvh builder add up to RATIO times as many extra\n"
+                "            object references as there are objects (default is 1)\n"
+                "-l <LAYOUT>: BVH node order, \"dfs\" (depth first), \"veb\" (van Emde\n"
+                "             Boas) or \"treelet\" (page-sized clusters) (default is \"dfs\")\n"
+                "-a <ACCEL>: acceleration structure, \"bvh\", \"bvh4\", \"bvh8\", \"qbvh4\",\n"
+                "           \"kdtree\" or \"grid\" (default is \"bvh\")\n"
+                "-c <PATH>: reuse the BVHs cached in PATH if the scene's geometry\n"
+                "           is unchanged, otherwise build them and cache them there\n"
+                "-r <PATH>: print a report on the quality of the scene's BVH, and\n"
+                "           of each triangle mesh's and sphere set's, and write\n"
+                "           them all to PATH as JSON\n"
+                "-p: trace camera rays through 4x4 pixel tiles in packets\n"
+                "-w: render breadth first, a stage at a time over batches of rays\n"
+                "-m: count cache accesses and misses while rendering, where the\n"
+                "    hardware and kernel allow it\n"
+                "-q: store triangle meshes compressed, their vertices snapped to\n"
+                "    a 16-bit grid over each mesh and their normals in 32 bits\n"
+                "-f <NUM>: render NUM frames of a turntable, turning the vertices\n"
+                "          and sphere sets a full circle about the y axis while\n"
+                "          other objects stay put, numbering the output files\n"
                 "-o <PATH>: output to PATH (should be *.png. default is \"raytraced.png\")\n"
                 "-s <PATH>: the scene file to be rendered\n",
                 prog);
 }
 
+/* Frame number frame of an animation output to path, e.g.
+   "out_0001.png" for "out.png" */
+std::string frame_path(const std::string& path, int frame)
+{
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.find('/', dot) != std::string::npos) {
+        return path + number;
+    }
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
 /* Helper that is passed into thread */
 void render_stripe(Scene* scene, uint8_t start, uint8_t nthreads, uint8_t* dst)
 {
@@ -42,7 +89,16 @@ int main(int argc, char* argv[])
     /* Parse arguments */
     std::string* outfile = nullptr;
     std::string* scenefile = nullptr;
+    std::string* cachefile = nullptr;
+    std::string* reportfile = nullptr;
     int thread_count = 4;
+    BVHOptions bvh_options;
+    AccelType accel_type = ACCEL_BVH;
+    bool packets = false;
+    bool wavefront = false;
+    bool measure = false;
+    bool compress = false;
+    int frames = 1;
 
     int c = 1;
 
@@ -69,6 +125,28 @@ int main(int argc, char* argv[])
             }
 
             outfile = new std::string(argv[c]);
+        } else if (arg == "-c") {
+            if (++c >= argc) {
+                std::fprintf(stderr, "No cache file supplied.\n");
+                ERROR();
+            }
+
+            cachefile = new std::string(argv[c]);
+        } else if (arg == "-r") {
+            if (++c >= argc) {
+                std::fprintf(stderr, "No report file supplied.\n");
+                ERROR();
+            }
+
+            reportfile = new std::string(argv[c]);
+        } else if (arg == "-p") {
+            packets = true;
+        } else if (arg == "-w") {
+            wavefront = true;
+        } else if (arg == "-m") {
+            measure = true;
+        } else if (arg == "-q") {
+            compress = true;
         } else if (arg == "-t") {
             if (++c >= argc) {
                 std::fprintf(stderr, "No thread count given.\n");
@@ -76,6 +154,81 @@ int main(int argc, char* argv[])
             }
 
             thread_count = atoi(argv[c]);
+        } else if (arg == "-f") {
+            if (++c >= argc) {
+                std::fprintf(stderr, "No frame count given.\n");
+                ERROR();
+            }
+
+            frames = atoi(argv[c]);
+            if (frames < 1) {
+                std::fprintf(stderr, "Invalid frame count %s.\n", argv[c]);
+                ERROR();
+            }
+        } else if (arg == "-b") {
+            if (++c >= argc) {
+                std::fprintf(stderr, "No BVH builder given.\n");
+                ERROR();
+            }
+
+            int b;
+            for (b = 0; b < N_BVH_BUILDERS; b++) {
+                if (BVH::BuilderName((BVHBuilder) b) == std::string(argv[c])) {
+                    break;
+                }
+            }
+
+            if (b == N_BVH_BUILDERS) {
+                std::fprintf(stderr, "Unknown BVH builder %s.\n", argv[c]);
+                ERROR();
+            }
+
+            bvh_options.builder = (BVHBuilder) b;
+        } else if (arg == "-d") {
+            if (++c >= argc) {
+                std::fprintf(stderr, "No duplication ratio given.\n");
+                ERROR();
+            }
+
+            bvh_options.max_duplication = atof(argv[c]);
+        } else if (arg == "-l") {
+            if (++c >= argc) {
+                std::fprintf(stderr, "No BVH layout given.\n");
+                ERROR();
+            }
+
+            int l;
+            for (l = 0; l < N_BVH_LAYOUTS; l++) {
+                if (BVH::LayoutName((BVHLayout) l) == std::string(argv[c])) {
+                    break;
+                }
+            }
+
+            if (l == N_BVH_LAYOUTS) {
+                std::fprintf(stderr, "Unknown BVH layout %s.\n", argv[c]);
+                ERROR();
+            }
+
+            bvh_options.layout = (BVHLayout) l;
+        } else if (arg == "-a") {
+            if (++c >= argc) {
+                std::fprintf(stderr, "No acceleration structure given.\n");
+                ERROR();
+            }
+
+            int a;
+            for (a = 0; a < N_ACCEL_TYPES; a++) {
+                if (Accelerator::TypeName((AccelType) a) == std::string(argv[c])) {
+                    break;
+                }
+            }
+
+            if (a == N_ACCEL_TYPES) {
+                std::fprintf(stderr, "Unknown acceleration structure %s.\n", argv[c]);
+                ERROR();
+            }
+
+            accel_type = (AccelType) a;
         }
 
         ++c;
@@ -90,17 +243,64 @@ int main(int argc, char* argv[])
         outfile = new std::string("raytraced.png");
     }
 
+    /* Compressed meshes keep no vertices that could be moved */
+    if (compress && frames > 1) {
+        std::fprintf(stderr, "Compressed meshes can't be animated.\n");
+        ERROR();
+    }
+
     Scene scene;
     SceneParser parser(*scenefile);
     SceneComponent* sc;
 
     int max_verts = -1, max_norms = -1;
-    VertexPool vert_pool, norm_pool;
-    Vector3D v1, v2, v3, n1, n2, n3;
+    std::shared_ptr<VertexPool> vert_pool(new VertexPool), norm_pool(new VertexPool);
 
     MaterialPool mat_pool;
     mat_pool.push_back(DEFAULT_MAT);
 
+    /* Meshes in order of definition, so instances can refer to them by
+       index, and the one being defined, if any. Objects inside a mesh
+       definition go to the mesh instead of the scene. */
+    std::vector<Mesh*> meshes;
+    Mesh* cur_mesh = nullptr;
+    auto add_object = [&](const SceneObject* obj) {
+        if (cur_mesh) {
+            cur_mesh->AddObject(obj);
+        } else {
+            scene.AddObject(obj);
+        }
+    };
+
+    /* Triangles go into one triangle mesh for the scene and one for
+       the mesh being defined, which are added like any other object
+       once that ends. Each remembers how many materials there were
+       when it last took one. */
+    struct OpenTriangleMesh {
+        TriangleMesh* mesh = nullptr;
+        size_t n_mats = 0;
+    } scene_tris, mesh_tris;
+    auto close_triangle_mesh = [&](OpenTriangleMesh& tris) {
+        if (tris.mesh) {
+            if (compress && !tris.mesh->Compress()) {
+                std::fprintf(stderr,
+                             "WARNING: the triangles of a mesh in scene file %s are "
+                             "too small for its bounds to compress, kept as is\n",
+                             scenefile->c_str());
+            }
+            scene.AddTriangleMesh(tris.mesh);
+            add_object(tris.mesh);
+            tris = OpenTriangleMesh();
+        }
+    };
+
+    auto degenerate = [&](const char* what) {
+        std::fprintf(stderr,
+                     "ERROR: degenerate \"%s\" in scene file %s\n",
+                     what, scenefile->c_str());
+        return 1;
+    };
+
     /* Build the scene. */
     std::printf("Building scene from description file %s...\n", scenefile->c_str());
     while ((sc = parser.GetNext())) {
@@ -118,10 +318,51 @@ int main(int argc, char* argv[])
             mat_pool.push_back(Material(sc));
             break;
         case CK_SPHERE:
-            scene.AddObject(new Sphere(Vector3D(v[0].d_val, v[1].d_val, v[2].d_val),
-                                       v[3].d_val,
-                                       mat_pool.back()));
+            add_object(new Sphere(Vector3D(v[0].d_val, v[1].d_val, v[2].d_val),
+                                  v[3].d_val,
+                                  mat_pool.back()));
+            break;
+        case CK_QUAD: {
+            Vector3D corner(sc, 0), edge1(sc, 3), edge2(sc, 6);
+            if (edge1.Cross(edge2).Norm() == 0) {
+                return degenerate("quad");
+            }
+            add_object(new Quad(corner, edge1, edge2, mat_pool.back()));
+            break;
+        }
+        case CK_DISK: {
+            Vector3D center(sc, 0), normal(sc, 3);
+            if (normal.Norm() == 0 || !(v[6].d_val > 0)) {
+                return degenerate("disk");
+            }
+            add_object(new Disk(center, normal, v[6].d_val, mat_pool.back()));
+            break;
+        }
+        case CK_CYLINDER: {
+            Vector3D base(sc, 0), top(sc, 3);
+            if (base == top || !(v[6].d_val > 0)) {
+                return degenerate("cylinder");
+            }
+            add_object(new Cylinder(base, top, v[6].d_val, mat_pool.back()));
+            break;
+        }
+        case CK_BOX: {
+            /* Flat boxes are quads */
+            Vector3D lo(sc, 0), hi(sc, 3);
+            if (!(lo < hi)) {
+                return degenerate("box");
+            }
+            add_object(new AxisBox(lo, hi, mat_pool.back()));
+            break;
+        }
+        case CK_ORIENTED_BOX: {
+            Vector3D center(sc, 0), half_extents(sc, 3), degrees(sc, 6);
+            if (!(Vector3D() < half_extents)) {
+                return degenerate("oriented_box");
+            }
+            add_object(new OrientedBox(center, half_extents, degrees, mat_pool.back()));
             break;
+        }
         case CK_POINT_LIGHT:
         case CK_SPOT_LIGHT:
         case CK_DIRECTIONAL_LIGHT:
@@ -141,13 +382,13 @@ int main(int argc, char* argv[])
                              "ERROR: \"max_vertices\" not declared before "
                              "vertex in scene file %s\n", scenefile->c_str());
                 return 1;
-            } else if ((int) vert_pool.size() + 1 > max_verts) {
+            } else if ((int) vert_pool->size() + 1 > max_verts) {
                 std::fprintf(stderr,
                              "ERROR: number of vertices in scene file %s "
                              "exceeds max_vertices\n", scenefile->c_str());
                 return 1;
             }
-            vert_pool.push_back(Vector3D(sc));
+            vert_pool->push_back(Vector3D(sc));
             break;
         case CK_NORMAL:
             if (max_norms < 1) {
@@ -155,32 +396,101 @@ int main(int argc, char* argv[])
                              "ERROR: \"max_normals\" not declared before "
                              "normal in scene file %s\n", scenefile->c_str());
                 return 1;
-            } else if ((int) norm_pool.size() + 1 > max_norms) {
+            } else if ((int) norm_pool->size() + 1 > max_norms) {
                 std::fprintf(stderr,
                              "ERROR: number of normals in scene file %s "
                              "exceeds max_normals\n", scenefile->c_str());
                 return 1;
             }
-            norm_pool.push_back(Vector3D(sc));
+            norm_pool->push_back(Vector3D(sc));
             break;
         case CK_NORMAL_TRIANGLE:
-            n1 = norm_pool[v[3].i_val];
-            n2 = norm_pool[v[4].i_val];
-            n3 = norm_pool[v[5].i_val];
-        case CK_TRIANGLE:
-            v1 = vert_pool[v[0].i_val];
-            v2 = vert_pool[v[1].i_val];
-            v3 = vert_pool[v[2].i_val];
-            Triangle* tri;
+        case CK_TRIANGLE: {
+            OpenTriangleMesh& tris = cur_mesh ? mesh_tris : scene_tris;
+            if (!tris.mesh) {
+                tris.mesh = new TriangleMesh(vert_pool, norm_pool);
+            }
+            if (tris.n_mats != mat_pool.size()) {
+                tris.mesh->SetMaterial(mat_pool.back());
+                tris.n_mats = mat_pool.size();
+            }
+
             if (sc->key == CK_TRIANGLE) {
-                tri = new Triangle(v1, v2, v3, mat_pool.back());
+                tris.mesh->AddTriangle(v[0].i_val, v[1].i_val, v[2].i_val);
             } else {
-                tri = new NormalTriangle(v1, v2, v3,
-                                         n1, n2, n3,
-                                         mat_pool.back());
+                tris.mesh->AddTriangle(v[0].i_val, v[1].i_val, v[2].i_val,
+                                       v[3].i_val, v[4].i_val, v[5].i_val);
+            }
+            break;
+        }
+        case CK_MESH_BEGIN:
+            if (cur_mesh) {
+                std::fprintf(stderr,
+                             "ERROR: nested \"mesh_begin\" in scene file %s\n",
+                             scenefile->c_str());
+                return 1;
+            }
+            cur_mesh = new Mesh();
+            meshes.push_back(cur_mesh);
+            scene.AddMesh(cur_mesh);
+            break;
+        case CK_MESH_END:
+            if (!cur_mesh) {
+                std::fprintf(stderr,
+                             "ERROR: \"mesh_end\" without \"mesh_begin\" "
+                             "in scene file %s\n", scenefile->c_str());
+                return 1;
+            }
+            close_triangle_mesh(mesh_tris);
+            cur_mesh = nullptr;
+            break;
+        case CK_SPHERE_SET: {
+            /* Relative to the scene file */
+            std::string path = sc->path();
+            size_t dir_end = scenefile->find_last_of('/');
+            if (!path.empty() && path[0] != '/' && dir_end != std::string::npos) {
+                path = scenefile->substr(0, dir_end + 1) + path;
             }
 
-            scene.AddObject(tri);
+            SphereSet* set = new SphereSet();
+            if (!set->Load(path, mat_pool)) {
+                std::fprintf(stderr,
+                             "ERROR: sphere set %s in scene file %s is missing, "
+                             "damaged or uses undefined materials\n",
+                             path.c_str(), scenefile->c_str());
+                delete set;
+                return 1;
+            }
+            scene.AddSphereSet(set);
+            add_object(set);
+            break;
+        }
+        case CK_PLANE:
+            /* Meshes trace their objects through BVHs, which can't
+               hold a plane */
+            if (cur_mesh) {
+                std::fprintf(stderr,
+                             "ERROR: plane inside a mesh definition "
+                             "in scene file %s\n", scenefile->c_str());
+                return 1;
+            }
+            scene.AddUnboundedObject(new Plane(Vector3D(v[0].d_val, v[1].d_val, v[2].d_val),
+                                               Vector3D(v[3].d_val, v[4].d_val, v[5].d_val),
+                                               mat_pool.back()));
+            break;
+        case CK_INSTANCE:
+            if (cur_mesh) {
+                std::fprintf(stderr,
+                             "ERROR: instance inside a mesh definition "
+                             "in scene file %s\n", scenefile->c_str());
+                return 1;
+            } else if (v[0].i_val < 0 || v[0].i_val >= (int) meshes.size()) {
+                std::fprintf(stderr,
+                             "ERROR: instance of undefined mesh %d "
+                             "in scene file %s\n", v[0].i_val, scenefile->c_str());
+                return 1;
+            }
+            scene.AddObject(new Instance(meshes[v[0].i_val], Transform(sc, 1)));
             break;
         default:
             /* TODO: Implement this? */
@@ -189,39 +499,197 @@ int main(int argc, char* argv[])
 
         delete sc;
     }
+    close_triangle_mesh(mesh_tris);
+    cur_mesh = nullptr;
+    close_triangle_mesh(scene_tris);
 
     std::printf("Scene building complete. "
                 "Added %ld vertices, %ld normals, "
-                "and %ld materials.\n",
-                vert_pool.size(), norm_pool.size(), mat_pool.size());
+                "%ld materials and %ld meshes.\n",
+                vert_pool->size(), norm_pool->size(), mat_pool.size(), meshes.size());
+
+    /* Compressed meshes let go of the buffers once packed, unless the
+       vertices are to be moved between frames */
+    if (frames == 1) {
+        vert_pool.reset();
+        norm_pool.reset();
+    }
+
+    if (cachefile) {
+        /* The parser only saw the names of the sphere sets' files */
+        uint64_t geometry_hash = parser.GetGeometryHash();
+        for (auto set : scene.GetSphereSets()) {
+            geometry_hash = set->Hash(geometry_hash);
+        }
+
+        /* Compressed meshes' trees are built over snapped vertices */
+        if (compress) {
+            geometry_hash = fnv1a("q", 1, geometry_hash);
+        }
+        scene.SetBVHCache(*cachefile, geometry_hash);
+    }
 
-    std::printf("Initializing BVH...\n");
-    scene.InitBVH();
+    std::printf("Initializing %s (%s builder, %s layout)...\n",
+                Accelerator::TypeName(accel_type),
+                BVH::BuilderName(bvh_options.builder),
+                BVH::LayoutName(bvh_options.layout));
+
+    /* The render threads would otherwise sit idle, so build with all
+       of them. */
+    bvh_options.n_threads = thread_count;
+    auto build_start = std::chrono::system_clock::now();
+    scene.InitBVH(bvh_options, accel_type);
+    std::chrono::duration<double> build_time = std::chrono::system_clock::now() - build_start;
+
+    if (reportfile) {
+        const BVH* bvh = scene.GetBVH();
+        if (!bvh) {
+            std::fprintf(stderr, "WARNING: %s is not made from a BVH, no report written\n",
+                         Accelerator::TypeName(accel_type));
+        } else {
+            BVHReport report(*bvh);
+            report.PrintText(stdout);
+
+            /* Triangles and sphere sets' spheres sit in their own trees */
+            for (auto tri_mesh : scene.GetTriangleMeshes()) {
+                std::printf("Triangle mesh of %zu triangles:\n", tri_mesh->Size());
+                BVHReport(*tri_mesh->GetBVH()).PrintText(stdout);
+            }
+            for (auto set : scene.GetSphereSets()) {
+                std::printf("Sphere set of %zu spheres:\n", set->Size());
+                BVHReport(*set->GetBVH()).PrintText(stdout);
+            }
+
+            FILE* f = std::fopen(reportfile->c_str(), "w");
+            if (!f) {
+                std::fprintf(stderr, "ERROR: could not write report to %s\n",
+                             reportfile->c_str());
+            } else {
+                std::fprintf(f, "{\n  \"scene\": ");
+                report.PrintJSON(f, 2);
+
+                const std::vector<TriangleMesh*>& tri_meshes = scene.GetTriangleMeshes();
+                std::fprintf(f, ",\n  \"triangle_meshes\": [");
+                for (size_t i = 0; i < tri_meshes.size(); i++) {
+                    std::fprintf(f, "%s\n    ", i > 0 ? "," : "");
+                    BVHReport(*tri_meshes[i]->GetBVH()).PrintJSON(f, 4);
+                }
+                std::fprintf(f, "%s]", tri_meshes.empty() ? "" : "\n  ");
+
+                const std::vector<SphereSet*>& sets = scene.GetSphereSets();
+                std::fprintf(f, ",\n  \"sphere_sets\": [");
+                for (size_t i = 0; i < sets.size(); i++) {
+                    std::fprintf(f, "%s\n    ", i > 0 ? "," : "");
+                    BVHReport(*sets[i]->GetBVH()).PrintJSON(f, 4);
+                }
+                std::fprintf(f, "%s]\n}\n", sets.empty() ? "" : "\n  ");
+                std::fclose(f);
+            }
+        }
+    }
+
+    scene.SetPacketTracing(packets);
+    scene.SetWavefront(wavefront);
 
     uint8_t* raw = new uint8_t[scene.GetHeight() * scene.GetWidth() * 4];
 
     /* Run the renderer. */
+    CacheCounters counters;
+    if (measure && !counters.Start()) {
+        std::fprintf(stderr, "WARNING: cache counters are not available here\n");
+        measure = false;
+    }
+
     auto start = std::chrono::system_clock::now();
-    std::vector<std::thread> threads;
+    std::chrono::duration<double> update_time(0);
+    Transform turn = Transform::Rotate(AXIS_Y, 360.0 / frames);
 
-    for (int t = 0; t < thread_count; t++) {
-        threads.push_back(std::thread(render_stripe, &scene, t, thread_count, raw));
-    }
+    for (int frame = 0; frame < frames; frame++) {
+        if (frame > 0) {
+            auto update_start = std::chrono::system_clock::now();
+            for (auto& vert : *vert_pool) {
+                vert = turn.Point(vert);
+            }
+            for (auto& norm : *norm_pool) {
+                norm = turn.Normal(norm);
+            }
+            for (auto set : scene.GetSphereSets()) {
+                set->Move(turn);
+            }
+
+            size_t n_rebuilt = scene.UpdateBVH();
+            std::chrono::duration<double> frame_update =
+                std::chrono::system_clock::now() - update_start;
+            update_time += frame_update;
+            std::printf("Frame %d: updated in %.3lf sec, %zu BVHs rebuilt\n",
+                        frame, frame_update.count(), n_rebuilt);
+        }
 
-    for (int t = 0; t < thread_count; t++) {
-        threads[t].join();
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < thread_count; t++) {
+            threads.push_back(std::thread(render_stripe, &scene, t, thread_count, raw));
+        }
+
+        for (int t = 0; t < thread_count; t++) {
+            threads[t].join();
+        }
+
+        /* Write the image to disk */
+        std::string path = frames == 1 ? *outfile : frame_path(*outfile, frame);
+        stbi_write_png(path.c_str(), scene.GetWidth(), scene.GetHeight(), 4, raw, scene.GetWidth() * 4);
     }
 
-    /* Write the image to disk */
-    stbi_write_png(outfile->c_str(), scene.GetWidth(), scene.GetHeight(), 4, raw, scene.GetWidth() * 4);
+    if (measure) {
+        counters.Stop();
+    }
 
     /* Record the timing and clean up. */
-    std::chrono::duration<double> etime = std::chrono::system_clock::now() - start;
-    std::printf("\nRender time: %.2lf sec\n", etime.count());
+    std::chrono::duration<double> etime = std::chrono::system_clock::now() - start - update_time;
+    AccelStats stats = scene.GetAccelerator()->GetStats();
+    std::printf("\n%s build time: %.2lf sec "
+                "(%zu nodes, %zu object references, %.2lf MB)\n",
+                Accelerator::TypeName(accel_type), build_time.count(),
+                stats.n_nodes, stats.n_refs, stats.bytes / 1048576.0);
+
+    /* Meshes, triangle meshes and sphere sets have trees of their own,
+       which usually hold most of the scene */
+    std::vector<const BVH*> bottom;
+    for (auto mesh : meshes) {
+        bottom.push_back(mesh->GetBVH());
+    }
+    for (auto tri_mesh : scene.GetTriangleMeshes()) {
+        bottom.push_back(tri_mesh->GetBVH());
+    }
+    for (auto set : scene.GetSphereSets()) {
+        bottom.push_back(set->GetBVH());
+    }
+    if (!bottom.empty()) {
+        AccelStats total = {0, 0, 0};
+        for (auto tree : bottom) {
+            AccelStats tree_stats = tree->GetStats();
+            total.n_nodes += tree_stats.n_nodes;
+            total.n_refs += tree_stats.n_refs;
+            total.bytes += tree_stats.bytes;
+        }
+        std::printf("%zu bottom-level BVHs "
+                    "(%zu nodes, %zu primitive references, %.2lf MB)\n",
+                    bottom.size(), total.n_nodes, total.n_refs, total.bytes / 1048576.0);
+    }
+    std::printf("Render time: %.2lf sec\n", etime.count());
+    if (frames > 1) {
+        std::printf("Update time: %.2lf sec over %d frames\n", update_time.count(), frames - 1);
+    }
+
+    if (measure) {
+        counters.Print(stdout);
+    }
 
     delete[] raw;
     delete scenefile;
     delete outfile;
+    delete cachefile;
+    delete reportfile;
 
     return 0;
 }
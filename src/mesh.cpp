@@ -0,0 +1,85 @@
+#include <cassert>
+
+#include "bounds.hpp"
+#include "bvh.hpp"
+#include "intersection.hpp"
+#include "mesh.hpp"
+
+Mesh::Mesh() :
+    bounds(),
+    bvh(nullptr)
+{
+}
+
+Mesh::~Mesh()
+{
+    delete this->bvh;
+
+    for (auto obj : this->objects) {
+        delete obj;
+    }
+}
+
+void Mesh::AddObject(const SceneObject* obj)
+{
+    assert(!this->bvh);
+
+    this->objects.push_back(obj);
+    this->bounds.Expand(Bounds(obj->GetBoundingBox()));
+}
+
+void Mesh::Build(const BVHOptions& options)
+{
+    if (!this->bvh) {
+        this->bvh = new BVH(this->objects, options);
+    }
+}
+
+bool Mesh::UpdateBVH(const BVHOptions& options)
+{
+    assert(this->bvh);
+
+    this->bounds = Bounds();
+    for (auto obj : this->objects) {
+        this->bounds.Expand(Bounds(obj->GetBoundingBox()));
+    }
+
+    this->bvh->Refit(options.n_threads);
+    if (!this->bvh->NeedsRebuild()) {
+        return false;
+    }
+
+    delete this->bvh;
+    this->bvh = nullptr;
+    Build(options);
+    return true;
+}
+
+void Mesh::SetBVH(BVH* bvh)
+{
+    delete this->bvh;
+    this->bvh = bvh;
+}
+
+SceneObjectIntersection Mesh::Intersects(const Ray3D& ray, double max_dist) const
+{
+    assert(this->bvh);
+    return this->bvh->Intersects(ray, max_dist);
+}
+
+const SceneObject* Mesh::ClosestHit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    assert(this->bvh);
+    return this->bvh->ClosestHit(ray, max_dist, hit);
+}
+
+bool Mesh::Occluded(const Ray3D& ray, double max_dist) const
+{
+    assert(this->bvh);
+    return this->bvh->Occluded(ray, max_dist);
+}
+
+Box Mesh::GetBoundingBox() const
+{
+    return this->bounds.ToBox();
+}
@@ -0,0 +1,70 @@
+#ifndef MESH_HPP_
+#define MESH_HPP_
+
+#include <vector>
+
+#include "bounds.hpp"
+#include "box.hpp"
+#include "bvh.hpp"
+#include "intersection.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+
+/* A group of objects defined once in object space and placed in the
+ * scene any number of times through Instances. The mesh owns its
+ * objects and its own (bottom-level) BVH over them.
+ */
+class Mesh {
+public:
+    Mesh();
+    ~Mesh();
+
+    void AddObject(const SceneObject* obj);
+
+    /* Build the bottom-level BVH. Does nothing if it is already
+       built. */
+    void Build(const BVHOptions& options = BVHOptions());
+
+    /* Catch up with objects that have changed in object space since
+       the BVH was built, e.g. triangle meshes whose vertices moved, by
+       refitting it, or rebuilding it once refitting has made it too
+       loose. Returns whether it was rebuilt. */
+    bool UpdateBVH(const BVHOptions& options = BVHOptions());
+
+    /* Closest object hit by a ray in object space */
+    SceneObjectIntersection Intersects(const Ray3D& ray, double max_dist) const;
+
+    /* Closest object hit by a ray in object space, with the hit for
+       its Finalize(); null if nothing is hit */
+    const SceneObject* ClosestHit(const Ray3D& ray, double max_dist, PrimHit& hit) const;
+
+    /* Whether anything in the mesh is hit closer than max_dist */
+    bool Occluded(const Ray3D& ray, double max_dist) const;
+
+    /* Object-space bounds of the whole mesh */
+    Box GetBoundingBox() const;
+
+    inline size_t Size() const {
+        return objects.size();
+    }
+
+    inline const std::vector<const SceneObject*>& GetObjects() const {
+        return objects;
+    }
+
+    /* The bottom-level BVH, if built */
+    inline const BVH* GetBVH() const {
+        return bvh;
+    }
+
+    /* Use a BVH built elsewhere over GetObjects(), e.g. one read from a
+       cache, instead of building one. The mesh takes ownership. */
+    void SetBVH(BVH* bvh);
+
+private:
+    Bounds bounds;
+    BVH* bvh;
+    std::vector<const SceneObject*> objects;
+};
+
+#endif
@@ -22,14 +22,14 @@ NormalTriangle::~NormalTriangle()
 {
 }
 
-SceneObjectIntersection NormalTriangle::Intersects(const Ray3D &ray, double max_dist) const
+SceneObjectIntersection NormalTriangle::Finalize(const Ray3D& ray, const PrimHit& hit) const
 {
-    SceneObjectIntersection intersected = Triangle::Intersects(ray, max_dist);
-    if (intersected.intersected) {
-        intersected.norm = Ray3D(intersected.point,
-                                 this->NormalAtPoint(intersected.point));
-    }
-
+    /* The same weights NormalAtPoint() works out from areas */
+    SceneObjectIntersection intersected = Triangle::Finalize(ray, hit);
+    intersected.norm = Ray3D(intersected.point,
+                             this->norms[0] * (1 - hit.u - hit.v)
+                             + this->norms[1] * hit.u
+                             + this->norms[2] * hit.v);
     return intersected;
 }
 
@@ -15,7 +15,10 @@ public:
 
     virtual ~NormalTriangle();
 
-    virtual SceneObjectIntersection Intersects(const Ray3D& ray, double max_dist) const override;
+    /* Interpolates the vertex normals with the hit's barycentrics */
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
     virtual Vector3D NormalAtPoint(const Vector3D& v) const override;
 
 protected:
@@ -0,0 +1,22 @@
+#include "intersection.hpp"
+#include "object_part.hpp"
+
+ObjectPart::ObjectPart(const SceneObject* owner, const Material& mat) :
+    SceneObject(owner->GetPos(), mat),
+    owner(owner)
+{
+}
+
+ObjectPart::~ObjectPart()
+{
+}
+
+SceneObjectIntersection ObjectPart::Intersects(const Ray3D& ray, double max_dist) const
+{
+    return SceneObjectIntersection(this, false, ray);
+}
+
+Box ObjectPart::GetBoundingBox() const
+{
+    return owner->GetBoundingBox();
+}
@@ -0,0 +1,34 @@
+#ifndef OBJECT_PART_HPP_
+#define OBJECT_PART_HPP_
+
+#include "box.hpp"
+#include "intersection.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "vector.hpp"
+
+/* The primitives of an object made of many, e.g. a TriangleMesh, that
+ * have one material. Hit records name the part rather than the object,
+ * so shading finds the right material; the part itself is never
+ * intersected.
+ */
+class ObjectPart : public SceneObject {
+public:
+    ObjectPart(const SceneObject* owner, const Material& mat);
+    virtual ~ObjectPart();
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    virtual Box GetBoundingBox() const override;
+
+private:
+    const SceneObject* owner;
+
+    virtual inline Vector3D NormalAtPoint(const Vector3D& v) const override
+    {
+        return Vector3D();
+    };
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef OCT_NORMAL_HPP_
+#define OCT_NORMAL_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+#include "vector.hpp"
+
+/* Unit vectors in 32 bits, by octahedral mapping: the direction is
+   projected onto the octahedron |x| + |y| + |z| = 1, whose lower half
+   is folded over the upper, and the resulting point of the square
+   [-1, 1]^2 is stored as two signed 16-bit fractions, x in the low
+   half. That is within about 0.004 degrees of the direction encoded;
+   its length is lost. */
+
+/* Never the encoding of a direction, as neither half is ever -32768 */
+const uint32_t NO_OCT_NORMAL = 0x80008000;
+
+inline uint32_t oct_encode(const Vector3D& n)
+{
+    double x = n.GetValue(AXIS_X), y = n.GetValue(AXIS_Y), z = n.GetValue(AXIS_Z);
+    double l1 = std::fabs(x) + std::fabs(y) + std::fabs(z);
+    if (!(l1 > 0)) {
+        return 0;
+    }
+
+    x /= l1;
+    y /= l1;
+    if (z < 0) {
+        double fx = (1 - std::fabs(y)) * (x < 0 ? -1 : 1);
+        y = (1 - std::fabs(x)) * (y < 0 ? -1 : 1);
+        x = fx;
+    }
+
+    int16_t ix = (int16_t) std::lround(std::max(-1.0, std::min(1.0, x)) * 32767);
+    int16_t iy = (int16_t) std::lround(std::max(-1.0, std::min(1.0, y)) * 32767);
+    return (uint32_t) (uint16_t) ix | (uint32_t) (uint16_t) iy << 16;
+}
+
+/* The unit vector encoded by oct_encode() */
+inline Vector3D oct_decode(uint32_t code)
+{
+    double x = (int16_t) (code & 0xffff) / 32767.0;
+    double y = (int16_t) (code >> 16) / 32767.0;
+    double z = 1 - std::fabs(x) - std::fabs(y);
+    if (z < 0) {
+        double fx = (1 - std::fabs(y)) * (x < 0 ? -1 : 1);
+        y = (1 - std::fabs(x)) * (y < 0 ? -1 : 1);
+        x = fx;
+    }
+
+    Vector3D n(x, y, z);
+    return n / n.Norm();
+}
+
+#endif
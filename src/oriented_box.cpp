@@ -0,0 +1,61 @@
+#include "axis_box.hpp"
+#include "intersection.hpp"
+#include "oriented_box.hpp"
+
+OrientedBox::OrientedBox(const Vector3D& center, const Vector3D& half_extents,
+                         const Vector3D& degrees, const Material& mat) :
+    SceneObject(center, mat),
+    half_extents(half_extents),
+    to_world(Transform::Translate(center)
+             * Transform::Rotate(AXIS_Z, degrees.GetZ())
+             * Transform::Rotate(AXIS_Y, degrees.GetY())
+             * Transform::Rotate(AXIS_X, degrees.GetX())),
+    to_box(to_world.Inverse())
+{
+}
+
+OrientedBox::~OrientedBox()
+{
+}
+
+bool OrientedBox::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    Vector3D origin = this->to_box.Point(ray.GetOrigin()),
+        dir = this->to_box.Vector(ray.GetDir());
+    double o[N_AXES], d[N_AXES], lo[N_AXES], hi[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        o[axis] = origin.GetValue(axis);
+        d[axis] = dir.GetValue(axis);
+        hi[axis] = this->half_extents.GetValue(axis);
+        lo[axis] = -hi[axis];
+    }
+
+    if (!hit_box(o, d, lo, hi, max_dist, hit.dist)) {
+        return false;
+    }
+
+    hit.part = this;
+    return true;
+}
+
+SceneObjectIntersection OrientedBox::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    return this->FinalizeSolid(ray, hit);
+}
+
+SceneObjectIntersection OrientedBox::Intersects(const Ray3D& ray, double max_dist) const
+{
+    return this->HitThenFinalize(ray, max_dist);
+}
+
+Vector3D OrientedBox::NormalAtPoint(const Vector3D& v) const
+{
+    Vector3D normal = box_normal(-this->half_extents, this->half_extents,
+                                 this->to_box.Point(v));
+    return this->to_world.Normal(normal).Normalized();
+}
+
+Box OrientedBox::GetBoundingBox() const
+{
+    return this->to_world.Apply(Box(-this->half_extents, this->half_extents));
+}
@@ -0,0 +1,40 @@
+#ifndef ORIENTED_BOX_HPP_
+#define ORIENTED_BOX_HPP_
+
+#include "box.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "transform.hpp"
+#include "vector.hpp"
+
+/* A solid box of the given half extents around center, turned by
+ * rotations about x, y and z in degrees, applied in that order. Rays
+ * are turned the other way into the box's frame, where it is an
+ * AxisBox; turning doesn't change distances. */
+class OrientedBox : public SceneObject {
+public:
+    OrientedBox(const Vector3D& center, const Vector3D& half_extents,
+                const Vector3D& degrees, const Material& mat);
+    virtual ~OrientedBox();
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray, double max_dist) const override;
+
+    /* The hit point and normal wait for Finalize() */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
+    /* Around the turned corners, so no bigger than it has to be */
+    virtual Box GetBoundingBox() const override;
+
+private:
+    Vector3D half_extents;
+
+    /* From the box's frame, where it is centered on the origin, to the
+       scene's, and back */
+    Transform to_world, to_box;
+
+    virtual Vector3D NormalAtPoint(const Vector3D& v) const override;
+};
+
+#endif
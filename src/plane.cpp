@@ -1,3 +1,6 @@
+#include <cmath>
+
+#include "box.hpp"
 #include "intersection.hpp"
 #include "plane.hpp"
 #include "ray.hpp"
@@ -14,30 +17,58 @@ Plane::~Plane()
 {
 }
 
-SceneObjectIntersection Plane::Intersects(const Ray3D &ray, double max_dist) const
+bool Plane::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
 {
     double denom = ray.GetDir().Dot(this->normal);
 
     /* Infinite / zero intersections if ray perpendicular to normal */
     if (is_zero(denom)) {
+        return false;
+    }
+
+    double t = (this->pos - ray.GetOrigin()).Dot(this->normal) / denom;
+    if (!(t >= EPSILON && t <= max_dist)) {
+        return false;
+    }
+
+    hit.dist = t;
+    hit.part = this;
+    return true;
+}
+
+SceneObjectIntersection Plane::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    return SceneObjectIntersection(this,
+                                   true,
+                                   ray,
+                                   INC_INWARD,
+                                   ray.Point(hit.dist),
+                                   this->normal);
+}
+
+SceneObjectIntersection Plane::Intersects(const Ray3D &ray, double max_dist) const
+{
+    PrimHit hit;
+    if (!this->Hit(ray, max_dist, hit)) {
         return SceneObjectIntersection(this, false, ray);
-    } else {
-        double t = (this->pos - ray.GetOrigin()).Dot(this->normal) / denom;
-
-        if (t >= EPSILON && t <= max_dist) {
-            return SceneObjectIntersection(this,
-                                           true,
-                                           ray,
-                                           INC_INWARD,
-                                           ray.Point(t),
-                                           this->normal);
-        } else {
-            return SceneObjectIntersection(this, false, ray);
-        }
     }
+
+    return this->Finalize(ray, hit);
+}
+
+bool Plane::Occludes(const Ray3D& ray, double max_dist) const
+{
+    PrimHit hit;
+    return this->Hit(ray, max_dist, hit);
 }
 
 Vector3D Plane::NormalAtPoint(const Vector3D &v) const
 {
     return this->normal;
 }
+
+Box Plane::GetBoundingBox() const
+{
+    return Box(Vector3D(-INFINITY, -INFINITY, -INFINITY),
+               Vector3D(INFINITY, INFINITY, INFINITY));
+}
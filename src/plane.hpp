@@ -6,6 +6,10 @@
 #include "scene_object.hpp"
 #include "vector.hpp"
 
+/* An infinite plane through origin. Its bounding box is all of space,
+ * so planes are traced outside the acceleration structures, see
+ * Scene::AddUnboundedObject(); Triangle narrows the plane down to
+ * something that can go in them. */
 class Plane : public SceneObject {
 public:
     Plane(const Vector3D& origin, const Vector3D& normal, const Material& mat);
@@ -14,8 +18,16 @@ public:
     virtual SceneObjectIntersection Intersects(const Ray3D& ray,
                                                double max_dist) const override;
 
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
+    virtual bool Occludes(const Ray3D& ray, double max_dist) const override;
+
     virtual Vector3D NormalAtPoint(const Vector3D& v) const override;
 
+    virtual Box GetBoundingBox() const override;
+
 protected:
     Vector3D normal;
 };
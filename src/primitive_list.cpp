@@ -0,0 +1,79 @@
+#include <typeinfo>
+
+#include "primitive_list.hpp"
+
+PrimitiveList::PrimitiveList()
+{
+}
+
+PrimitiveList::PrimitiveList(const std::vector<const SceneObject*>& objs)
+{
+    this->objs.reserve(objs.size());
+    this->refs.reserve(objs.size());
+    for (auto obj : objs) {
+        Add(obj);
+    }
+
+    Finish();
+}
+
+void PrimitiveList::Add(const SceneObject* obj)
+{
+    /* Objects in several leaves share one copy */
+    auto copied = copies.find(obj);
+    objs.push_back(obj);
+    refs.push_back(copied != copies.end() ? refs[copied->second] : Copy(obj));
+    copies.emplace(obj, refs.size() - 1);
+}
+
+void PrimitiveList::Finish()
+{
+    spheres.shrink_to_fit();
+    std::unordered_map<const SceneObject*, uint32_t>().swap(copies);
+}
+
+void PrimitiveList::Update()
+{
+    spheres.clear();
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        auto copied = copies.find(objs[i]);
+        refs[i] = copied != copies.end() ? refs[copied->second] : Copy(objs[i]);
+        copies.emplace(objs[i], i);
+    }
+
+    Finish();
+}
+
+PrimitiveList::Ref PrimitiveList::Copy(const SceneObject* obj)
+{
+    Ref ref;
+
+    /* Only this exact type: a subclass could test itself in a way of
+       its own */
+    const std::type_info& type = typeid(*obj);
+
+    if (type == typeid(Sphere)) {
+        const Sphere* sphere = static_cast<const Sphere*>(obj);
+        SphereData data;
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            data.center[axis] = sphere->GetPos().GetValue(axis);
+        }
+        data.radius = sphere->GetRadius();
+
+        ref.kind = KIND_SPHERE;
+        ref.index = spheres.size();
+        spheres.push_back(data);
+    } else {
+        ref.kind = KIND_OBJECT;
+        ref.index = 0;
+    }
+
+    return ref;
+}
+
+size_t PrimitiveList::Bytes() const
+{
+    return objs.size() * (sizeof(const SceneObject*) + sizeof(Ref))
+        + spheres.size() * sizeof(SphereData);
+}
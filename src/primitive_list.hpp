@@ -0,0 +1,125 @@
+#ifndef PRIMITIVE_LIST_HPP_
+#define PRIMITIVE_LIST_HPP_
+
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "bounds.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "sphere.hpp"
+#include "triangle.hpp"
+
+/* An accelerator's object references, in leaf order, tagged by concrete
+ * type. Spheres have their geometry copied into an array of their own,
+ * so leaves test them with the inlined kernel in a switch, instead of
+ * calling through the vtable of an object somewhere on the heap. Every
+ * other object, triangle meshes included, is still tested through
+ * SceneObject.
+ */
+class PrimitiveList {
+public:
+    PrimitiveList();
+    PrimitiveList(const std::vector<const SceneObject*>& objs);
+
+    /* Append a reference to obj */
+    void Add(const SceneObject* obj);
+
+    /* Done adding references: let go of what Add() needs to share one
+       copy between references to the same object. The constructor from
+       objs calls this itself. */
+    void Finish();
+
+    /* Copy the spheres' geometry again, after the objects have moved */
+    void Update();
+
+    inline size_t Size() const {
+        return objs.size();
+    }
+
+    inline const SceneObject* operator[](size_t i) const {
+        return objs[i];
+    }
+
+    inline const std::vector<const SceneObject*>& GetObjects() const {
+        return objs;
+    }
+
+    /* Memory taken by the references and the copied geometry, once
+       finished */
+    size_t Bytes() const;
+
+    /* The same as (*this)[i]->Hit() and ->Occludes(); tri_ray must be
+       set up from ray */
+    inline bool Hit(uint32_t i, const Ray3D& ray, const TriangleRay& tri_ray,
+                    double max_dist, PrimHit& hit) const;
+    inline bool Occludes(uint32_t i, const Ray3D& ray, const TriangleRay& tri_ray,
+                         double max_dist) const;
+
+private:
+    enum Kind {
+        KIND_OBJECT,
+        KIND_SPHERE
+    };
+
+    /* What objs[i] is, and for spheres where its geometry is in their
+       array */
+    struct Ref {
+        uint32_t kind : 1;
+        uint32_t index : 31;
+    };
+
+    struct SphereData {
+        double center[N_AXES];
+        double radius;
+    };
+
+    /* Tag obj, copying its geometry if it is a sphere */
+    Ref Copy(const SceneObject* obj);
+
+    std::vector<const SceneObject*> objs;
+    std::vector<Ref> refs;
+    std::vector<SphereData> spheres;
+
+    /* Some reference to each object added so far, until finished */
+    std::unordered_map<const SceneObject*, uint32_t> copies;
+};
+
+inline bool PrimitiveList::Hit(uint32_t i, const Ray3D& ray, const TriangleRay& tri_ray,
+                               double max_dist, PrimHit& hit) const
+{
+    Ref ref = refs[i];
+
+    switch (ref.kind) {
+    case KIND_SPHERE: {
+        const SphereData& sphere = spheres[ref.index];
+        if (!hit_sphere(tri_ray.o, tri_ray.d, sphere.center, sphere.radius, max_dist, hit.dist)) {
+            return false;
+        }
+        break;
+    }
+    default:
+        return objs[i]->Hit(ray, max_dist, hit);
+    }
+
+    hit.part = objs[i];
+    return true;
+}
+
+inline bool PrimitiveList::Occludes(uint32_t i, const Ray3D& ray, const TriangleRay& tri_ray,
+                                    double max_dist) const
+{
+    Ref ref = refs[i];
+
+    switch (ref.kind) {
+    case KIND_SPHERE: {
+        PrimHit hit;
+        return Hit(i, ray, tri_ray, max_dist, hit);
+    }
+    default:
+        return objs[i]->Occludes(ray, max_dist);
+    }
+}
+
+#endif
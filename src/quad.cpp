@@ -0,0 +1,53 @@
+#include "intersection.hpp"
+#include "quad.hpp"
+#include "ray.hpp"
+#include "vector.hpp"
+
+/* The same side as Triangle's for corner, corner + edge1 and
+   corner + edge2 */
+Quad::Quad(const Vector3D& corner, const Vector3D& edge1, const Vector3D& edge2,
+           const Material& mat) :
+    Plane(corner + (edge1 + edge2) / 2, edge2.Cross(edge1), mat),
+    corner(corner),
+    edge1(edge1),
+    edge2(edge2)
+{
+    Vector3D n = edge1.Cross(edge2);
+    this->w = n / n.Dot(n);
+}
+
+Quad::~Quad()
+{
+}
+
+bool Quad::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    if (!Plane::Hit(ray, max_dist, hit)) {
+        return false;
+    }
+
+    Vector3D rel = this->corner.To(ray.Point(hit.dist));
+    double u = this->w.Dot(rel.Cross(this->edge2)),
+        v = this->w.Dot(this->edge1.Cross(rel));
+    if (!(u >= 0 && u <= 1 && v >= 0 && v <= 1)) {
+        return false;
+    }
+
+    hit.u = u;
+    hit.v = v;
+    return true;
+}
+
+Box Quad::GetBoundingBox() const
+{
+    Vector3D min_extent = this->corner, max_extent = this->corner;
+    Vector3D others[3] = {this->corner + this->edge1,
+                          this->corner + this->edge2,
+                          this->corner + this->edge1 + this->edge2};
+    for (auto& pt : others) {
+        min_extent = Vector3D::MinCombination(min_extent, pt);
+        max_extent = Vector3D::MaxCombination(max_extent, pt);
+    }
+
+    return Box(min_extent, max_extent);
+}
@@ -0,0 +1,33 @@
+#ifndef QUAD_HPP_
+#define QUAD_HPP_
+
+#include "box.hpp"
+#include "plane.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "vector.hpp"
+
+/* The parallelogram with a corner at corner and sides edge1 and edge2,
+ * e.g. a wall or a floor: two triangles' worth in one primitive. Like
+ * a triangle it has two sides and no inside. */
+class Quad : public Plane {
+public:
+    Quad(const Vector3D& corner, const Vector3D& edge1, const Vector3D& edge2,
+         const Material& mat);
+    virtual ~Quad();
+
+    /* Hits report how far along edge1 and edge2 they are, from 0 to 1,
+       as u and v */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+
+    virtual Box GetBoundingBox() const override;
+
+private:
+    Vector3D corner, edge1, edge2;
+
+    /* edge1 x edge2 over its squared norm, which turns the cross
+       products of a point with the edges into its coordinates */
+    Vector3D w;
+};
+
+#endif
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "bounds.hpp"
+#include "bvh.hpp"
+#include "quantized_bvh.hpp"
+#include "slab_test.hpp"
+
+/* Quantization steps are powers of two, so a step count times the
+   step is exact and decoding rounds only once, the same way whether
+   or not the compiler fuses the multiply and add. */
+static inline float step_size(int exponent)
+{
+    uint32_t bits = (uint32_t) (exponent + 127) << 23;
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline float decode_plane(float origin, int q, float step)
+{
+    return origin + (float) q * step;
+}
+
+QuantizedBVH4::QuantizedBVH4(const BVH& bvh) :
+    nodes(nullptr),
+    n_nodes(0),
+    prims(bvh.GetPrimitives())
+{
+    std::vector<Node> built;
+    if (prims.Size() == 0) {
+        /* The empty scene's root has no children at all */
+        float lo[N_AXES][W], hi[N_AXES][W];
+        built.push_back(Node());
+        Encode(built[0], lo, hi, 0);
+    } else {
+        Collapse(bvh.GetNodes(), 0, built);
+    }
+
+    n_nodes = built.size();
+    void* mem;
+    if (posix_memalign(&mem, sizeof(Node), n_nodes * sizeof(Node)) != 0) {
+        throw std::bad_alloc();
+    }
+    nodes = static_cast<Node*>(mem);
+    std::copy(built.begin(), built.end(), nodes);
+}
+
+QuantizedBVH4::~QuantizedBVH4()
+{
+    std::free(nodes);
+}
+
+void QuantizedBVH4::Encode(Node& node, const float lo[N_AXES][W],
+                           const float hi[N_AXES][W], int n_children)
+{
+    std::memset(&node, 0, sizeof(node));
+    node.n_children = n_children;
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        if (n_children == 0) {
+            continue;
+        }
+
+        float node_lo = *std::min_element(lo[axis], lo[axis] + n_children);
+        float node_hi = *std::max_element(hi[axis], hi[axis] + n_children);
+
+        /* Smallest step that spans the node in 255 steps */
+        int exponent;
+        std::frexp(((double) node_hi - node_lo) / UINT8_MAX, &exponent);
+        exponent = std::max(exponent, -126);
+        while (exponent < 127 &&
+               decode_plane(node_lo, UINT8_MAX, step_size(exponent)) < node_hi) {
+            exponent++;
+        }
+
+        float step = step_size(exponent);
+        node.origin[axis] = node_lo;
+        node.exponent[axis] = exponent;
+
+        for (int i = 0; i < n_children; i++) {
+            double q_lo = std::floor(((double) lo[axis][i] - node_lo) / step);
+            double q_hi = std::ceil(((double) hi[axis][i] - node_lo) / step);
+            int l = std::min(std::max(q_lo, 0.0), (double) UINT8_MAX);
+            int h = std::min(std::max(q_hi, 0.0), (double) UINT8_MAX);
+
+            /* Correct for rounding in the decoder so the decoded box
+               encloses the child */
+            while (l > 0 && decode_plane(node_lo, l, step) > lo[axis][i]) {
+                l--;
+            }
+            while (h < UINT8_MAX && decode_plane(node_lo, h, step) < hi[axis][i]) {
+                h++;
+            }
+
+            node.lo[axis][i] = l;
+            node.hi[axis][i] = h;
+        }
+    }
+}
+
+void QuantizedBVH4::Decode(const Node& node, float lo[N_AXES][W], float hi[N_AXES][W])
+{
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        float step = step_size(node.exponent[axis]);
+#if defined(__SSE2__)
+        __m128 o = _mm_set1_ps(node.origin[axis]), s = _mm_set1_ps(step);
+        __m128i zero = _mm_setzero_si128();
+        int32_t packed;
+
+        std::memcpy(&packed, node.lo[axis], sizeof(packed));
+        __m128i q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        _mm_storeu_ps(lo[axis], _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(q), s)));
+
+        std::memcpy(&packed, node.hi[axis], sizeof(packed));
+        q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        _mm_storeu_ps(hi[axis], _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(q), s)));
+#else
+        for (int i = 0; i < W; i++) {
+            lo[axis][i] = decode_plane(node.origin[axis], node.lo[axis][i], step);
+            hi[axis][i] = decode_plane(node.origin[axis], node.hi[axis][i], step);
+        }
+#endif
+    }
+}
+
+uint32_t QuantizedBVH4::Collapse(const BVHNodeArray& bin, uint32_t index,
+                                 std::vector<Node>& out)
+{
+    /* Gather children the same way BVH4 does: keep opening up the
+       largest interior node until there are W of them. */
+    uint32_t children[W];
+    int n_children = 1;
+    children[0] = index;
+
+    while (n_children < W) {
+        int best = -1;
+        double best_area = -1;
+
+        for (int i = 0; i < n_children; i++) {
+            const LinearBVHNode& child = bin[children[i]];
+            if (!child.IsLeaf() && child.SurfaceArea() > best_area) {
+                best = i;
+                best_area = child.SurfaceArea();
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        uint32_t first = bin[children[best]].offset;
+        children[best] = first;
+        children[n_children++] = first + 1;
+    }
+
+    float lo[N_AXES][W], hi[N_AXES][W];
+    for (int i = 0; i < n_children; i++) {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            lo[axis][i] = bin[children[i]].bounds[BE_MIN_EXTENT][axis];
+            hi[axis][i] = bin[children[i]].bounds[BE_MAX_EXTENT][axis];
+        }
+    }
+
+    uint32_t node_index = out.size();
+    out.push_back(Node());
+    Encode(out[node_index], lo, hi, n_children);
+
+    for (int i = 0; i < n_children; i++) {
+        const LinearBVHNode& child = bin[children[i]];
+
+        /* Careful: these may reallocate out */
+        if (!child.IsLeaf()) {
+            uint32_t child_index = Collapse(bin, children[i], out);
+            out[node_index].offset[i] = child_index;
+        } else if (child.count > MAX_LEAF_OBJS) {
+            uint32_t child_index = SplitLeaf(child, child.offset, child.count, out);
+            out[node_index].offset[i] = child_index;
+        } else {
+            out[node_index].offset[i] = child.offset;
+            out[node_index].count[i] = child.count;
+        }
+    }
+
+    return node_index;
+}
+
+uint32_t QuantizedBVH4::SplitLeaf(const LinearBVHNode& leaf, uint32_t offset, uint32_t count,
+                                  std::vector<Node>& out)
+{
+    uint32_t per_child = (count + W - 1) / W;
+    int n_children = (count + per_child - 1) / per_child;
+
+    float lo[N_AXES][W], hi[N_AXES][W];
+    for (int i = 0; i < n_children; i++) {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            lo[axis][i] = leaf.bounds[BE_MIN_EXTENT][axis];
+            hi[axis][i] = leaf.bounds[BE_MAX_EXTENT][axis];
+        }
+    }
+
+    uint32_t node_index = out.size();
+    out.push_back(Node());
+    Encode(out[node_index], lo, hi, n_children);
+
+    for (int i = 0; i < n_children; i++) {
+        uint32_t start = offset + i * per_child;
+        uint32_t n = std::min(per_child, offset + count - start);
+
+        if (n > MAX_LEAF_OBJS) {
+            uint32_t child_index = SplitLeaf(leaf, start, n, out);
+            out[node_index].offset[i] = child_index;
+        } else {
+            out[node_index].offset[i] = start;
+            out[node_index].count[i] = n;
+        }
+    }
+
+    return node_index;
+}
+
+SceneObjectIntersection QuantizedBVH4::Intersects(const Ray3D& ray, double max_dist) const
+{
+    const SceneObject* closest = nullptr;
+    PrimHit hit;
+    hit.dist = INFINITY;
+
+    BVHRay bvh_ray(ray);
+    TriangleRay tri_ray(ray);
+    float t_max = round_up(max_dist);
+
+    /* Children still to visit, nearest on top */
+    struct StackEntry {
+        uint32_t offset;
+        uint32_t count;
+        float t_entry;
+    } to_check[STACK_SIZE];
+    int stack_size = 0;
+
+    to_check[stack_size++] = {0, 0, 0};
+
+    while (stack_size > 0) {
+        StackEntry entry = to_check[--stack_size];
+
+        /* Something closer was found since this was pushed */
+        if (entry.t_entry > t_max) {
+            continue;
+        }
+
+        if (entry.count > 0) {
+            for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                PrimHit prim_hit;
+                if (prims.Hit(i, ray, tri_ray, max_dist, prim_hit) && prim_hit.dist < hit.dist) {
+                    closest = prims[i];
+                    hit = prim_hit;
+                    max_dist = hit.dist;
+                    t_max = round_up(max_dist);
+                }
+            }
+            continue;
+        }
+
+        const Node& node = nodes[entry.offset];
+
+        float lo[N_AXES][W], hi[N_AXES][W];
+        Decode(node, lo, hi);
+
+        const float* near[N_AXES];
+        const float* far[N_AXES];
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            near[axis] = bvh_ray.dir_neg[axis] ? hi[axis] : lo[axis];
+            far[axis] = bvh_ray.dir_neg[axis] ? lo[axis] : hi[axis];
+        }
+
+        float t_entry[W];
+        int mask = slab_test4(near, far, 0, bvh_ray, t_max, t_entry)
+            & ((1 << node.n_children) - 1);
+
+        /* Push the hit children farthest first, so the nearest is
+           popped next */
+        int first = stack_size;
+        for (int i = 0; i < W; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+
+            StackEntry child = {node.offset[i], node.count[i], t_entry[i]};
+            int j = stack_size++;
+            while (j > first && to_check[j - 1].t_entry < child.t_entry) {
+                to_check[j] = to_check[j - 1];
+                j--;
+            }
+            to_check[j] = child;
+        }
+    }
+
+    return FinalizeHit(closest, ray, hit);
+}
+
+bool QuantizedBVH4::Occluded(const Ray3D& ray, double max_dist) const
+{
+    BVHRay bvh_ray(ray);
+    TriangleRay tri_ray(ray);
+    float t_max = round_up(max_dist);
+
+    struct StackEntry {
+        uint32_t offset;
+        uint32_t count;
+    } to_check[STACK_SIZE];
+    int stack_size = 0;
+
+    to_check[stack_size++] = {0, 0};
+
+    while (stack_size > 0) {
+        StackEntry entry = to_check[--stack_size];
+
+        if (entry.count > 0) {
+            for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                if (prims.Occludes(i, ray, tri_ray, max_dist)) {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        const Node& node = nodes[entry.offset];
+
+        float lo[N_AXES][W], hi[N_AXES][W];
+        Decode(node, lo, hi);
+
+        const float* near[N_AXES];
+        const float* far[N_AXES];
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            near[axis] = bvh_ray.dir_neg[axis] ? hi[axis] : lo[axis];
+            far[axis] = bvh_ray.dir_neg[axis] ? lo[axis] : hi[axis];
+        }
+
+        float t_entry[W];
+        int mask = slab_test4(near, far, 0, bvh_ray, t_max, t_entry)
+            & ((1 << node.n_children) - 1);
+
+        for (int i = 0; i < W; i++) {
+            if (mask & (1 << i)) {
+                to_check[stack_size++] = {node.offset[i], node.count[i]};
+            }
+        }
+    }
+
+    return false;
+}
+
+AccelStats QuantizedBVH4::GetStats() const
+{
+    AccelStats stats;
+    stats.n_nodes = n_nodes;
+    stats.n_refs = prims.Size();
+    stats.bytes = n_nodes * sizeof(Node) + prims.Bytes();
+    return stats;
+}
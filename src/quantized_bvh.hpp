@@ -0,0 +1,95 @@
+#ifndef QUANTIZED_BVH_HPP_
+#define QUANTIZED_BVH_HPP_
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "intersection.hpp"
+#include "primitive_list.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+
+/* A 4-wide BVH, collapsed from a binary BVH like BVH4, whose child
+ * bounds are quantized to 8 bits per plane. Each node stores its own
+ * box as a float origin and a power-of-two step per axis, and each
+ * child plane as a number of steps from the origin, rounded outward so
+ * decoded boxes always enclose the real ones. A node fits one 64-byte
+ * cache line, half the size of a BVH4 node, at the cost of slightly
+ * looser boxes and a few instructions to decode them.
+ */
+class QuantizedBVH4 : public Accelerator {
+public:
+    QuantizedBVH4(const BVH& bvh);
+    virtual ~QuantizedBVH4();
+
+    QuantizedBVH4(const QuantizedBVH4&) = delete;
+    QuantizedBVH4& operator=(const QuantizedBVH4&) = delete;
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    virtual bool Occluded(const Ray3D& ray, double max_dist) const override;
+
+    virtual AccelStats GetStats() const override;
+
+private:
+    static const int W = 4;
+
+    /* Leaves with more objects than fit in a child's count are split
+       up over several children */
+    static const uint32_t MAX_LEAF_OBJS = UINT8_MAX;
+
+    struct Node {
+        /* The node's box is origin + [0, 255] * 2^exponent per axis */
+        float origin[N_AXES];
+        int8_t exponent[N_AXES];
+
+        /* Children occupy the first n_children slots */
+        uint8_t n_children;
+
+        /* Child bounds in steps from origin */
+        uint8_t lo[N_AXES][W];
+        uint8_t hi[N_AXES][W];
+
+        /* Leaf children: first object and object count. Interior
+           children: index of the child node and a count of zero. */
+        uint32_t offset[W];
+        uint8_t count[W];
+
+        uint32_t pad;
+    };
+
+    static_assert(sizeof(Node) == 64, "QuantizedBVH4::Node should be 64 bytes");
+
+    /* Quantize the given child bounds into node */
+    static void Encode(Node& node, const float lo[N_AXES][W],
+                       const float hi[N_AXES][W], int n_children);
+
+    /* Decode node's child bounds for the slab test */
+    static void Decode(const Node& node, float lo[N_AXES][W], float hi[N_AXES][W]);
+
+    /* Collapse the binary subtree rooted at index into a new node of
+       out and return the new node's index */
+    uint32_t Collapse(const BVHNodeArray& bin, uint32_t index,
+                      std::vector<Node>& out);
+
+    /* Make a node whose children share leaf's bounds and split its
+       count objects from offset on between them */
+    uint32_t SplitLeaf(const LinearBVHNode& leaf, uint32_t offset, uint32_t count,
+                       std::vector<Node>& out);
+
+    /* Worst-case traversal stack. Split leaves add at most 12 levels
+       to the binary tree's depth, as 255 * 4^12 > 2^32 objects. */
+    static const int STACK_SIZE = (W - 1) * (BVH::MAX_DEPTH + 12) + 1;
+
+    /* Cache line aligned, so no node straddles two lines */
+    Node* nodes;
+    size_t n_nodes;
+
+    PrimitiveList prims;
+};
+
+#endif
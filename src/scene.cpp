@@ -1,11 +1,13 @@
 #include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <cstring>
 #include <mutex>
 #include <thread>
 #include <vector>
 #include <stdint.h>
 
+#include "bvh_cache.hpp"
 #include "camera.hpp"
 #include "intersection.hpp"
 #include "scene.hpp"
@@ -14,25 +16,43 @@
 
 #define MAX_DEPTH (10)
 
+/* Samples every pixel takes before checking for convergence */
+#define MIN_SAMPLES (8)
+
 Scene::Scene(uint32_t w,
              uint32_t h) :
     width(w),
     height(h),
     num_pix(w * h),
     cam(45, width, height),
-    bvh(nullptr)
+    bvh(nullptr),
+    accel(nullptr),
+    accel_type(ACCEL_BVH),
+    geometry_hash(0),
+    packets(false),
+    wavefront(false)
 {
 }
 
 Scene::~Scene()
 {
+    ClearBVH();
+
     for (auto obj : this->objects) {
         delete obj;
     }
 
+    for (auto obj : this->unbounded) {
+        delete obj;
+    }
+
     for (auto light : this->lights) {
         delete light;
     }
+
+    for (auto mesh : this->meshes) {
+        delete mesh;
+    }
 }
 
 void Scene::AddObject(const SceneObject* obj)
@@ -40,11 +60,114 @@ void Scene::AddObject(const SceneObject* obj)
     this->objects.push_back(obj);
 }
 
+void Scene::AddUnboundedObject(const SceneObject* obj)
+{
+    this->unbounded.push_back(obj);
+}
+
 void Scene::AddLight(const LightSource* light)
 {
     this->lights.push_back(light);
 }
 
+void Scene::AddMesh(Mesh* mesh)
+{
+    this->meshes.push_back(mesh);
+}
+
+void Scene::AddTriangleMesh(TriangleMesh* mesh)
+{
+    this->triangle_meshes.push_back(mesh);
+}
+
+void Scene::AddSphereSet(SphereSet* set)
+{
+    this->sphere_sets.push_back(set);
+}
+
+SceneObjectIntersection Scene::Intersects(const Ray3D& ray) const
+{
+    const SceneObject* closest = nullptr;
+    PrimHit hit, closest_hit;
+    closest_hit.dist = INFINITY;
+
+    for (auto obj : this->unbounded) {
+        if (obj->Hit(ray, closest_hit.dist, hit)) {
+            closest = obj;
+            closest_hit = hit;
+        }
+    }
+
+    /* Anything in accel at the same distance wins, as it would have
+       if it had been tested last */
+    SceneObjectIntersection record = accel->Intersects(ray, closest_hit.dist);
+    if (record.intersected || !closest) {
+        return record;
+    }
+
+    return closest->Finalize(ray, closest_hit);
+}
+
+void Scene::IntersectPacket(const Ray3D* rays, int n,
+                            std::vector<SceneObjectIntersection>& hits) const
+{
+    accel->IntersectPacket(rays, n, hits);
+    if (this->unbounded.empty()) {
+        return;
+    }
+
+    /* The rays of a packet share one traversal, so the unbounded hits
+       can't cut it short; they only replace hits further away */
+    for (int i = 0; i < n; i++) {
+        const SceneObject* closest = nullptr;
+        PrimHit hit, closest_hit;
+        closest_hit.dist = hits[i].intersected ? hits[i].dist : INFINITY;
+
+        for (auto obj : this->unbounded) {
+            if (obj->Hit(rays[i], closest_hit.dist, hit) && hit.dist < closest_hit.dist) {
+                closest = obj;
+                closest_hit = hit;
+            }
+        }
+
+        if (closest) {
+            hits[i] = closest->Finalize(rays[i], closest_hit);
+        }
+    }
+}
+
+bool Scene::Occluded(const Ray3D& ray, double max_dist) const
+{
+    for (auto obj : this->unbounded) {
+        if (obj->Occludes(ray, max_dist)) {
+            return true;
+        }
+    }
+
+    return accel->Occluded(ray, max_dist);
+}
+
+Color Scene::LightColor(const LightSource* light, const Material& mat,
+                        const Vector3D& pt, const Vector3D& normal) const
+{
+    /* Lambertian shading... TODO: Factor lighting models into
+       their own class hierarchy */
+    Vector3D obj_to_light = light->GetVecFromPoint(pt);
+    Color diffuse = mat.diffuse
+        * std::max(0.0, obj_to_light.Normalized().Dot(normal))
+        * light->GetIntensity(pt);
+
+    /* Phong specular shading */
+    Vector3D ref_light = obj_to_light.Normalized().ReflectAbout(normal),
+        obj_to_cam = pt.To(this->cam.GetPos()).Normalized();
+
+    Color specular = mat.specular
+        * std::pow(std::max(0.0, obj_to_cam.Dot(ref_light)), mat.phong_exp)
+        * light->GetIntensity(pt);
+
+    return diffuse + specular;
+}
+
 Color Scene::ObjectColorAtPoint(const Ray3D& view,
                                 const SceneObject* obj,
                                 const Vector3D& pt,
@@ -55,31 +178,10 @@ Color Scene::ObjectColorAtPoint(const Ray3D& view,
     Material mat = obj->GetMaterial();
 
     for (auto light : this->lights) {
-        /* Lambertian shading... TODO: Factor lighting models into
-           their own class hierarchy */
-        Vector3D obj_to_light = light->GetVecFromPoint(pt);
-        Color diffuse = mat.diffuse
-            * std::max(0.0, obj_to_light.Normalized().Dot(normal))
-            * light->GetIntensity(pt);
-
-        /* Phong specular shading */
-        Vector3D ref_light = obj_to_light.Normalized().ReflectAbout(normal),
-            obj_to_cam = pt.To(this->cam.GetPos()).Normalized();
-
-        Color specular = mat.specular
-            * std::pow(std::max(0.0, obj_to_cam.Dot(ref_light)), mat.phong_exp)
-            * light->GetIntensity(pt);
-
         /* shadows */
-        bool blocked = false;
-        for (auto obj : this->objects) {
-            if (obj->Intersects(Ray3D(pt, obj_to_light), light->Distance(pt)).intersected) {
-                blocked = true;
-            }
-        }
-
-        if (!blocked) {
-            acc += diffuse + specular;
+        Vector3D obj_to_light = light->GetVecFromPoint(pt);
+        if (!this->Occluded(Ray3D(pt, obj_to_light), light->Distance(pt))) {
+            acc += this->LightColor(light, mat, pt, normal);
         }
     }
 
@@ -105,8 +207,12 @@ Color Scene::SceneColorAlongRay(const Ray3D& ray, uint8_t depth) const
         return this->background;
     }
 
-    SceneObjectIntersection closest = bvh->Intersects(ray, INFINITY);
+    return this->HitColor(ray, this->Intersects(ray), depth);
+}
 
+Color Scene::HitColor(const Ray3D& ray, const SceneObjectIntersection& closest,
+                      uint8_t depth) const
+{
     if (!closest.intersected) {
         /* No object intersected; ray exits scene. default
            to black (ie no light reflected) */
@@ -144,48 +250,363 @@ inline std::vector<double> extract_luminances(std::vector<Color> colors)
 
 static std::mutex rend_ct_lock;
 
-void Scene::RenderPixels(int start, int stride, uint8_t* dst) const
+Ray3D Scene::PixelRay(int x, int y) const
+{
+    /* floating-point offsets from the center of the image to the
+       right and top edges */
+    double xoff = this->width / 2.0, yoff = this->height / 2.0;
+
+    return cam.GetRayThroughPoint((x - xoff + rand_d())  / xoff,
+                                  -(y - yoff + rand_d()) / yoff);
+}
+
+bool Scene::Converged(const std::vector<Color>& samples)
+{
+    return samples.size() >= MIN_SAMPLES &&
+        range(extract_luminances(samples)) / samples.size() <= 0.01;
+}
+
+void Scene::FinishPixel(int x, int y, std::vector<Color>& samples, uint8_t* dst) const
+{
+    while (!Converged(samples)) {
+        samples.push_back(this->SceneColorAlongRay(this->PixelRay(x, y)));
+    }
+
+    this->WritePixel(x, y, samples, dst);
+}
+
+void Scene::WritePixel(int x, int y, const std::vector<Color>& samples, uint8_t* dst) const
 {
     static uint32_t rendered; /* pixels rendered */
 
+    /* Output the linear average of the samples to the
+       pixel. */
+    uint32_t i = y * this->width + x;
+    Color::Average(samples).Output8BitPixel(dst + i * 4);
+
+    /* Print the status marker */
+    rend_ct_lock.lock();
+    rendered++;
+    if (rendered % 100 == 0) {
+        std::printf("\r[");
+        double ratio = (double) rendered / this->num_pix;
+        for (int i = 0; i < 20 * ratio; i++) {
+            std::printf("#");
+        }
+        for (int i = 0; i < 20 * (1 - ratio); i++) {
+            std::printf("-");
+        }
+        std::printf("] (%d/%d)", rendered, this->num_pix);
+    }
+
+    /* Start over for the next frame */
+    if (rendered == this->num_pix) {
+        rendered = 0;
+    }
+    rend_ct_lock.unlock();
+}
+
+void Scene::RenderPixels(int start, int stride, uint8_t* dst) const
+{
+    if (this->wavefront) {
+        this->RenderWavefront(start, stride, dst);
+        return;
+    } else if (this->packets) {
+        this->RenderTiles(start, stride, dst);
+        return;
+    }
+
     for (uint32_t i = start; i < num_pix; i += stride) {
         int y = i / this->width, x = i % this->width;
 
         std::vector<Color> samples;
-        std::vector<double> lums;
+        this->FinishPixel(x, y, samples, dst);
+    }
+}
+
+static_assert(Scene::TILE_SIZE * Scene::TILE_SIZE <= Accelerator::MAX_PACKET_SIZE,
+              "tiles should fit in one packet");
+
+void Scene::RenderTiles(int start, int stride, uint8_t* dst) const
+{
+    uint32_t tiles_x = (this->width + TILE_SIZE - 1) / TILE_SIZE,
+        tiles_y = (this->height + TILE_SIZE - 1) / TILE_SIZE;
+
+    std::vector<Ray3D> rays;
+    std::vector<SceneObjectIntersection> hits;
+
+    for (uint32_t t = start; t < tiles_x * tiles_y; t += stride) {
+        uint32_t x0 = (t % tiles_x) * TILE_SIZE, y0 = (t / tiles_x) * TILE_SIZE;
+        uint32_t x1 = std::min(x0 + TILE_SIZE, this->width),
+            y1 = std::min(y0 + TILE_SIZE, this->height);
+
+        /* Every pixel takes at least MIN_SAMPLES samples, so those
+           are traced as packets of one ray per pixel of the tile. */
+        std::vector<Color> samples[TILE_SIZE * TILE_SIZE];
+        for (int s = 0; s < MIN_SAMPLES; s++) {
+            rays.clear();
+            for (uint32_t y = y0; y < y1; y++) {
+                for (uint32_t x = x0; x < x1; x++) {
+                    rays.push_back(this->PixelRay(x, y));
+                }
+            }
+
+            this->IntersectPacket(rays.data(), rays.size(), hits);
+            for (size_t i = 0; i < rays.size(); i++) {
+                samples[i].push_back(this->HitColor(rays[i], hits[i]));
+            }
+        }
+
+        size_t i = 0;
+        for (uint32_t y = y0; y < y1; y++) {
+            for (uint32_t x = x0; x < x1; x++) {
+                this->FinishPixel(x, y, samples[i++], dst);
+            }
+        }
+    }
+}
+
+/* One ray of the shading tree a camera ray spawns, traced breadth
+   first by the wavefront renderer. Children always come after their
+   parent, so colors can be resolved by walking vertices backwards. */
+enum PathSlot {
+    SLOT_REFLECTED,
+    SLOT_REFRACTED
+};
+
+struct PathVertex {
+    PathVertex(const Ray3D& ray, int32_t parent, PathSlot slot, uint8_t depth) :
+        ray(ray),
+        parent(parent),
+        slot(slot),
+        depth(depth),
+        obj(nullptr),
+        inc(-1)
+    {
+    }
+
+    Ray3D ray;
+
+    /* Index of the vertex that spawned this one, or -1 for camera
+       rays, and which of its rays this is */
+    int32_t parent;
+    PathSlot slot;
+    uint8_t depth;
+
+    /* What the ray hit, if anything */
+    const SceneObject* obj;
+    int inc;
+
+    /* Light reaching the hit point unshadowed, and the colors seen
+       along the rays spawned from it */
+    Color lit, reflected, refracted;
+};
+
+/* A light's contribution to a vertex, if nothing is in the way */
+struct ShadowRay {
+    Ray3D ray;
+    double max_dist;
+    uint32_t vertex;
+    Color color;
+};
+
+/* Sort key that is the same for identical materials. Materials are
+   all doubles, so they are hashed a word at a time. */
+static uint64_t material_key(const Material& mat)
+{
+    static_assert(sizeof(Material) % sizeof(uint64_t) == 0,
+                  "Material should be made of whole words");
+
+    uint64_t words[sizeof(Material) / sizeof(uint64_t)];
+    std::memcpy(words, &mat, sizeof(words));
+
+    uint64_t h = FNV_OFFSET_BASIS;
+    for (auto word : words) {
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    return h;
+}
 
-        /* floating-point offsets from the center of the image to the
-           right and top edges */
-        double xoff = this->width / 2.0, yoff = this->height / 2.0;
+/* Queues of the wavefront stages, kept between batches so their
+   memory is reused */
+struct WavefrontQueues {
+    std::vector<PathVertex> verts;
+    std::vector<SceneObjectIntersection> hits, packet_hits;
+    std::vector<Ray3D> packet;
+    std::vector<std::pair<uint64_t, uint32_t> > order;
+    std::vector<ShadowRay> shadow_rays;
+};
+
+void Scene::TraceWavefront(const std::vector<Ray3D>& rays, WavefrontQueues& queues,
+                           std::vector<Color>& colors) const
+{
+    std::vector<PathVertex>& verts = queues.verts;
+    std::vector<SceneObjectIntersection>& hits = queues.hits;
+    std::vector<SceneObjectIntersection>& packet_hits = queues.packet_hits;
+    std::vector<Ray3D>& packet = queues.packet;
+    std::vector<std::pair<uint64_t, uint32_t> >& order = queues.order;
+    std::vector<ShadowRay>& shadow_rays = queues.shadow_rays;
+
+    verts.clear();
+    for (auto& ray : rays) {
+        verts.push_back(PathVertex(ray, -1, SLOT_REFLECTED, 0));
+    }
+
+    for (size_t begin = 0, end = verts.size(); begin < end;
+         begin = end, end = verts.size()) {
+        /* Closest hits. Camera rays of neighbouring pixels go through
+           the accelerator as packets. */
+        hits.clear();
+        for (size_t v = begin; v < end; ) {
+            if (verts[v].depth == 0) {
+                packet.clear();
+                for (; v < end && packet.size() < Accelerator::MAX_PACKET_SIZE; v++) {
+                    packet.push_back(verts[v].ray);
+                }
+                this->IntersectPacket(packet.data(), packet.size(), packet_hits);
+                hits.insert(hits.end(), packet_hits.begin(), packet_hits.end());
+            } else if (verts[v].depth > MAX_DEPTH) {
+                hits.push_back(SceneObjectIntersection(nullptr, false, verts[v].ray));
+                v++;
+            } else {
+                hits.push_back(this->Intersects(verts[v].ray));
+                v++;
+            }
+        }
 
-        double lum_range = INFINITY;
+        /* Shade hits grouped by material */
+        order.clear();
+        for (size_t v = begin; v < end; v++) {
+            const SceneObjectIntersection& hit = hits[v - begin];
+            if (!hit.intersected) {
+                continue;
+            }
+
+            order.push_back(std::make_pair(material_key(hit.GetObject()->GetMaterial()), v));
+        }
+        std::sort(order.begin(), order.end());
+
+        shadow_rays.clear();
+        for (auto& entry : order) {
+            uint32_t v = entry.second;
+            const SceneObjectIntersection& hit = hits[v - begin];
+
+            verts[v].obj = hit.GetObject();
+            verts[v].inc = hit.inc;
+
+            /* Copied, as spawning vertices may move verts[v] */
+            Ray3D view = verts[v].ray;
+            Vector3D pt = hit.point, normal = hit.norm.GetDir();
+            uint8_t depth = verts[v].depth + 1;
+            Material mat = verts[v].obj->GetMaterial();
+
+            if (hit.inc == INC_OUTWARD) {
+                verts.push_back(PathVertex(view.RefractThrough(pt, -normal, mat.ior),
+                                           v, SLOT_REFRACTED, depth));
+                continue;
+            } else if (hit.inc != INC_INWARD) {
+                continue;
+            }
+
+            for (auto light : this->lights) {
+                ShadowRay shadow = {Ray3D(pt, light->GetVecFromPoint(pt)),
+                                    light->Distance(pt), v,
+                                    this->LightColor(light, mat, pt, normal)};
+                shadow_rays.push_back(shadow);
+            }
+
+            if (mat.specular > Color(0, 0, 0)) {
+                verts.push_back(PathVertex(view.ReflectAbout(pt, normal),
+                                           v, SLOT_REFLECTED, depth));
+            }
+
+            if (mat.transmissivity > Color(0, 0, 0)) {
+                verts.push_back(PathVertex(view.RefractThrough(pt, normal, 1 / mat.ior),
+                                           v, SLOT_REFRACTED, depth));
+            }
+        }
+
+        /* Each vertex's lights are queued in order, so they add up in
+           the same order as in ObjectColorAtPoint */
+        for (auto& shadow : shadow_rays) {
+            if (!this->Occluded(shadow.ray, shadow.max_dist)) {
+                verts[shadow.vertex].lit += shadow.color;
+            }
+        }
+    }
+
+    /* Combine colors up the tree the way ObjectColorAtPoint and
+       HitColor would have */
+    colors.resize(rays.size());
+    for (size_t v = verts.size(); v-- > 0; ) {
+        const PathVertex& vert = verts[v];
+        Color color = this->background;
+
+        if (vert.inc == INC_OUTWARD) {
+            color = vert.refracted;
+        } else if (vert.inc == INC_INWARD) {
+            Material mat = vert.obj->GetMaterial();
+            color = vert.lit;
+            if (mat.specular > Color(0, 0, 0)) {
+                color += vert.reflected * mat.specular;
+            }
+            if (mat.transmissivity > Color(0, 0, 0)) {
+                color += vert.refracted * mat.transmissivity;
+            }
+            color += mat.ambient * this->ambient;
+        }
 
-        do {
-            Ray3D ray = cam.GetRayThroughPoint((x - xoff + rand_d())  / xoff,
-                                               -(y - yoff + rand_d()) / yoff);
-            samples.push_back(this->SceneColorAlongRay(ray));
-            lum_range = range(extract_luminances(samples));
-        } while (samples.size() < 8 || lum_range / samples.size() > 0.01);
+        if (vert.parent < 0) {
+            colors[v] = color;
+        } else if (vert.slot == SLOT_REFLECTED) {
+            verts[vert.parent].reflected = color;
+        } else {
+            verts[vert.parent].refracted = color;
+        }
+    }
+}
 
-        /* Output the linear average of the samples to the
-           pixel. */
-        Color::Average(samples).Output8BitPixel(dst + i * 4);
+void Scene::RenderWavefront(int start, int stride, uint8_t* dst) const
+{
+    std::vector<uint32_t> active;
+    std::vector<Ray3D> rays;
+    std::vector<Color> colors;
+    WavefrontQueues queues;
+
+    /* Batches are runs of neighbouring pixels, so camera rays are
+       coherent enough to trace as packets */
+    for (uint32_t first = start * WAVEFRONT_BATCH; first < num_pix;
+         first += stride * WAVEFRONT_BATCH) {
+        uint32_t last = std::min(first + WAVEFRONT_BATCH, num_pix);
+        std::vector<std::vector<Color> > samples(last - first);
+
+        active.clear();
+        for (uint32_t i = first; i < last; i++) {
+            active.push_back(i);
+        }
 
-        /* Print the status marker */
-        rend_ct_lock.lock();
-        rendered++;
-        if (rendered % 100 == 0) {
-            std::printf("\r[");
-            double ratio = (double) rendered / this->num_pix;
-            for (int i = 0; i < 20 * ratio; i++) {
-                std::printf("#");
+        /* Take one more sample of every pixel not converged yet */
+        while (!active.empty()) {
+            rays.clear();
+            for (auto i : active) {
+                rays.push_back(this->PixelRay(i % this->width, i / this->width));
             }
-            for (int i = 0; i < 20 * (1 - ratio); i++) {
-                std::printf("-");
+
+            this->TraceWavefront(rays, queues, colors);
+
+            size_t n_active = 0;
+            for (size_t k = 0; k < active.size(); k++) {
+                uint32_t i = active[k];
+                samples[i - first].push_back(colors[k]);
+
+                if (Converged(samples[i - first])) {
+                    this->WritePixel(i % this->width, i / this->width, samples[i - first], dst);
+                } else {
+                    active[n_active++] = i;
+                }
             }
-            std::printf("] (%d/%d)", rendered, this->num_pix);
+            active.resize(n_active);
         }
-        rend_ct_lock.unlock();
     }
 }
 
@@ -216,11 +637,186 @@ uint32_t Scene::GetHeight() const
     return this->height;
 }
 
-void Scene::InitBVH()
+void Scene::MakeAccelerator()
+{
+    if (accel && accel != bvh) {
+        delete accel;
+    }
+
+    accel = Accelerator::Build(accel_type, objects, bvh, bvh_options.n_threads);
+}
+
+void Scene::ClearBVH()
+{
+    if (accel != bvh) {
+        delete accel;
+    }
+    delete bvh;
+
+    accel = nullptr;
+    bvh = nullptr;
+}
+
+void Scene::BuildBVH()
+{
+    ClearBVH();
+
+    for (auto mesh : meshes) {
+        mesh->Build(bvh_options);
+    }
+    for (auto mesh : triangle_meshes) {
+        mesh->Build(bvh_options);
+    }
+    for (auto set : sphere_sets) {
+        set->Build(bvh_options);
+    }
+
+    if (Accelerator::NeedsBVH(accel_type)) {
+        bvh = new BVH(objects, bvh_options);
+    }
+}
+
+bool Scene::LoadBVHCache()
 {
+    BVHCache cache(bvh_cache_path, BVHCache::Key(geometry_hash, bvh_options));
+    size_t n_tri_meshes = meshes.size() + triangle_meshes.size();
+    size_t n_meshes = n_tri_meshes + sphere_sets.size();
+    size_t n_trees = n_meshes + Accelerator::NeedsBVH(accel_type);
+    if (cache.Size() != n_trees) {
+        return false;
+    }
+
+    /* Meshes come first, in order, then triangle meshes, then sphere
+       sets, then the top level if there is one */
+    std::vector<BVH*> loaded;
+    for (size_t i = 0; i < n_trees; i++) {
+        BVH* tree;
+        if (i < meshes.size()) {
+            tree = cache.Load(i, meshes[i]->GetObjects());
+        } else if (i < n_tri_meshes) {
+            tree = cache.Load(i, triangle_meshes[i - meshes.size()]->Size());
+        } else if (i < n_meshes) {
+            tree = cache.Load(i, sphere_sets[i - n_tri_meshes]->Size());
+        } else {
+            tree = cache.Load(i, objects);
+        }
+        if (!tree) {
+            for (auto t : loaded) {
+                delete t;
+            }
+            return false;
+        }
+        loaded.push_back(tree);
+    }
+
+    ClearBVH();
+    for (size_t i = 0; i < meshes.size(); i++) {
+        meshes[i]->SetBVH(loaded[i]);
+    }
+    for (size_t i = 0; i < triangle_meshes.size(); i++) {
+        triangle_meshes[i]->SetBVH(loaded[meshes.size() + i]);
+    }
+    for (size_t i = 0; i < sphere_sets.size(); i++) {
+        sphere_sets[i]->SetBVH(loaded[n_tri_meshes + i]);
+    }
+    if (n_trees > n_meshes) {
+        bvh = loaded.back();
+    }
+
+    std::printf("Read BVH cache %s\n", bvh_cache_path.c_str());
+    return true;
+}
+
+void Scene::SaveBVHCache() const
+{
+    BVHCache cache(bvh_cache_path, BVHCache::Key(geometry_hash, bvh_options));
+    for (auto mesh : meshes) {
+        cache.Add(*mesh->GetBVH());
+    }
+    for (auto mesh : triangle_meshes) {
+        cache.Add(*mesh->GetBVH());
+    }
+    for (auto set : sphere_sets) {
+        cache.Add(*set->GetBVH());
+    }
     if (bvh) {
-        delete bvh;
+        cache.Add(*bvh);
+    }
+
+    if (cache.Write()) {
+        std::printf("Wrote BVH cache %s\n", bvh_cache_path.c_str());
+    } else {
+        std::fprintf(stderr, "WARNING: could not write BVH cache %s\n",
+                     bvh_cache_path.c_str());
+    }
+}
+
+void Scene::SetBVHCache(const std::string& path, uint64_t geometry_hash)
+{
+    this->bvh_cache_path = path;
+    this->geometry_hash = geometry_hash;
+}
+
+void Scene::InitBVH(const BVHOptions& options, AccelType accel_type)
+{
+    this->bvh_options = options;
+    this->accel_type = accel_type;
+
+    if (bvh_cache_path.empty() || !LoadBVHCache()) {
+        BuildBVH();
+
+        if (!bvh_cache_path.empty()) {
+            SaveBVHCache();
+        }
+    }
+
+    /* Any cache is written, so the sphere sets no longer need to know
+       which sphere of their files each slot holds */
+    for (auto set : sphere_sets) {
+        set->Renumber();
     }
 
-    bvh = new BVH(objects);
+    MakeAccelerator();
+}
+
+size_t Scene::UpdateBVH()
+{
+    if (!accel) {
+        InitBVH(bvh_options, accel_type);
+        return 0;
+    }
+
+    /* Meshes may hold triangle meshes, so those go first */
+    size_t n_rebuilt = 0;
+    for (auto mesh : triangle_meshes) {
+        n_rebuilt += mesh->UpdateBVH(bvh_options);
+    }
+    for (auto set : sphere_sets) {
+        n_rebuilt += set->UpdateBVH(bvh_options);
+    }
+    for (auto mesh : meshes) {
+        n_rebuilt += mesh->UpdateBVH(bvh_options);
+    }
+
+    if (!bvh) {
+        MakeAccelerator();
+        return n_rebuilt;
+    }
+
+    bvh->Refit(bvh_options.n_threads);
+
+    /* Objects have moved since any cached tree was made, so rebuild
+       from scratch rather than going back to the cache; the bottom
+       level is built already */
+    if (bvh->NeedsRebuild()) {
+        BuildBVH();
+        MakeAccelerator();
+        return n_rebuilt + 1;
+    }
+
+    /* Collapsing is linear too, so wide trees are simply redone */
+    if (accel != bvh) {
+        MakeAccelerator();
+    }
+    return n_rebuilt;
 }
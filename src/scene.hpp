@@ -6,12 +6,17 @@
 #include <queue>
 #include <stdint.h>
 
+#include "accelerator.hpp"
 #include "bvh.hpp"
 #include "camera.hpp"
 #include "color.hpp"
+#include "intersection.hpp"
+#include "mesh.hpp"
 #include "scene_object.hpp"
+#include "sphere_set.hpp"
+#include "triangle_mesh.hpp"
 
-typedef std::vector<Vector3D> VertexPool;
+struct WavefrontQueues;
 
 class Scene {
 public:
@@ -21,28 +26,155 @@ public:
     void AddObject(const SceneObject* obj);
     void AddLight(const LightSource* light);
 
+    /* Meshes are only placed through Instances added as objects */
+    void AddMesh(Mesh* mesh);
+
+    /* Triangle meshes are added as objects, of the scene or of a mesh,
+       and also here so their BVHs get built */
+    void AddTriangleMesh(TriangleMesh* mesh);
+
+    /* Sphere sets likewise */
+    void AddSphereSet(SphereSet* set);
+
+    /* Objects without finite bounds, such as planes, are kept out of
+       the acceleration structures, whose bounds and splits they would
+       ruin, and every ray is tested against them besides */
+    void AddUnboundedObject(const SceneObject* obj);
+
     uint32_t GetHeight() const;
     uint32_t GetWidth() const;
 
+    /* Render every stride-th pixel from start on, or with packet
+       tracing every stride-th tile */
     void RenderPixels(int start, int stride, uint8_t* dst) const;
 
+    /* Trace the first samples of each TILE_SIZE x TILE_SIZE tile of
+       pixels as packets of camera rays */
+    inline void SetPacketTracing(bool enabled) {
+        this->packets = enabled;
+    }
+
+    static const uint32_t TILE_SIZE = 4;
+
+    /* Render breadth first instead: camera rays of a batch of pixels
+       are traced together, then the hits are shaded in material order,
+       then the shadow and secondary rays those spawn are traced, and so
+       on, one stage over the whole batch at a time */
+    inline void SetWavefront(bool enabled) {
+        this->wavefront = enabled;
+    }
+
+    static const uint32_t WAVEFRONT_BATCH = 4096;
+
     inline Camera& GetCamera() {
         return this->cam;
     }
 
     void Configure(SceneComponent* sc);
 
-    void InitBVH();
+    /* Build the acceleration structure used to trace rays, along with
+       the bottom-level BVH of every mesh */
+    void InitBVH(const BVHOptions& options = BVHOptions(),
+                 AccelType accel_type = ACCEL_BVH);
+
+    /* Bring the acceleration structures up to date after objects, or
+       the vertices and spheres of triangle meshes and sphere sets, have
+       moved: refit each BVH in place, bottom level first, or rebuild
+       it with the settings last passed to InitBVH once refitting has
+       degraded it too much. Structures that aren't made from a BVH are
+       always rebuilt. Returns the number of BVHs rebuilt. */
+    size_t UpdateBVH();
+
+    /* Have InitBVH read its trees from the cache file at path when the
+       file was written for this geometry and these build options, and
+       write them there when it wasn't. */
+    void SetBVHCache(const std::string& path, uint64_t geometry_hash);
+
+    /* The structure rays are traced through, e.g. for reporting on it */
+    inline const Accelerator* GetAccelerator() const {
+        return this->accel;
+    }
+
+    /* The binary BVH the accelerator was made from, or null if it
+       wasn't made from one */
+    inline const BVH* GetBVH() const {
+        return this->bvh;
+    }
+
+    inline const std::vector<TriangleMesh*>& GetTriangleMeshes() const {
+        return this->triangle_meshes;
+    }
+
+    inline const std::vector<SphereSet*>& GetSphereSets() const {
+        return this->sphere_sets;
+    }
 
 private:
+    /* Closest hit along ray, of the unbounded objects and of those in
+       accel. The closest unbounded hit limits how far into accel the
+       ray is traced. */
+    SceneObjectIntersection Intersects(const Ray3D& ray) const;
+
+    /* Closest hits of n rays traced through accel as a packet */
+    void IntersectPacket(const Ray3D* rays, int n,
+                         std::vector<SceneObjectIntersection>& hits) const;
+
+    /* Is anything, unbounded or in accel, closer than max_dist? */
+    bool Occluded(const Ray3D& ray, double max_dist) const;
+
     /* Find what color lies at the end of ray */
     Color SceneColorAlongRay(const Ray3D& ray, uint8_t depth = 0) const;
 
+    /* Color seen along ray, given what it hits */
+    Color HitColor(const Ray3D& ray, const SceneObjectIntersection& closest,
+                   uint8_t depth = 0) const;
+
+    /* A camera ray through a random point of pixel (x, y) */
+    Ray3D PixelRay(int x, int y) const;
+
+    /* Light reaching pt on a surface of material mat from light,
+       ignoring shadows */
+    Color LightColor(const LightSource* light, const Material& mat,
+                     const Vector3D& pt, const Vector3D& normal) const;
+
+    /* Have enough samples been taken of a pixel? */
+    static bool Converged(const std::vector<Color>& samples);
+
+    /* Add samples to those already taken of pixel (x, y) until they
+       converge, then write their average to dst */
+    void FinishPixel(int x, int y, std::vector<Color>& samples, uint8_t* dst) const;
+
+    void WritePixel(int x, int y, const std::vector<Color>& samples, uint8_t* dst) const;
+
+    void RenderTiles(int start, int stride, uint8_t* dst) const;
+
+    /* Find the colors seen along rays by tracing them breadth first,
+       using the memory of queues */
+    void TraceWavefront(const std::vector<Ray3D>& rays, WavefrontQueues& queues,
+                        std::vector<Color>& colors) const;
+
+    void RenderWavefront(int start, int stride, uint8_t* dst) const;
+
     /* Compute the specific of some object at a given point */
     Color ObjectColorAtPoint(const Ray3D& view, const SceneObject* obj,
                              const Vector3D& pt, const Vector3D& normal,
                              uint8_t depth = 0) const;
 
+    /* Make accel according to accel_type, from bvh if it needs one */
+    void MakeAccelerator();
+
+    /* Delete accel and bvh */
+    void ClearBVH();
+
+    /* Build any mesh BVHs not built yet, and bvh if accel_type needs
+       it, with bvh_options */
+    void BuildBVH();
+
+    /* Take every BVH from the cache, or none of them and return
+       false; then write the current ones to it */
+    bool LoadBVHCache();
+    void SaveBVHCache() const;
+
     uint32_t width, height, num_pix;
 
     Camera cam;
@@ -51,9 +183,23 @@ private:
     /* Distance from point to the image plane */
     double dist;
 
-    const BVH* bvh;
+    /* The binary BVH is kept around even when tracing through a
+       structure collapsed from it, so it can be refit. It is null for
+       structures built straight from the objects. */
+    BVH* bvh;
+    const Accelerator* accel;
+    BVHOptions bvh_options;
+    AccelType accel_type;
+    std::string bvh_cache_path;
+    uint64_t geometry_hash;
     std::vector<const SceneObject*> objects;
+    std::vector<const SceneObject*> unbounded;
+    std::vector<Mesh*> meshes;
+    std::vector<TriangleMesh*> triangle_meshes;
+    std::vector<SphereSet*> sphere_sets;
     std::vector<const LightSource*> lights;
+    bool packets;
+    bool wavefront;
 };
 
 #endif
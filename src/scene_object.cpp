@@ -19,7 +19,70 @@ SceneObject::~SceneObject()
 {
 }
 
+bool SceneObject::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    SceneObjectIntersection intersect = this->Intersects(ray, max_dist);
+    if (!intersect.intersected) {
+        return false;
+    }
+
+    hit.dist = intersect.dist;
+    hit.part = this;
+    return true;
+}
+
+SceneObjectIntersection SceneObject::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    /* The record's distance is measured from its point, which may be
+       an ulp off the distance the hit was found at, so don't limit
+       the search by it. The closest hit overall is the same one. */
+    return this->Intersects(ray, INFINITY);
+}
+
+bool SceneObject::Occludes(const Ray3D& ray, double max_dist) const
+{
+    return this->Intersects(ray, max_dist).intersected;
+}
+
+SceneObjectIntersection SceneObject::HitThenFinalize(const Ray3D& ray, double max_dist) const
+{
+    PrimHit hit;
+    if (!this->Hit(ray, max_dist, hit)) {
+        return SceneObjectIntersection(this, false, ray);
+    }
+
+    return this->Finalize(ray, hit);
+}
+
+SceneObjectIntersection SceneObject::FinalizeSolid(const Ray3D& ray, const PrimHit& hit) const
+{
+    Vector3D int_pt = ray.Point(hit.dist);
+    Vector3D normal = this->NormalAtPoint(int_pt);
+    int inc = ray.GetDir().Dot(normal) < 0 ? INC_INWARD : INC_OUTWARD;
+
+    return SceneObjectIntersection(this,
+                                   true,
+                                   ray,
+                                   inc,
+                                   int_pt,
+                                   normal);
+}
+
 Material SceneObject::GetMaterial() const
 {
     return this->mat;
 }
+
+void SceneObject::SplitBounds(int axis, double pos, Bounds& below, Bounds& above) const
+{
+    below = above = Bounds(this->GetBoundingBox());
+    below.hi[axis] = std::min(below.hi[axis], pos);
+    above.lo[axis] = std::max(above.lo[axis], pos);
+
+    if (below.lo[axis] > below.hi[axis]) {
+        below = Bounds();
+    }
+    if (above.lo[axis] > above.hi[axis]) {
+        above = Bounds();
+    }
+}
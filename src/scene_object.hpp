@@ -2,7 +2,9 @@
 #define _SCENE_OBJECT_HPP
 
 #include <vector>
+#include <stdint.h>
 
+#include "bounds.hpp"
 #include "box.hpp"
 #include "color.hpp"
 #include "geometry.hpp"
@@ -13,6 +15,24 @@
 
 struct Intersection;
 struct SceneObjectIntersection;
+class SceneObject;
+
+/* Where a ray hits an object, as found by SceneObject::Hit(): just
+ * enough for Finalize() to build the full intersection record, which
+ * is only worth doing for the closest of all the hits. */
+struct PrimHit {
+    /* Distance along the ray */
+    double dist;
+
+    /* Object specific, e.g. barycentric coordinates */
+    double u, v;
+
+    /* For objects made of other objects, the one that was hit */
+    const SceneObject* part;
+
+    /* For objects made of many primitives, the one that was hit */
+    uint32_t index;
+};
 
 class SceneObject : public Geometry {
 public:
@@ -23,11 +43,35 @@ public:
                                                double max_dist = INFINITY) const = 0;
     virtual Vector3D NormalAtPoint(const Vector3D& v) const = 0;
 
+    /* Find the closest hit no further than max_dist without building
+       its record. Finalize() then builds the record from hit. The
+       defaults just call Intersects(); objects whose full record costs
+       much more than finding the hit should override both. */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray, const PrimHit& hit) const;
+
+    /* Does the ray hit this object closer than max_dist? Objects that
+       can answer this faster than finding the closest hit should. */
+    virtual bool Occludes(const Ray3D& ray, double max_dist) const;
+
     virtual Material GetMaterial() const;
 
     virtual Box GetBoundingBox() const = 0;
 
+    /* Bounds of the parts of this object below and above the plane at
+       pos along axis, for builders that split objects spatially. This
+       default just cuts the bounding box in two; objects that can do
+       better should. */
+    virtual void SplitBounds(int axis, double pos, Bounds& below, Bounds& above) const;
+
 protected:
+    /* Intersects() for objects that override Hit() and Finalize() */
+    SceneObjectIntersection HitThenFinalize(const Ray3D& ray, double max_dist) const;
+
+    /* Finalize() for closed solids: the record of hit, its normal from
+       NormalAtPoint(), going inward if the ray meets the normal */
+    SceneObjectIntersection FinalizeSolid(const Ray3D& ray, const PrimHit& hit) const;
+
     Material mat;
 };
 
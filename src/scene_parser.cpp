@@ -3,10 +3,12 @@
 #include <fstream>
 #include <cstring>
 
+#include "helper.hpp"
 #include "scene_parser.hpp"
 
 SceneParser::SceneParser(std::string path) :
-    input(path.c_str())
+    input(path.c_str()),
+    geometry_hash(FNV_OFFSET_BASIS)
 {
 }
 
@@ -14,14 +16,54 @@ SceneParser::~SceneParser()
 {
 }
 
-SceneComponent* SceneParser::GetNext() {
+SceneComponent* SceneParser::GetNext()
+{
+    SceneComponent* sc = ReadComponent();
+    if (!sc) {
+        return nullptr;
+    }
+
+    switch (sc->key) {
+    case CK_VERTEX:
+    case CK_TRIANGLE:
+    case CK_NORMAL_TRIANGLE:
+    case CK_SPHERE:
+    case CK_MESH_BEGIN:
+    case CK_MESH_END:
+    case CK_INSTANCE:
+    case CK_SPHERE_SET:
+    case CK_QUAD:
+    case CK_DISK:
+    case CK_CYLINDER:
+    case CK_BOX:
+    case CK_ORIENTED_BOX:
+        geometry_hash = fnv1a(&sc->key, sizeof(sc->key), geometry_hash);
+        for (auto& val : sc->values()) {
+            geometry_hash = fnv1a(&val, sizeof(val), geometry_hash);
+        }
+
+        /* Only a file's name: whoever loads the file adds what is in it */
+        geometry_hash = fnv1a(sc->path().data(), sc->path().size(), geometry_hash);
+        break;
+    case CK_PLANE:
+        /* Planes never go in the trees, so moving one keeps them */
+    default:
+        break;
+    }
+
+    return sc;
+}
+
+SceneComponent* SceneParser::ReadComponent() {
     std::string line;
 
     // check for errors in opening the file
     if(input.fail()){
         return nullptr;
     }
+    /* Zeroed so values read as ints hash the same every time */
     SceneValue val;
+    val.d_val = 0;
     ValueList vals;
 
     //Loop through reading each line
@@ -137,6 +179,74 @@ SceneComponent* SceneParser::GetNext() {
             }
             return new SceneComponent(CK_AMBIENT_LIGHT, vals);
 
+        } else if (command == "mesh_begin") {
+            return new SceneComponent(CK_MESH_BEGIN, vals);
+
+        } else if (command == "mesh_end") {
+            return new SceneComponent(CK_MESH_END, vals);
+
+        } else if (command == "instance") {
+            /* mesh id, then translation, rotation and scale */
+            input >> val.i_val;
+            vals.push_back(val);
+            for (int i = 0; i < 7; i++) {
+                input >> val.d_val;
+                vals.push_back(val);
+            }
+            return new SceneComponent(CK_INSTANCE, vals);
+
+        } else if (command == "sphere_set") {
+            input >> line;
+            return new SceneComponent(CK_SPHERE_SET, line);
+
+        } else if (command == "plane") {
+            /* a point on the plane, then its normal */
+            for (int i = 0; i < 6; i++) {
+                input >> val.d_val;
+                vals.push_back(val);
+            }
+            return new SceneComponent(CK_PLANE, vals);
+
+        } else if (command == "quad") {
+            /* a corner, then the two edges from it */
+            for (int i = 0; i < 9; i++) {
+                input >> val.d_val;
+                vals.push_back(val);
+            }
+            return new SceneComponent(CK_QUAD, vals);
+
+        } else if (command == "disk") {
+            /* center, normal, then radius */
+            for (int i = 0; i < 7; i++) {
+                input >> val.d_val;
+                vals.push_back(val);
+            }
+            return new SceneComponent(CK_DISK, vals);
+
+        } else if (command == "cylinder") {
+            /* centers of the two caps, then radius */
+            for (int i = 0; i < 7; i++) {
+                input >> val.d_val;
+                vals.push_back(val);
+            }
+            return new SceneComponent(CK_CYLINDER, vals);
+
+        } else if (command == "box") {
+            /* lowest corner, then highest */
+            for (int i = 0; i < 6; i++) {
+                input >> val.d_val;
+                vals.push_back(val);
+            }
+            return new SceneComponent(CK_BOX, vals);
+
+        } else if (command == "oriented_box") {
+            /* center, half extents, then rotations about x, y and z */
+            for (int i = 0; i < 9; i++) {
+                input >> val.d_val;
+                vals.push_back(val);
+            }
+            return new SceneComponent(CK_ORIENTED_BOX, vals);
+
         } else if (input.eof()) {
             return nullptr;
         } else {
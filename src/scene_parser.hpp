@@ -5,6 +5,7 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <stdint.h>
 
 enum ComponentKey {
     CK_EOF,
@@ -26,6 +27,16 @@ enum ComponentKey {
     CK_SPOT_LIGHT,
     CK_AMBIENT_LIGHT,
     CK_MAX_DEPTH,
+    CK_MESH_BEGIN,
+    CK_MESH_END,
+    CK_INSTANCE,
+    CK_SPHERE_SET,
+    CK_PLANE,
+    CK_QUAD,
+    CK_DISK,
+    CK_CYLINDER,
+    CK_BOX,
+    CK_ORIENTED_BOX,
     CK_N_KEYS
 };
 
@@ -51,14 +62,26 @@ struct SceneComponent {
     {
     }
 
+    inline SceneComponent(int key, const std::string& path) :
+        key(key),
+        path_(path)
+    {
+    }
+
     const int key;
 
     inline const ValueList& values() const {
         return values_;
     }
 
+    /* File named by the component, for those that load one */
+    inline const std::string& path() const {
+        return path_;
+    }
+
 private:
     ValueList values_;
+    std::string path_;
 };
 
 class SceneParser {
@@ -68,8 +91,18 @@ public:
 
     SceneComponent* GetNext();
 
+    /* Hash of every component read so far that affects the scene's
+       geometry, e.g. to tell whether cached acceleration structures
+       still fit it. Cameras, lights and materials don't count. */
+    inline uint64_t GetGeometryHash() const {
+        return geometry_hash;
+    }
+
 private:
+    SceneComponent* ReadComponent();
+
     std::ifstream input;
+    uint64_t geometry_hash;
 };
 
 #endif
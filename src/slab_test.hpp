@@ -0,0 +1,117 @@
+#ifndef SLAB_TEST_HPP_
+#define SLAB_TEST_HPP_
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#include "bounds.hpp"
+#include "bvh.hpp"
+
+/* Slab test of a ray against a node's box. On a hit, t_entry is set
+   to where the ray enters the box (possibly negative). */
+inline bool node_intersects(const LinearBVHNode& node,
+                            const BVHRay& ray,
+                            float t_max,
+                            float* t_entry)
+{
+    float t0 = 0, t1 = t_max;
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        float t_near = (node.bounds[ray.dir_neg[axis]][axis] - ray.near_origin[axis])
+            * ray.inv_dir[axis];
+        float t_far = (node.bounds[1 - ray.dir_neg[axis]][axis] - ray.far_origin[axis])
+            * ray.inv_dir[axis] * SLAB_EPSILON;
+
+        /* Written so that NaNs (0 * inf) leave the interval alone */
+        t0 = t_near > t0 ? t_near : t0;
+        t1 = t_far < t1 ? t_far : t1;
+
+        if (t0 > t1) {
+            return false;
+        }
+    }
+
+    *t_entry = t0;
+    return true;
+}
+
+/* Slab test of one ray against four boxes at once, given each box's
+   near and far planes per axis. Returns a bit mask of the boxes that
+   were hit and stores where the ray enters them. */
+inline int slab_test4(const float* const near[N_AXES],
+                      const float* const far[N_AXES],
+                      int base,
+                      const BVHRay& ray,
+                      float t_max,
+                      float* t_entry)
+{
+#if defined(__SSE__)
+    __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(t_max),
+        eps = _mm_set1_ps(SLAB_EPSILON);
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        __m128 o_near = _mm_set1_ps(ray.near_origin[axis]),
+            o_far = _mm_set1_ps(ray.far_origin[axis]),
+            inv = _mm_set1_ps(ray.inv_dir[axis]);
+        __m128 t_near = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near[axis] + base), o_near), inv);
+        __m128 t_far = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far[axis] + base), o_far), inv), eps);
+
+        /* max/min return their second operand for NaNs (0 * inf),
+           which leaves the interval alone */
+        t0 = _mm_max_ps(t_near, t0);
+        t1 = _mm_min_ps(t_far, t1);
+    }
+
+    _mm_storeu_ps(t_entry, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+
+    for (int i = 0; i < 4; i++) {
+        float t0 = 0, t1 = t_max;
+
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            float t_near = (near[axis][base + i] - ray.near_origin[axis]) * ray.inv_dir[axis];
+            float t_far = (far[axis][base + i] - ray.far_origin[axis]) * ray.inv_dir[axis]
+                * SLAB_EPSILON;
+            t0 = t_near > t0 ? t_near : t0;
+            t1 = t_far < t1 ? t_far : t1;
+        }
+
+        t_entry[i] = t0;
+        mask |= (t0 <= t1) << i;
+    }
+
+    return mask;
+#endif
+}
+
+#if defined(__AVX__)
+/* Same as slab_test4, for eight boxes */
+inline int slab_test8(const float* const near[N_AXES],
+                      const float* const far[N_AXES],
+                      const BVHRay& ray,
+                      float t_max,
+                      float* t_entry)
+{
+    __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(t_max),
+        eps = _mm256_set1_ps(SLAB_EPSILON);
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        __m256 o_near = _mm256_set1_ps(ray.near_origin[axis]),
+            o_far = _mm256_set1_ps(ray.far_origin[axis]),
+            inv = _mm256_set1_ps(ray.inv_dir[axis]);
+        __m256 t_near = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near[axis]), o_near), inv);
+        __m256 t_far = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far[axis]), o_far), inv), eps);
+
+        t0 = _mm256_max_ps(t_near, t0);
+        t1 = _mm256_min_ps(t_far, t1);
+    }
+
+    _mm256_storeu_ps(t_entry, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+#endif
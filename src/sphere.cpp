@@ -11,50 +11,48 @@ Sphere::~Sphere()
 {
 }
 
-SceneObjectIntersection Sphere::Intersects(const Ray3D& ray, double max_dist) const
+bool Sphere::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
 {
-    Vector3D to_ray_origin = ray.GetOrigin() - this->pos;
-
-    /* object must be "in front of" the ray */
-    if (ray.GetDir().Dot(-to_ray_origin) <= 0) {
-        return SceneObjectIntersection(this, false, ray);
+    Vector3D origin = ray.GetOrigin(), dir = ray.GetDir();
+    double o[N_AXES], d[N_AXES], center[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        o[axis] = origin.GetValue(axis);
+        d[axis] = dir.GetValue(axis);
+        center[axis] = this->pos.GetValue(axis);
     }
 
-    /* determinant */
-    double base = -(ray.GetDir().Dot(to_ray_origin));
-    double det = pow(ray.GetDir().Dot(to_ray_origin), 2)
-        - pow(to_ray_origin.Norm(), 2)
-        + pow(this->radius, 2);
-
-    if (det < 0) {
-        /* No intersection with sphere */
-        return SceneObjectIntersection(this, false, ray);
-    } else {
-        /* Either one or two intersections; return closer one to camera */
-        double s = sqrt(det);
-        double t = s > base ? (base + s) : (base - s);
+    if (!hit_sphere(o, d, center, this->radius, max_dist, hit.dist)) {
+        return false;
+    }
 
-        /* Correct for "acne" by ignoring intersections at t=0 */
-        if (is_zero(t)) {
-            t = base + s;
-        }
+    hit.part = this;
+    return true;
+}
 
-        if (t <= max_dist) {
-            Vector3D int_pt = ray.Point(t);
-            int inc = ray.GetDir().Dot(this->NormalAtPoint(int_pt)) < 0 ?
-                INC_INWARD :
-                INC_OUTWARD; // Incidence
+SceneObjectIntersection Sphere::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    Vector3D int_pt = ray.Point(hit.dist);
+    Vector3D normal = this->NormalAtPoint(int_pt);
+    int inc = ray.GetDir().Dot(normal) < 0 ?
+        INC_INWARD :
+        INC_OUTWARD; // Incidence
+
+    return SceneObjectIntersection(this,
+                                   true,
+                                   ray,
+                                   inc,
+                                   int_pt,
+                                   normal);
+}
 
-            return SceneObjectIntersection(this,
-                                           true,
-                                           ray,
-                                           inc,
-                                           int_pt,
-                                           this->NormalAtPoint(int_pt));
-        } else {
-            return SceneObjectIntersection(this, false, ray);
-        }
+SceneObjectIntersection Sphere::Intersects(const Ray3D& ray, double max_dist) const
+{
+    PrimHit hit;
+    if (!this->Hit(ray, max_dist, hit)) {
+        return SceneObjectIntersection(this, false, ray);
     }
+
+    return this->Finalize(ray, hit);
 }
 
 Box Sphere::GetBoundingBox() const
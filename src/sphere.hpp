@@ -1,9 +1,55 @@
 #ifndef SPHERE_HPP_
 #define SPHERE_HPP_
 
+#include <cmath>
+
+#include "helper.hpp"
 #include "scene_object.hpp"
 #include "vector.hpp"
 
+/* Test of the ray with origin o and direction d against the sphere
+   around center. On a hit no further than max_dist, sets t to the
+   nearer intersection in front of the ray, or to the far one if the
+   near one is too close to the origin to tell from it. */
+inline bool hit_sphere(const double o[N_AXES], const double d[N_AXES],
+                       const double center[N_AXES], double radius,
+                       double max_dist, double& t)
+{
+    double to_ray_origin[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        to_ray_origin[axis] = o[axis] - center[axis];
+    }
+
+    /* object must be "in front of" the ray */
+    double base = -(d[AXIS_X] * to_ray_origin[AXIS_X] +
+                    d[AXIS_Y] * to_ray_origin[AXIS_Y] +
+                    d[AXIS_Z] * to_ray_origin[AXIS_Z]);
+    if (base <= 0) {
+        return false;
+    }
+
+    /* determinant */
+    double dist = std::sqrt(to_ray_origin[AXIS_X] * to_ray_origin[AXIS_X] +
+                            to_ray_origin[AXIS_Y] * to_ray_origin[AXIS_Y] +
+                            to_ray_origin[AXIS_Z] * to_ray_origin[AXIS_Z]);
+    double det = base * base - dist * dist + radius * radius;
+    if (det < 0) {
+        /* No intersection with sphere */
+        return false;
+    }
+
+    /* Either one or two intersections; return closer one to camera */
+    double s = std::sqrt(det);
+    t = s > base ? (base + s) : (base - s);
+
+    /* Correct for "acne" by ignoring intersections at t=0 */
+    if (is_zero(t)) {
+        t = base + s;
+    }
+
+    return t <= max_dist;
+}
+
 class Sphere : public SceneObject {
 public:
     Sphere(const Vector3D& pos, double radius, const Material& mat);
@@ -11,8 +57,17 @@ public:
 
     virtual SceneObjectIntersection Intersects(const Ray3D& ray, double max_dist) const override;
 
+    /* The hit point and normal wait for Finalize() */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
     virtual Box GetBoundingBox() const override;
 
+    inline double GetRadius() const {
+        return radius;
+    }
+
 private:
     double radius;
 
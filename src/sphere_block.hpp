@@ -0,0 +1,183 @@
+#ifndef SPHERE_BLOCK_HPP_
+#define SPHERE_BLOCK_HPP_
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <stdint.h>
+
+#include "helper.hpp"
+#include "sphere.hpp"
+#include "vector.hpp"
+
+/* Spheres in a SphereBlock */
+const int SPHERE_BLOCK_SIZE = 4;
+
+/* The centers and radii of four spheres, coordinate by coordinate, in
+   single precision: a block fills one 64-byte cache line. center[axis]
+   [lane] is the axis coordinate of the lane's sphere's center. */
+struct SphereBlock {
+    float center[N_AXES][SPHERE_BLOCK_SIZE];
+    float radius[SPHERE_BLOCK_SIZE];
+};
+
+/* Bit mask of the lanes of the block holding slot first that hold
+   slots before end */
+inline int sphere_lanes(uint32_t first, uint32_t end)
+{
+    uint32_t lo = first % SPHERE_BLOCK_SIZE;
+    uint32_t hi = std::min<uint32_t>(SPHERE_BLOCK_SIZE, lo + (end - first));
+    return ((1 << hi) - 1) & ~((1 << lo) - 1);
+}
+
+#if defined(__AVX__)
+/* hit_sphere() for all four lanes of a block, in double precision.
+   Returns a bit mask of the lanes in lanes that were hit, and sets
+   their t. */
+inline int hit_sphere4(const double o[N_AXES], const double d[N_AXES],
+                       const SphereBlock& block, int lanes, double max_dist,
+                       double* t)
+{
+    /* The same operations as hit_sphere(), in the same order, so a
+       sphere is hit or missed the same way in any lane */
+    __m256d to[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        to[axis] = _mm256_sub_pd(_mm256_set1_pd(o[axis]),
+                                 _mm256_cvtps_pd(_mm_loadu_ps(block.center[axis])));
+    }
+
+    __m256d zero = _mm256_setzero_pd();
+    __m256d base = _mm256_sub_pd(zero, _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(d[AXIS_X]), to[AXIS_X]),
+                      _mm256_mul_pd(_mm256_set1_pd(d[AXIS_Y]), to[AXIS_Y])),
+        _mm256_mul_pd(_mm256_set1_pd(d[AXIS_Z]), to[AXIS_Z])));
+
+    __m256d dist = _mm256_sqrt_pd(_mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(to[AXIS_X], to[AXIS_X]),
+                      _mm256_mul_pd(to[AXIS_Y], to[AXIS_Y])),
+        _mm256_mul_pd(to[AXIS_Z], to[AXIS_Z])));
+    __m256d radius = _mm256_cvtps_pd(_mm_loadu_ps(block.radius));
+    __m256d det = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(base, base),
+                                              _mm256_mul_pd(dist, dist)),
+                                _mm256_mul_pd(radius, radius));
+
+    /* Lanes with no intersection get NaNs here, and are masked out */
+    __m256d s = _mm256_sqrt_pd(det);
+    __m256d far = _mm256_add_pd(base, s);
+    __m256d t_hit = _mm256_blendv_pd(_mm256_sub_pd(base, s), far,
+                                     _mm256_cmp_pd(s, base, _CMP_GT_OQ));
+
+    /* Correct for "acne" by ignoring intersections at t=0 */
+    __m256d abs_t = _mm256_andnot_pd(_mm256_set1_pd(-0.0), t_hit);
+    t_hit = _mm256_blendv_pd(t_hit, far,
+                             _mm256_cmp_pd(abs_t, _mm256_set1_pd(EPSILON), _CMP_LT_OQ));
+
+    __m256d hit = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(base, zero, _CMP_GT_OQ),
+                                              _mm256_cmp_pd(det, zero, _CMP_GE_OQ)),
+                                _mm256_cmp_pd(t_hit, _mm256_set1_pd(max_dist), _CMP_LE_OQ));
+
+    int mask = _mm256_movemask_pd(hit) & lanes;
+    if (mask) {
+        _mm256_storeu_pd(t, t_hit);
+    }
+    return mask;
+}
+#elif defined(__SSE2__)
+/* hit_sphere() for two lanes of a block, whose centers and radii are
+   given, as a two bit mask */
+inline int hit_sphere2(const __m128d o[N_AXES], const __m128d d[N_AXES],
+                       const __m128d center[N_AXES], __m128d radius,
+                       double max_dist, double* t)
+{
+    __m128d to[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        to[axis] = _mm_sub_pd(o[axis], center[axis]);
+    }
+
+    __m128d zero = _mm_setzero_pd();
+    __m128d base = _mm_sub_pd(zero, _mm_add_pd(
+        _mm_add_pd(_mm_mul_pd(d[AXIS_X], to[AXIS_X]), _mm_mul_pd(d[AXIS_Y], to[AXIS_Y])),
+        _mm_mul_pd(d[AXIS_Z], to[AXIS_Z])));
+
+    __m128d dist = _mm_sqrt_pd(_mm_add_pd(
+        _mm_add_pd(_mm_mul_pd(to[AXIS_X], to[AXIS_X]), _mm_mul_pd(to[AXIS_Y], to[AXIS_Y])),
+        _mm_mul_pd(to[AXIS_Z], to[AXIS_Z])));
+    __m128d det = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(base, base), _mm_mul_pd(dist, dist)),
+                             _mm_mul_pd(radius, radius));
+
+    /* Lanes with no intersection get NaNs here, and are masked out */
+    __m128d s = _mm_sqrt_pd(det);
+    __m128d far = _mm_add_pd(base, s);
+    __m128d use_far = _mm_cmpgt_pd(s, base);
+    __m128d t_hit = _mm_or_pd(_mm_and_pd(use_far, far),
+                              _mm_andnot_pd(use_far, _mm_sub_pd(base, s)));
+
+    /* Correct for "acne" by ignoring intersections at t=0 */
+    __m128d abs_t = _mm_andnot_pd(_mm_set1_pd(-0.0), t_hit);
+    use_far = _mm_cmplt_pd(abs_t, _mm_set1_pd(EPSILON));
+    t_hit = _mm_or_pd(_mm_and_pd(use_far, far), _mm_andnot_pd(use_far, t_hit));
+
+    __m128d hit = _mm_and_pd(_mm_and_pd(_mm_cmpgt_pd(base, zero), _mm_cmpge_pd(det, zero)),
+                             _mm_cmple_pd(t_hit, _mm_set1_pd(max_dist)));
+
+    int mask = _mm_movemask_pd(hit);
+    if (mask) {
+        _mm_storeu_pd(t, t_hit);
+    }
+    return mask;
+}
+
+/* hit_sphere() for all four lanes of a block, as two pairs */
+inline int hit_sphere4(const double o[N_AXES], const double d[N_AXES],
+                       const SphereBlock& block, int lanes, double max_dist,
+                       double* t)
+{
+    __m128d o2[N_AXES], d2[N_AXES], lo[N_AXES], hi[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        __m128 center = _mm_loadu_ps(block.center[axis]);
+        o2[axis] = _mm_set1_pd(o[axis]);
+        d2[axis] = _mm_set1_pd(d[axis]);
+        lo[axis] = _mm_cvtps_pd(center);
+        hi[axis] = _mm_cvtps_pd(_mm_movehl_ps(center, center));
+    }
+    __m128 radius = _mm_loadu_ps(block.radius);
+
+    int mask = 0;
+    if (lanes & 0x3) {
+        mask |= hit_sphere2(o2, d2, lo, _mm_cvtps_pd(radius), max_dist, t);
+    }
+    if (lanes & 0xc) {
+        mask |= hit_sphere2(o2, d2, hi, _mm_cvtps_pd(_mm_movehl_ps(radius, radius)),
+                            max_dist, t + 2) << 2;
+    }
+    return mask & lanes;
+}
+#else
+/* hit_sphere() for each of the lanes in lanes */
+inline int hit_sphere4(const double o[N_AXES], const double d[N_AXES],
+                       const SphereBlock& block, int lanes, double max_dist,
+                       double* t)
+{
+    int mask = 0;
+
+    for (int i = 0; i < SPHERE_BLOCK_SIZE; i++) {
+        if (!(lanes & (1 << i))) {
+            continue;
+        }
+
+        double center[N_AXES];
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            center[axis] = block.center[axis][i];
+        }
+        if (hit_sphere(o, d, center, block.radius[i], max_dist, t[i])) {
+            mask |= 1 << i;
+        }
+    }
+
+    return mask;
+}
+#endif
+
+#endif
@@ -0,0 +1,413 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "bounds.hpp"
+#include "bvh.hpp"
+#include "bvh_traversal.hpp"
+#include "helper.hpp"
+#include "intersection.hpp"
+#include "sphere_block.hpp"
+#include "sphere_set.hpp"
+
+/* Bump the last character whenever the layout changes */
+static const char SPHERE_SET_MAGIC[8] = {'P', 'T', 'S', 'P', 'H', 'R', 0, '1'};
+
+struct SphereSetHeader {
+    char magic[8];
+    uint64_t n_spheres;
+};
+
+/* A set's spheres, as read, seen as indexed primitives for the BVH
+   builders */
+class SetSpheres : public BVHPrimitives {
+public:
+    SetSpheres(const SphereSet& set) : set(set) {}
+
+    size_t Size() const {
+        return set.Size();
+    }
+
+    Bounds GetBounds(uint32_t i) const {
+        Bounds bounds;
+        double radius = set.GetRadius(i);
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            double center = set.GetCenter(i, axis);
+            bounds.lo[axis] = center - radius;
+            bounds.hi[axis] = center + radius;
+        }
+        return bounds;
+    }
+
+private:
+    const SphereSet& set;
+};
+
+class SphereSet::PackedSpheres : public BVHPrimitives {
+public:
+    PackedSpheres(const SphereSet& set) : set(set) {}
+
+    size_t Size() const {
+        return set.Size();
+    }
+
+    Bounds GetBounds(uint32_t i) const {
+        const SphereBlock& block = set.blocks[i / SPHERE_BLOCK_SIZE];
+        int lane = i % SPHERE_BLOCK_SIZE;
+
+        Bounds bounds;
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            bounds.lo[axis] = block.center[axis][lane] - block.radius[lane];
+            bounds.hi[axis] = block.center[axis][lane] + block.radius[lane];
+        }
+        return bounds;
+    }
+
+private:
+    const SphereSet& set;
+};
+
+SphereSet::SphereSet() :
+    SceneObject(Vector3D(), DEFAULT_MAT),
+    n_spheres(0),
+    bounds(),
+    bvh(nullptr),
+    mat_id(0)
+{
+}
+
+SphereSet::~SphereSet()
+{
+    delete this->bvh;
+
+    for (auto part : this->parts) {
+        delete part;
+    }
+}
+
+bool SphereSet::Load(const std::string& path, const MaterialPool& mats)
+{
+    assert(!this->bvh && this->n_spheres == 0);
+
+    FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+
+    /* Spheres are indexed with 32 bits */
+    SphereSetHeader header;
+    if (std::fread(&header, sizeof(header), 1, f) != 1 ||
+        std::memcmp(header.magic, SPHERE_SET_MAGIC, sizeof(SPHERE_SET_MAGIC)) != 0 ||
+        header.n_spheres == 0 || header.n_spheres > UINT32_MAX) {
+        std::fclose(f);
+        return false;
+    }
+
+    size_t n = header.n_spheres;
+    bool ok = true;
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        this->centers[axis].resize(n);
+        ok = ok && std::fread(this->centers[axis].data(), sizeof(float), n, f) == n;
+    }
+    this->radii.resize(n);
+    this->mat_ids.resize(n);
+    ok = ok && std::fread(this->radii.data(), sizeof(float), n, f) == n
+        && std::fread(this->mat_ids.data(), sizeof(uint16_t), n, f) == n
+        && std::fgetc(f) == EOF;
+    std::fclose(f);
+
+    for (size_t i = 0; ok && i < n; i++) {
+        ok = this->mat_ids[i] < mats.size() && std::isfinite(this->radii[i])
+            && this->radii[i] > 0;
+        for (int axis = AXIS_X; ok && axis < N_AXES; axis++) {
+            ok = std::isfinite(this->centers[axis][i]);
+        }
+    }
+
+    if (!ok) {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            std::vector<float>().swap(this->centers[axis]);
+        }
+        std::vector<float>().swap(this->radii);
+        std::vector<uint16_t>().swap(this->mat_ids);
+        return false;
+    }
+
+    this->n_spheres = n;
+    for (auto& mat : mats) {
+        this->parts.push_back(new ObjectPart(this, mat));
+    }
+
+    /* The mean builder places the set at the center of its bounds */
+    SetSpheres spheres(*this);
+    for (uint32_t i = 0; i < n; i++) {
+        this->bounds.Expand(spheres.GetBounds(i));
+    }
+    this->pos = Vector3D(this->bounds.Center(AXIS_X),
+                         this->bounds.Center(AXIS_Y),
+                         this->bounds.Center(AXIS_Z));
+
+    return true;
+}
+
+uint64_t SphereSet::Hash(uint64_t h) const
+{
+    assert(!this->bvh);
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        h = fnv1a(this->centers[axis].data(), this->n_spheres * sizeof(float), h);
+    }
+    h = fnv1a(this->radii.data(), this->n_spheres * sizeof(float), h);
+    return fnv1a(this->mat_ids.data(), this->n_spheres * sizeof(uint16_t), h);
+}
+
+void SphereSet::Build(const BVHOptions& options)
+{
+    if (!this->bvh) {
+        /* Leaves are tested a block at a time, so up to a block's
+           worth of spheres cost about as much as one. Sparse spheres
+           would still be split down to one a leaf, with a node of
+           twice the size of its sphere's slot, so leaves are filled. */
+        BVHOptions block_options = options;
+        block_options.leaf_block = SPHERE_BLOCK_SIZE;
+        block_options.leaf_fill = FILL_BLOCKS * SPHERE_BLOCK_SIZE;
+
+        /* A sphere referenced from several leaves would need a slot in
+           each, which costs more than the overlap it saves */
+        if (block_options.builder == BVH_BUILD_SBVH) {
+            block_options.builder = BVH_BUILD_SAH;
+        }
+
+        this->bvh = new BVH(SetSpheres(*this), block_options);
+        PackBlocks();
+    }
+}
+
+void SphereSet::SetBVH(BVH* bvh)
+{
+    if (this->bvh) {
+        delete bvh;
+        return;
+    }
+
+    this->bvh = bvh;
+    PackBlocks();
+}
+
+void SphereSet::PackBlocks()
+{
+    const std::vector<uint32_t>& spheres = this->bvh->GetIndices();
+
+    /* Lanes past the last sphere are never tested */
+    size_t n_slots = spheres.size();
+    this->blocks.assign((n_slots + SPHERE_BLOCK_SIZE - 1) / SPHERE_BLOCK_SIZE, SphereBlock());
+    this->blocks.shrink_to_fit();
+
+    /* Sets are often all of one material, which needs no slot of its
+       own */
+    this->mat_id = this->mat_ids[0];
+    bool one_mat = std::all_of(this->mat_ids.begin(), this->mat_ids.end(),
+                               [&](uint16_t id) { return id == this->mat_id; });
+    this->slot_mats.assign(one_mat ? 0 : n_slots, 0);
+    this->slot_mats.shrink_to_fit();
+
+    for (size_t slot = 0; slot < n_slots; slot++) {
+        uint32_t sphere = spheres[slot];
+        SphereBlock& dest = this->blocks[slot / SPHERE_BLOCK_SIZE];
+        int lane = slot % SPHERE_BLOCK_SIZE;
+
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            dest.center[axis][lane] = this->centers[axis][sphere];
+        }
+        dest.radius[lane] = this->radii[sphere];
+        if (!one_mat) {
+            this->slot_mats[slot] = this->mat_ids[sphere];
+        }
+    }
+
+    /* Everything is in the blocks now */
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        std::vector<float>().swap(this->centers[axis]);
+    }
+    std::vector<float>().swap(this->radii);
+    std::vector<uint16_t>().swap(this->mat_ids);
+}
+
+void SphereSet::Renumber()
+{
+    assert(this->bvh);
+
+    /* Slots are in the order of the BVH's references already */
+    this->bvh->DropIndices();
+}
+
+void SphereSet::UnpackBlocks()
+{
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        this->centers[axis].resize(this->n_spheres);
+    }
+    this->radii.resize(this->n_spheres);
+    this->mat_ids.resize(this->n_spheres);
+
+    for (size_t slot = 0; slot < this->n_spheres; slot++) {
+        const SphereBlock& src = this->blocks[slot / SPHERE_BLOCK_SIZE];
+        int lane = slot % SPHERE_BLOCK_SIZE;
+
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            this->centers[axis][slot] = src.center[axis][lane];
+        }
+        this->radii[slot] = src.radius[lane];
+        this->mat_ids[slot] = this->slot_mats.empty() ? this->mat_id : this->slot_mats[slot];
+    }
+
+    std::vector<SphereBlock>().swap(this->blocks);
+    std::vector<uint16_t>().swap(this->slot_mats);
+}
+
+void SphereSet::Move(const Transform& transform)
+{
+    assert(this->bvh);
+
+    for (size_t slot = 0; slot < this->n_spheres; slot++) {
+        SphereBlock& block = this->blocks[slot / SPHERE_BLOCK_SIZE];
+        int lane = slot % SPHERE_BLOCK_SIZE;
+
+        Vector3D center = transform.Point(Vector3D(block.center[AXIS_X][lane],
+                                                   block.center[AXIS_Y][lane],
+                                                   block.center[AXIS_Z][lane]));
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            block.center[axis][lane] = center.GetValue(axis);
+        }
+    }
+}
+
+bool SphereSet::UpdateBVH(const BVHOptions& options)
+{
+    Renumber();
+
+    PackedSpheres spheres(*this);
+    this->bounds = Bounds();
+    for (uint32_t i = 0; i < this->n_spheres; i++) {
+        this->bounds.Expand(spheres.GetBounds(i));
+    }
+    this->pos = Vector3D(this->bounds.Center(AXIS_X),
+                         this->bounds.Center(AXIS_Y),
+                         this->bounds.Center(AXIS_Z));
+
+    this->bvh->Refit(spheres, options.n_threads);
+    if (!this->bvh->NeedsRebuild()) {
+        return false;
+    }
+
+    UnpackBlocks();
+    delete this->bvh;
+    this->bvh = nullptr;
+    Build(options);
+    Renumber();
+    return true;
+}
+
+bool SphereSet::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    assert(this->bvh);
+
+    Vector3D origin = ray.GetOrigin(), dir = ray.GetDir();
+    double o[N_AXES], d[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        o[axis] = origin.GetValue(axis);
+        d[axis] = dir.GetValue(axis);
+    }
+    hit.dist = INFINITY;
+
+    bool found = this->bvh->TraverseClosest(0, ray, max_dist, [&](uint32_t first, uint32_t count,
+                                                                  double& max_dist) {
+            bool found = false;
+            uint32_t end = first + count;
+
+            for (uint32_t slot = first; slot < end;) {
+                uint32_t block = slot / SPHERE_BLOCK_SIZE;
+                double t[SPHERE_BLOCK_SIZE];
+                int mask = hit_sphere4(o, d, this->blocks[block], sphere_lanes(slot, end),
+                                       max_dist, t);
+
+                /* All lanes were tested against the same max_dist, so
+                   a later one may still be further than an earlier */
+                for (int i = 0; i < SPHERE_BLOCK_SIZE; i++) {
+                    if (!(mask & (1 << i)) || !(t[i] < hit.dist)) {
+                        continue;
+                    }
+
+                    hit.dist = t[i];
+                    hit.index = block * SPHERE_BLOCK_SIZE + i;
+                    max_dist = t[i];
+                    found = true;
+                }
+                slot = (block + 1) * SPHERE_BLOCK_SIZE;
+            }
+            return found;
+        });
+
+    hit.part = this;
+    return found;
+}
+
+SceneObjectIntersection SphereSet::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    const SphereBlock& block = this->blocks[hit.index / SPHERE_BLOCK_SIZE];
+    int lane = hit.index % SPHERE_BLOCK_SIZE;
+    Vector3D center(block.center[AXIS_X][lane],
+                    block.center[AXIS_Y][lane],
+                    block.center[AXIS_Z][lane]);
+
+    /* The same record as Sphere's */
+    Vector3D int_pt = ray.Point(hit.dist);
+    Vector3D normal = center.To(int_pt).Normalized();
+    int inc = ray.GetDir().Dot(normal) < 0 ? INC_INWARD : INC_OUTWARD;
+
+    uint16_t mat = this->slot_mats.empty() ? this->mat_id : this->slot_mats[hit.index];
+    return SceneObjectIntersection(this->parts[mat],
+                                   true,
+                                   ray,
+                                   inc,
+                                   int_pt,
+                                   normal);
+}
+
+SceneObjectIntersection SphereSet::Intersects(const Ray3D& ray, double max_dist) const
+{
+    return this->HitThenFinalize(ray, max_dist);
+}
+
+bool SphereSet::Occludes(const Ray3D& ray, double max_dist) const
+{
+    assert(this->bvh);
+
+    Vector3D origin = ray.GetOrigin(), dir = ray.GetDir();
+    double o[N_AXES], d[N_AXES];
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        o[axis] = origin.GetValue(axis);
+        d[axis] = dir.GetValue(axis);
+    }
+
+    return this->bvh->TraverseAny(ray, max_dist, [&](uint32_t first, uint32_t count) {
+            uint32_t end = first + count;
+
+            for (uint32_t slot = first; slot < end;) {
+                uint32_t block = slot / SPHERE_BLOCK_SIZE;
+                double t[SPHERE_BLOCK_SIZE];
+                if (hit_sphere4(o, d, this->blocks[block], sphere_lanes(slot, end),
+                                max_dist, t)) {
+                    return true;
+                }
+                slot = (block + 1) * SPHERE_BLOCK_SIZE;
+            }
+            return false;
+        });
+}
+
+Box SphereSet::GetBoundingBox() const
+{
+    return this->bounds.ToBox();
+}
@@ -0,0 +1,158 @@
+#ifndef SPHERE_SET_HPP_
+#define SPHERE_SET_HPP_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "bounds.hpp"
+#include "box.hpp"
+#include "bvh.hpp"
+#include "intersection.hpp"
+#include "material.hpp"
+#include "object_part.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "sphere_block.hpp"
+#include "transform.hpp"
+#include "vector.hpp"
+
+/* Many spheres as a single object, for particle and molecular data
+ * sets far too big for one Sphere each. Spheres are read from a binary
+ * file into arrays of centers, radii and material ids, in single
+ * precision, and the set has its own BVH over them. Once the BVH is
+ * known, the spheres are moved into blocks in the order the leaves
+ * refer to them, which are tested four at a time, and the arrays they
+ * were read into are freed. The BVH never splits a few blocks' worth
+ * of spheres, but its leaves rarely fill whole blocks, so the slots
+ * are packed without gaps and a leaf may start partway through a block
+ * and end in the next. Once the slots are numbered as the spheres, the
+ * BVH needs no index of them either.
+ *
+ * A sphere then takes a sixteen byte slot of a block, a two byte
+ * material id unless the set has only the one, and about five bytes of
+ * BVH nodes: 21 bytes a sphere in all for a million randomly placed
+ * spheres of one material.
+ *
+ * The file is a header, eight bytes of magic "PTSPHR" 0 '1' and the
+ * number of spheres as a uint64_t, followed by every sphere's center x,
+ * then every center y, then every center z and every radius as floats,
+ * then every material id as a uint16_t. Material ids count the
+ * scene's materials in the order they are defined, with 0 the default
+ * one. Everything is in the machine's byte order.
+ */
+class SphereSet : public SceneObject {
+public:
+    SphereSet();
+    virtual ~SphereSet();
+
+    /* Read the spheres in the file at path, whose material ids index
+       mats. Returns false if the file can't be read, is damaged or
+       refers to materials not in mats. */
+    bool Load(const std::string& path, const MaterialPool& mats);
+
+    /* Hash of the spheres read, continuing from h, e.g. to tell
+       whether a cached BVH was built over them. Only valid before the
+       BVH is built or set. */
+    uint64_t Hash(uint64_t h) const;
+
+    /* Build the set's BVH. Does nothing if it is already built. */
+    void Build(const BVHOptions& options = BVHOptions());
+
+    /* Use a BVH built elsewhere over the spheres, e.g. one read from a
+       cache, instead of building one. The set takes ownership. Once
+       the spheres are packed for one BVH they can't be for another, so
+       if the set already has one it keeps it and deletes bvh. */
+    void SetBVH(BVH* bvh);
+
+    /* Number the spheres by slot from now on, so the BVH can let go
+       of its index of them. They can't be matched against the file
+       any more, e.g. to cache the BVH, so Scene calls this once any
+       cache is written. Only valid once the BVH is built or set. */
+    void Renumber();
+
+    /* Move every sphere's center by transform, which should be rigid,
+       as radii are kept. Only valid once the BVH is built or set;
+       UpdateBVH() must be called before the set is traced again. */
+    void Move(const Transform& transform);
+
+    /* Catch up with the spheres moved since the BVH was built, by
+       refitting it, or rebuilding it once refitting has made it too
+       loose. Returns whether it was rebuilt. */
+    bool UpdateBVH(const BVHOptions& options = BVHOptions());
+
+    inline const BVH* GetBVH() const {
+        return bvh;
+    }
+
+    inline size_t Size() const {
+        return n_spheres;
+    }
+
+    /* A sphere as read; only valid before the BVH is built or set */
+    inline float GetCenter(uint32_t sphere, int axis) const {
+        return centers[axis][sphere];
+    }
+
+    inline float GetRadius(uint32_t sphere) const {
+        return radii[sphere];
+    }
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    /* hit.index is the slot of the sphere that was hit */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
+    virtual bool Occludes(const Ray3D& ray, double max_dist) const override;
+
+    virtual Box GetBoundingBox() const override;
+
+private:
+    /* Ranges of up to this many blocks of spheres are never split.
+       Past one block, this trades a little time testing spheres for
+       fewer nodes: at four, the nodes take about five bytes a sphere,
+       for a few percent more time tracing. */
+    static const int FILL_BLOCKS = 4;
+
+    /* The packed spheres as primitives numbered by slot, for refitting
+       the BVH once renumbered */
+    class PackedSpheres;
+
+    /* Fill blocks and slot_mats from the BVH's leaves, then free the
+       arrays the spheres were read into */
+    void PackBlocks();
+
+    /* Undo PackBlocks() for renumbered spheres, so the BVH can be
+       built anew */
+    void UnpackBlocks();
+
+    size_t n_spheres;
+
+    /* The spheres as read, until they are packed */
+    std::vector<float> centers[N_AXES], radii;
+    std::vector<uint16_t> mat_ids;
+
+    /* One part per material the ids can refer to */
+    std::vector<const ObjectPart*> parts;
+
+    Bounds bounds;
+    BVH* bvh;
+
+    /* The spheres, and their material ids, in slots numbered as the
+       BVH's references are. slot_mats is empty if every sphere has
+       material mat_id. */
+    std::vector<SphereBlock> blocks;
+    std::vector<uint16_t> slot_mats;
+    uint16_t mat_id;
+
+    /* Normals are only known at hits, and are reported by Finalize */
+    virtual inline Vector3D NormalAtPoint(const Vector3D& v) const override
+    {
+        return Vector3D();
+    };
+};
+
+#endif
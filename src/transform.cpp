@@ -0,0 +1,133 @@
+#include <cassert>
+#include <cmath>
+
+#include "box.hpp"
+#include "scene_parser.hpp"
+#include "transform.hpp"
+#include "vector.hpp"
+
+Transform::Transform()
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            m[i][j] = inv[i][j] = i == j;
+        }
+    }
+}
+
+Transform::Transform(const SceneComponent* sc, int start_val) :
+    Transform()
+{
+    const ValueList& v = sc->values();
+
+    *this = Translate(Vector3D(sc, start_val))
+        * Rotate(AXIS_Z, v[start_val + 5].d_val)
+        * Rotate(AXIS_Y, v[start_val + 4].d_val)
+        * Rotate(AXIS_X, v[start_val + 3].d_val)
+        * Scale(v[start_val + 6].d_val);
+}
+
+Transform Transform::Translate(const Vector3D& offset)
+{
+    Transform t;
+    for (int i = 0; i < 3; i++) {
+        t.m[i][3] = offset.GetValue(i);
+        t.inv[i][3] = -offset.GetValue(i);
+    }
+    return t;
+}
+
+Transform Transform::Scale(double factor)
+{
+    assert(factor != 0);
+
+    Transform t;
+    for (int i = 0; i < 3; i++) {
+        t.m[i][i] = factor;
+        t.inv[i][i] = 1 / factor;
+    }
+    return t;
+}
+
+Transform Transform::Rotate(int axis, double degrees)
+{
+    double rad = degrees * M_PI / 180, c = std::cos(rad), s = std::sin(rad);
+    int a = (axis + 1) % 3, b = (axis + 2) % 3;
+
+    /* Rotations are orthogonal, so the inverse is the transpose */
+    Transform t;
+    t.m[a][a] = t.m[b][b] = t.inv[a][a] = t.inv[b][b] = c;
+    t.m[a][b] = t.inv[b][a] = -s;
+    t.m[b][a] = t.inv[a][b] = s;
+    return t;
+}
+
+/* Product of two 3x4 affine matrices, treating the missing row as
+   (0, 0, 0, 1) */
+static void multiply(const double a[3][4], const double b[3][4], double out[3][4])
+{
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+        }
+        out[i][3] += a[i][3];
+    }
+}
+
+Transform Transform::operator* (const Transform& t) const
+{
+    Transform r;
+    multiply(this->m, t.m, r.m);
+    multiply(t.inv, this->inv, r.inv);
+    return r;
+}
+
+Transform Transform::Inverse() const
+{
+    Transform r;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            r.m[i][j] = inv[i][j];
+            r.inv[i][j] = m[i][j];
+        }
+    }
+    return r;
+}
+
+Vector3D Transform::Point(const Vector3D& p) const
+{
+    return Vector3D(m[0][0] * p.GetX() + m[0][1] * p.GetY() + m[0][2] * p.GetZ() + m[0][3],
+                    m[1][0] * p.GetX() + m[1][1] * p.GetY() + m[1][2] * p.GetZ() + m[1][3],
+                    m[2][0] * p.GetX() + m[2][1] * p.GetY() + m[2][2] * p.GetZ() + m[2][3]);
+}
+
+Vector3D Transform::Vector(const Vector3D& v) const
+{
+    return Vector3D(m[0][0] * v.GetX() + m[0][1] * v.GetY() + m[0][2] * v.GetZ(),
+                    m[1][0] * v.GetX() + m[1][1] * v.GetY() + m[1][2] * v.GetZ(),
+                    m[2][0] * v.GetX() + m[2][1] * v.GetY() + m[2][2] * v.GetZ());
+}
+
+Vector3D Transform::Normal(const Vector3D& n) const
+{
+    return Vector3D(inv[0][0] * n.GetX() + inv[1][0] * n.GetY() + inv[2][0] * n.GetZ(),
+                    inv[0][1] * n.GetX() + inv[1][1] * n.GetY() + inv[2][1] * n.GetZ(),
+                    inv[0][2] * n.GetX() + inv[1][2] * n.GetY() + inv[2][2] * n.GetZ());
+}
+
+Box Transform::Apply(const Box& box) const
+{
+    const Vector3D& lo = box.GetExtent(BE_MIN_EXTENT);
+    const Vector3D& hi = box.GetExtent(BE_MAX_EXTENT);
+
+    Vector3D min_extent = Point(lo), max_extent = min_extent;
+    for (int corner = 1; corner < 8; corner++) {
+        Vector3D p = Point(Vector3D(corner & 1 ? hi.GetX() : lo.GetX(),
+                                    corner & 2 ? hi.GetY() : lo.GetY(),
+                                    corner & 4 ? hi.GetZ() : lo.GetZ()));
+        min_extent = Vector3D::MinCombination(min_extent, p);
+        max_extent = Vector3D::MaxCombination(max_extent, p);
+    }
+
+    return Box(min_extent, max_extent);
+}
@@ -0,0 +1,45 @@
+#ifndef TRANSFORM_HPP_
+#define TRANSFORM_HPP_
+
+#include "box.hpp"
+#include "scene_parser.hpp"
+#include "vector.hpp"
+
+/* An affine transformation, stored as the upper 3x4 part of a 4x4
+ * matrix along with its inverse so both directions stay cheap.
+ */
+class Transform {
+public:
+    /* Identity */
+    Transform();
+
+    /* Translation x y z, rotations about x, y and z in degrees, and a
+       uniform scale, read from sc starting at start_val. Scaling is
+       applied first and translation last. */
+    Transform(const SceneComponent* sc, int start_val = 0);
+
+    static Transform Translate(const Vector3D& offset);
+    static Transform Scale(double factor);
+    static Transform Rotate(int axis, double degrees);
+
+    /* Apply t first, then this */
+    Transform operator* (const Transform& t) const;
+
+    Transform Inverse() const;
+
+    Vector3D Point(const Vector3D& p) const;
+    Vector3D Vector(const Vector3D& v) const;
+
+    /* Normals transform by the inverse transpose; the result is not
+       normalized */
+    Vector3D Normal(const Vector3D& n) const;
+
+    /* Axis-aligned box around the transformed box */
+    Box Apply(const Box& box) const;
+
+private:
+    double m[3][4];
+    double inv[3][4];
+};
+
+#endif
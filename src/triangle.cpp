@@ -1,3 +1,6 @@
+#include <cmath>
+
+#include "helper.hpp"
 #include "intersection.hpp"
 #include "ray.hpp"
 #include "triangle.hpp"
@@ -17,41 +20,41 @@ Triangle::~Triangle()
 {
 }
 
-/* Möller-Trumbore algorithm implementation from
-   https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection */
-SceneObjectIntersection Triangle::Intersects(const Ray3D &ray, double max_dist) const
+bool Triangle::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
 {
-    /* Initial test... are we even facing the triangle? */
-    SceneObjectIntersection plane_intersect = Plane::Intersects(ray, max_dist);
-    if (!plane_intersect.intersected) {
-        return plane_intersect;
+    if (!hit_triangle(TriangleRay(ray), this->verts[0], this->verts[1], this->verts[2],
+                      max_dist, hit.dist, hit.u, hit.v)) {
+        return false;
     }
 
-    /* we are facing the plane containing this triangle. Figure out if
-       we are interecting the triangle, or just the plane. */
-
-    Vector3D v0v1 = this->verts[0].To(this->verts[1]),
-        v0v2 = this->verts[0].To(this->verts[2]),
-        p = ray.GetDir().Cross(v0v2);
+    hit.part = this;
+    return true;
+}
 
-    /* compute barycentric coords */
-    Vector3D v0_to_origin = this->verts[0].To(ray.GetOrigin());
-    double inverse_det = 1 / v0v1.Dot(p),
-        u = v0_to_origin.Dot(p) * inverse_det;
+SceneObjectIntersection Triangle::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    return SceneObjectIntersection(this,
+                                   true,
+                                   ray,
+                                   INC_INWARD,
+                                   ray.Point(hit.dist),
+                                   this->normal);
+}
 
-    if (u > 1 || u < 0) {
+SceneObjectIntersection Triangle::Intersects(const Ray3D &ray, double max_dist) const
+{
+    PrimHit hit;
+    if (!this->Hit(ray, max_dist, hit)) {
         return SceneObjectIntersection(this, false, ray);
     }
 
-    double v = ray.GetDir().Dot(v0_to_origin.Cross(v0v1)) * inverse_det;
-
-    if (v < 0 || u + v > 1) {
-        return SceneObjectIntersection(this, false, ray);
-    }
+    return this->Finalize(ray, hit);
+}
 
-    /* We successfully intersected the triangle! Since we already
-       computed the intersection point and normal, return those. */
-    return plane_intersect;
+bool Triangle::Occludes(const Ray3D& ray, double max_dist) const
+{
+    PrimHit hit;
+    return this->Hit(ray, max_dist, hit);
 }
 
 Box Triangle::GetBoundingBox() const
@@ -65,3 +68,44 @@ Box Triangle::GetBoundingBox() const
 
     return Box(min_extent, max_extent);
 }
+
+void Triangle::SplitBounds(int axis, double pos, Bounds& below, Bounds& above) const
+{
+    split_triangle_bounds(verts[0], verts[1], verts[2], axis, pos, below, above);
+}
+
+void split_triangle_bounds(const Vector3D& p0, const Vector3D& p1, const Vector3D& p2,
+                           int axis, double pos, Bounds& below, Bounds& above)
+{
+    const Vector3D* verts[3] = {&p0, &p1, &p2};
+    below = above = Bounds();
+
+    /* Walk the edges, sending each vertex to its side of the plane and
+       each crossing point to both */
+    for (int i = 0; i < 3; i++) {
+        double v[N_AXES], w[N_AXES];
+        for (int a = AXIS_X; a < N_AXES; a++) {
+            v[a] = verts[i]->GetValue(a);
+            w[a] = verts[(i + 1) % 3]->GetValue(a);
+        }
+
+        if (v[axis] <= pos) {
+            below.Expand(v);
+        }
+        if (v[axis] >= pos) {
+            above.Expand(v);
+        }
+
+        if ((v[axis] < pos && w[axis] > pos) || (v[axis] > pos && w[axis] < pos)) {
+            double t = (pos - v[axis]) / (w[axis] - v[axis]), cross[N_AXES];
+            for (int a = AXIS_X; a < N_AXES; a++) {
+                cross[a] = v[a] + t * (w[a] - v[a]);
+            }
+
+            /* Lerping may be off by an ulp; the point is on the plane */
+            cross[axis] = pos;
+            below.Expand(cross);
+            above.Expand(cross);
+        }
+    }
+}
@@ -1,10 +1,117 @@
 #ifndef TRIANGLE_HPP_
 #define TRIANGLE_HPP_
 
+#include <cmath>
+
+#include "bounds.hpp"
+#include "helper.hpp"
 #include "intersection.hpp"
 #include "plane.hpp"
+#include "ray.hpp"
 #include "vector.hpp"
 
+/* A ray set up for the watertight triangle test: its origin and
+   direction, and its dominant axis kz, so that many triangles can be
+   tested against it without working these out again */
+struct TriangleRay {
+    TriangleRay() {}
+    TriangleRay(const Ray3D& ray);
+
+    double o[N_AXES], d[N_AXES];
+    int kx, ky, kz;
+};
+
+inline TriangleRay::TriangleRay(const Ray3D& ray)
+{
+    Vector3D origin = ray.GetOrigin(), dir = ray.GetDir();
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        o[axis] = origin.GetValue(axis);
+        d[axis] = dir.GetValue(axis);
+    }
+
+    kz = AXIS_X;
+    if (std::abs(d[AXIS_Y]) > std::abs(d[kz])) {
+        kz = AXIS_Y;
+    }
+    if (std::abs(d[AXIS_Z]) > std::abs(d[kz])) {
+        kz = AXIS_Z;
+    }
+    kx = (kz + 1) % N_AXES;
+    ky = (kx + 1) % N_AXES;
+}
+
+/* A vertex's coordinate along axis, whether the vertex is a Vector3D
+   or an array of N_AXES doubles */
+inline double vertex_coord(const Vector3D& v, int axis)
+{
+    return v.GetValue(axis);
+}
+
+inline double vertex_coord(const double* v, int axis)
+{
+    return v[axis];
+}
+
+/* Watertight test (Woop, Benthin and Wald 2013) of the ray against the
+   triangle a, b, c: rays through a shared edge or vertex hit at least
+   one of the triangles sharing it. On a hit between EPSILON and
+   max_dist, sets t, and the barycentric coordinates u of b and v of c. */
+template <class Vertex>
+inline bool hit_triangle(const TriangleRay& ray,
+                         const Vertex& a, const Vertex& b, const Vertex& c,
+                         double max_dist, double& t, double& u, double& v)
+{
+    int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+    const Vertex* verts[3] = {&a, &b, &c};
+
+    /* Woop et al. shear the vertices so the ray runs down kz, dividing
+       by its kz component; scaling everything by that component
+       instead leaves the signs of the edge functions alone (they only
+       grow by its square) and saves the division. It stays watertight:
+       every triangle sharing a vertex still transforms it the same way,
+       so triangles sharing an edge compute the same edge function, with
+       opposite signs. */
+    double x[3], y[3], z[3];
+    for (int i = 0; i < 3; i++) {
+        double rx = vertex_coord(*verts[i], kx) - ray.o[kx],
+            ry = vertex_coord(*verts[i], ky) - ray.o[ky],
+            rz = vertex_coord(*verts[i], kz) - ray.o[kz];
+        x[i] = rx * ray.d[kz] - ray.d[kx] * rz;
+        y[i] = ry * ray.d[kz] - ray.d[ky] * rz;
+        z[i] = rz;
+    }
+
+    /* Edge functions: scaled barycentric coordinates of each vertex.
+       The ray misses unless they all share a sign; it doesn't matter
+       which, as triangles are two-sided. */
+    double e0 = x[2] * y[1] - y[2] * x[1],
+        e1 = x[0] * y[2] - y[0] * x[2],
+        e2 = x[1] * y[0] - y[1] * x[0];
+
+    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) {
+        return false;
+    }
+
+    double det = e0 + e1 + e2;
+    if (det == 0) {
+        return false;
+    }
+
+    t = (e0 * z[0] + e1 * z[1] + e2 * z[2]) / (det * ray.d[kz]);
+    if (!(t >= EPSILON && t <= max_dist)) {
+        return false;
+    }
+
+    u = e1 / det;
+    v = e2 / det;
+    return true;
+}
+
+/* Bounds of the parts of the triangle p0, p1, p2 below and above the
+   plane at pos along axis */
+void split_triangle_bounds(const Vector3D& p0, const Vector3D& p1, const Vector3D& p2,
+                           int axis, double pos, Bounds& below, Bounds& above);
+
 class Triangle : public Plane {
 public:
     Triangle(const Vector3D& vert1, const Vector3D& vert2, const Vector3D& vert3,
@@ -13,8 +120,24 @@ public:
 
     virtual Box GetBoundingBox() const override;
 
+    /* Clips the triangle itself, so slivers split into tight pieces */
+    virtual void SplitBounds(int axis, double pos,
+                             Bounds& below, Bounds& above) const override;
+
     virtual SceneObjectIntersection Intersects(const Ray3D& ray, double max_dist) const override;
 
+    /* Watertight, see hit_triangle(). Hits report the barycentric
+       coordinates of verts[1] and verts[2] as u and v. */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
+    virtual bool Occludes(const Ray3D& ray, double max_dist) const override;
+
+    inline const Vector3D& GetVertex(int k) const {
+        return verts[k];
+    }
+
 protected:
     Vector3D verts[3];
 };
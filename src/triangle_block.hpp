@@ -0,0 +1,206 @@
+#ifndef TRIANGLE_BLOCK_HPP_
+#define TRIANGLE_BLOCK_HPP_
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <stdint.h>
+
+#include "bounds.hpp"
+#include "helper.hpp"
+#include "triangle.hpp"
+#include "vector.hpp"
+
+/* Triangles in a TriangleBlock */
+const int TRIANGLE_BLOCK_SIZE = 4;
+
+/* The vertices of four triangles, coordinate by coordinate, so that one
+   ray is tested against all of them with vector instructions. verts
+   [k][axis][lane] is the axis coordinate of vertex k of the lane's
+   triangle. */
+struct TriangleBlock {
+    double verts[3][N_AXES][TRIANGLE_BLOCK_SIZE];
+};
+
+/* A TriangleBlock of a compressed mesh, its coordinates quantized to
+   lo[axis] + verts[k][axis][lane] * step[axis], a quarter of the size */
+struct QuantizedTriangleBlock {
+    uint16_t verts[3][N_AXES][TRIANGLE_BLOCK_SIZE];
+};
+
+/* Decode a quantized block. The steps must be powers of two and lo a
+   multiple of them, so every coordinate is exact, and comes out the
+   same however it is computed. */
+inline void dequantize_block(const QuantizedTriangleBlock& quantized,
+                             const double lo[N_AXES], const double step[N_AXES],
+                             TriangleBlock& block)
+{
+    for (int k = 0; k < 3; k++) {
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            const uint16_t* q = quantized.verts[k][axis];
+#if defined(__AVX__)
+            __m256d coords = _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(
+                _mm_loadl_epi64((const __m128i*) q)));
+            _mm256_storeu_pd(block.verts[k][axis], _mm256_add_pd(
+                _mm256_set1_pd(lo[axis]), _mm256_mul_pd(coords, _mm256_set1_pd(step[axis]))));
+#else
+            for (int i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+                block.verts[k][axis][i] = lo[axis] + q[i] * step[axis];
+            }
+#endif
+        }
+    }
+}
+
+/* Bit mask of the first n lanes of a block, or all of them */
+inline int block_lanes(uint32_t n)
+{
+    return n >= TRIANGLE_BLOCK_SIZE ? (1 << TRIANGLE_BLOCK_SIZE) - 1 : (1 << n) - 1;
+}
+
+#if defined(__AVX__)
+/* hit_triangle() for all four lanes of a block. Returns a bit mask of
+   the lanes in lanes that were hit, and sets their t, u and v. */
+inline int hit_triangle4(const TriangleRay& ray, const TriangleBlock& block,
+                         int lanes, double max_dist,
+                         double* t, double* u, double* v)
+{
+    int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+    __m256d o_x = _mm256_set1_pd(ray.o[kx]), o_y = _mm256_set1_pd(ray.o[ky]),
+        o_z = _mm256_set1_pd(ray.o[kz]), d_x = _mm256_set1_pd(ray.d[kx]),
+        d_y = _mm256_set1_pd(ray.d[ky]), d_z = _mm256_set1_pd(ray.d[kz]);
+
+    /* The same operations as hit_triangle(), in the same order, so a
+       triangle is hit or missed the same way in any lane */
+    __m256d x[3], y[3], z[3];
+    for (int i = 0; i < 3; i++) {
+        __m256d rx = _mm256_sub_pd(_mm256_loadu_pd(block.verts[i][kx]), o_x),
+            ry = _mm256_sub_pd(_mm256_loadu_pd(block.verts[i][ky]), o_y),
+            rz = _mm256_sub_pd(_mm256_loadu_pd(block.verts[i][kz]), o_z);
+        x[i] = _mm256_sub_pd(_mm256_mul_pd(rx, d_z), _mm256_mul_pd(d_x, rz));
+        y[i] = _mm256_sub_pd(_mm256_mul_pd(ry, d_z), _mm256_mul_pd(d_y, rz));
+        z[i] = rz;
+    }
+
+    __m256d e0 = _mm256_sub_pd(_mm256_mul_pd(x[2], y[1]), _mm256_mul_pd(y[2], x[1])),
+        e1 = _mm256_sub_pd(_mm256_mul_pd(x[0], y[2]), _mm256_mul_pd(y[0], x[2])),
+        e2 = _mm256_sub_pd(_mm256_mul_pd(x[1], y[0]), _mm256_mul_pd(y[1], x[0]));
+
+    __m256d zero = _mm256_setzero_pd();
+    __m256d neg = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(e0, zero, _CMP_LT_OQ),
+                                            _mm256_cmp_pd(e1, zero, _CMP_LT_OQ)),
+                               _mm256_cmp_pd(e2, zero, _CMP_LT_OQ));
+    __m256d pos = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(e0, zero, _CMP_GT_OQ),
+                                            _mm256_cmp_pd(e1, zero, _CMP_GT_OQ)),
+                               _mm256_cmp_pd(e2, zero, _CMP_GT_OQ));
+
+    __m256d det = _mm256_add_pd(_mm256_add_pd(e0, e1), e2);
+    __m256d miss = _mm256_or_pd(_mm256_and_pd(neg, pos), _mm256_cmp_pd(det, zero, _CMP_EQ_OQ));
+
+    __m256d t_num = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e0, z[0]), _mm256_mul_pd(e1, z[1])),
+                                  _mm256_mul_pd(e2, z[2]));
+    __m256d t_hit = _mm256_div_pd(t_num, _mm256_mul_pd(det, d_z));
+    __m256d in_range = _mm256_and_pd(_mm256_cmp_pd(t_hit, _mm256_set1_pd(EPSILON), _CMP_GE_OQ),
+                                     _mm256_cmp_pd(t_hit, _mm256_set1_pd(max_dist), _CMP_LE_OQ));
+
+    int mask = _mm256_movemask_pd(_mm256_andnot_pd(miss, in_range)) & lanes;
+    if (mask) {
+        _mm256_storeu_pd(t, t_hit);
+        _mm256_storeu_pd(u, _mm256_div_pd(e1, det));
+        _mm256_storeu_pd(v, _mm256_div_pd(e2, det));
+    }
+    return mask;
+}
+#elif defined(__SSE2__)
+/* hit_triangle() for lanes base and base + 1 of a block, as a two bit
+   mask */
+inline int hit_triangle2(const TriangleRay& ray, const TriangleBlock& block,
+                         int base, double max_dist,
+                         double* t, double* u, double* v)
+{
+    int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+    __m128d o_x = _mm_set1_pd(ray.o[kx]), o_y = _mm_set1_pd(ray.o[ky]),
+        o_z = _mm_set1_pd(ray.o[kz]), d_x = _mm_set1_pd(ray.d[kx]),
+        d_y = _mm_set1_pd(ray.d[ky]), d_z = _mm_set1_pd(ray.d[kz]);
+
+    __m128d x[3], y[3], z[3];
+    for (int i = 0; i < 3; i++) {
+        __m128d rx = _mm_sub_pd(_mm_loadu_pd(block.verts[i][kx] + base), o_x),
+            ry = _mm_sub_pd(_mm_loadu_pd(block.verts[i][ky] + base), o_y),
+            rz = _mm_sub_pd(_mm_loadu_pd(block.verts[i][kz] + base), o_z);
+        x[i] = _mm_sub_pd(_mm_mul_pd(rx, d_z), _mm_mul_pd(d_x, rz));
+        y[i] = _mm_sub_pd(_mm_mul_pd(ry, d_z), _mm_mul_pd(d_y, rz));
+        z[i] = rz;
+    }
+
+    __m128d e0 = _mm_sub_pd(_mm_mul_pd(x[2], y[1]), _mm_mul_pd(y[2], x[1])),
+        e1 = _mm_sub_pd(_mm_mul_pd(x[0], y[2]), _mm_mul_pd(y[0], x[2])),
+        e2 = _mm_sub_pd(_mm_mul_pd(x[1], y[0]), _mm_mul_pd(y[1], x[0]));
+
+    __m128d zero = _mm_setzero_pd();
+    __m128d neg = _mm_or_pd(_mm_or_pd(_mm_cmplt_pd(e0, zero), _mm_cmplt_pd(e1, zero)),
+                            _mm_cmplt_pd(e2, zero));
+    __m128d pos = _mm_or_pd(_mm_or_pd(_mm_cmpgt_pd(e0, zero), _mm_cmpgt_pd(e1, zero)),
+                            _mm_cmpgt_pd(e2, zero));
+
+    __m128d det = _mm_add_pd(_mm_add_pd(e0, e1), e2);
+    __m128d miss = _mm_or_pd(_mm_and_pd(neg, pos), _mm_cmpeq_pd(det, zero));
+
+    __m128d t_num = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e0, z[0]), _mm_mul_pd(e1, z[1])),
+                               _mm_mul_pd(e2, z[2]));
+    __m128d t_hit = _mm_div_pd(t_num, _mm_mul_pd(det, d_z));
+    __m128d in_range = _mm_and_pd(_mm_cmpge_pd(t_hit, _mm_set1_pd(EPSILON)),
+                                  _mm_cmple_pd(t_hit, _mm_set1_pd(max_dist)));
+
+    int mask = _mm_movemask_pd(_mm_andnot_pd(miss, in_range));
+    if (mask) {
+        _mm_storeu_pd(t + base, t_hit);
+        _mm_storeu_pd(u + base, _mm_div_pd(e1, det));
+        _mm_storeu_pd(v + base, _mm_div_pd(e2, det));
+    }
+    return mask;
+}
+
+/* hit_triangle() for all four lanes of a block, as two pairs */
+inline int hit_triangle4(const TriangleRay& ray, const TriangleBlock& block,
+                         int lanes, double max_dist,
+                         double* t, double* u, double* v)
+{
+    int mask = 0;
+    if (lanes & 0x3) {
+        mask |= hit_triangle2(ray, block, 0, max_dist, t, u, v);
+    }
+    if (lanes & 0xc) {
+        mask |= hit_triangle2(ray, block, 2, max_dist, t, u, v) << 2;
+    }
+    return mask & lanes;
+}
+#else
+/* hit_triangle() for each of the lanes in lanes */
+inline int hit_triangle4(const TriangleRay& ray, const TriangleBlock& block,
+                         int lanes, double max_dist,
+                         double* t, double* u, double* v)
+{
+    int mask = 0;
+
+    for (int i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+        if (!(lanes & (1 << i))) {
+            continue;
+        }
+
+        Vector3D p[3];
+        for (int k = 0; k < 3; k++) {
+            p[k] = Vector3D(block.verts[k][AXIS_X][i], block.verts[k][AXIS_Y][i],
+                            block.verts[k][AXIS_Z][i]);
+        }
+        if (hit_triangle(ray, p[0], p[1], p[2], max_dist, t[i], u[i], v[i])) {
+            mask |= 1 << i;
+        }
+    }
+
+    return mask;
+}
+#endif
+
+#endif
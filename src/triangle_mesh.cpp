@@ -0,0 +1,447 @@
+#include <cassert>
+#include <cmath>
+
+#include "bounds.hpp"
+#include "bvh.hpp"
+#include "bvh_traversal.hpp"
+#include "intersection.hpp"
+#include "oct_normal.hpp"
+#include "triangle.hpp"
+#include "triangle_block.hpp"
+#include "triangle_mesh.hpp"
+
+/* A mesh's triangles seen as indexed primitives for the BVH builders */
+class MeshTriangles : public BVHPrimitives {
+public:
+    MeshTriangles(const TriangleMesh& mesh) : mesh(mesh) {}
+
+    size_t Size() const {
+        return mesh.Size();
+    }
+
+    Bounds GetBounds(uint32_t i) const {
+        Bounds bounds;
+        for (int k = 0; k < 3; k++) {
+            double pt[N_AXES];
+            for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                pt[axis] = mesh.Vertex(i, k).GetValue(axis);
+            }
+            bounds.Expand(pt);
+        }
+        return bounds;
+    }
+
+    void SplitBounds(uint32_t i, int axis, double pos,
+                     Bounds& below, Bounds& above) const {
+        split_triangle_bounds(mesh.Vertex(i, 0), mesh.Vertex(i, 1), mesh.Vertex(i, 2),
+                              axis, pos, below, above);
+    }
+
+private:
+    const TriangleMesh& mesh;
+};
+
+TriangleMesh::TriangleMesh(const std::shared_ptr<const VertexPool>& verts,
+                           const std::shared_ptr<const VertexPool>& norms) :
+    SceneObject(Vector3D(), DEFAULT_MAT),
+    verts(verts),
+    norms(norms),
+    n_tris(0),
+    bounds(),
+    bvh(nullptr),
+    compressed(false),
+    grid_lo(),
+    grid_step()
+{
+}
+
+TriangleMesh::~TriangleMesh()
+{
+    delete this->bvh;
+
+    for (auto part : this->parts) {
+        delete part;
+    }
+}
+
+void TriangleMesh::SetMaterial(const Material& mat)
+{
+    this->parts.push_back(new ObjectPart(this, mat));
+}
+
+void TriangleMesh::AddTriangle(uint32_t a, uint32_t b, uint32_t c)
+{
+    if (!this->norm_indices.empty()) {
+        this->norm_indices.insert(this->norm_indices.end(), 3, (uint32_t) NO_NORMAL);
+    }
+    AddVertices(a, b, c);
+}
+
+void TriangleMesh::AddTriangle(uint32_t a, uint32_t b, uint32_t c,
+                               uint32_t na, uint32_t nb, uint32_t nc)
+{
+    assert(na < norms->size() && nb < norms->size() && nc < norms->size());
+
+    /* Only now do the triangles added so far need entries */
+    if (this->norm_indices.empty()) {
+        this->norm_indices.assign(3 * this->Size(), (uint32_t) NO_NORMAL);
+    }
+
+    this->norm_indices.push_back(na);
+    this->norm_indices.push_back(nb);
+    this->norm_indices.push_back(nc);
+    AddVertices(a, b, c);
+}
+
+void TriangleMesh::AddVertices(uint32_t a, uint32_t b, uint32_t c)
+{
+    assert(!this->bvh && !this->parts.empty());
+    assert(a < verts->size() && b < verts->size() && c < verts->size());
+
+    uint32_t tri = this->n_tris++;
+    this->vert_indices.push_back(a);
+    this->vert_indices.push_back(b);
+    this->vert_indices.push_back(c);
+    this->mat_ids.push_back(this->parts.size() - 1);
+
+    /* The mean builder places the mesh at the center of its bounds */
+    this->bounds.Expand(MeshTriangles(*this).GetBounds(tri));
+    this->pos = Vector3D(this->bounds.Center(AXIS_X),
+                         this->bounds.Center(AXIS_Y),
+                         this->bounds.Center(AXIS_Z));
+}
+
+bool TriangleMesh::Compress()
+{
+    assert(!this->bvh && !this->compressed && this->Size() > 0);
+
+    double edges = 0;
+    for (uint32_t tri = 0; tri < this->n_tris; tri++) {
+        for (int k = 0; k < 3; k++) {
+            edges += Vertex(tri, k).To(Vertex(tri, (k + 1) % 3)).Norm();
+        }
+    }
+    double max_step = edges / (3 * this->n_tris) / MIN_STEPS_PER_EDGE;
+
+    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+        double lo = this->bounds.lo[axis], hi = this->bounds.hi[axis];
+
+        /* The smallest power of two that spans the bounds in 16 bits,
+           but not so far below lo's precision that lo + 65535 steps
+           can't be told apart from lo */
+        double step = std::max((hi - lo) / 65535,
+                               std::max(std::fabs(lo), std::fabs(hi)) * std::ldexp(1.0, -36));
+        if (!(step > 0)) {
+            /* Flat at 0, so any step will do */
+            step = max_step > 0 ? max_step : 1;
+        }
+        double pow2 = std::ldexp(1.0, std::ilogb(step));
+        if (pow2 < step) {
+            pow2 *= 2;
+        }
+
+        /* Starting the grid below lo may take one more doubling */
+        double grid = std::floor(lo / pow2) * pow2;
+        while ((hi - grid) / pow2 > 65535) {
+            pow2 *= 2;
+            grid = std::floor(lo / pow2) * pow2;
+        }
+
+        /* A few huge triangles, say a ground, would leave the rest
+           with too few grid points to keep their shape */
+        if (pow2 > max_step) {
+            return false;
+        }
+
+        this->grid_lo[axis] = grid;
+        this->grid_step[axis] = pow2;
+    }
+    this->compressed = true;
+
+    /* Snapping may move a vertex out of the bounds by half a step */
+    MeshTriangles tris(*this);
+    this->bounds = Bounds();
+    for (uint32_t tri = 0; tri < this->n_tris; tri++) {
+        this->bounds.Expand(tris.GetBounds(tri));
+    }
+    this->pos = Vector3D(this->bounds.Center(AXIS_X),
+                         this->bounds.Center(AXIS_Y),
+                         this->bounds.Center(AXIS_Z));
+    return true;
+}
+
+void TriangleMesh::Build(const BVHOptions& options)
+{
+    if (!this->bvh) {
+        /* Leaves are tested a block at a time, so the builder may as
+           well fill the blocks */
+        BVHOptions block_options = options;
+        block_options.leaf_block = TRIANGLE_BLOCK_SIZE;
+
+        this->bvh = new BVH(MeshTriangles(*this), block_options);
+        PackBlocks();
+    }
+}
+
+void TriangleMesh::SetBVH(BVH* bvh)
+{
+    if (this->compressed && this->bvh) {
+        delete bvh;
+        return;
+    }
+
+    delete this->bvh;
+    this->bvh = bvh;
+    PackBlocks();
+}
+
+bool TriangleMesh::UpdateBVH(const BVHOptions& options)
+{
+    assert(this->bvh && !this->compressed);
+
+    MeshTriangles tris(*this);
+    this->bounds = Bounds();
+    for (uint32_t tri = 0; tri < this->n_tris; tri++) {
+        this->bounds.Expand(tris.GetBounds(tri));
+    }
+    this->pos = Vector3D(this->bounds.Center(AXIS_X),
+                         this->bounds.Center(AXIS_Y),
+                         this->bounds.Center(AXIS_Z));
+
+    this->bvh->Refit(tris, options.n_threads);
+    if (this->bvh->NeedsRebuild()) {
+        delete this->bvh;
+        this->bvh = nullptr;
+        Build(options);
+        return true;
+    }
+
+    /* The blocks hold copies of the vertices */
+    PackBlocks();
+    return false;
+}
+
+void TriangleMesh::PackBlocks()
+{
+    const BVHNodeArray& nodes = this->bvh->GetNodes();
+    const std::vector<uint32_t>& tris = this->bvh->GetIndices();
+
+    /* Each leaf starts a block of its own, so none straddles two, and
+       the leaves' blocks follow the nodes' order in memory */
+    size_t n_blocks = 0;
+    for (auto& node : nodes) {
+        n_blocks += (node.count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+    }
+
+    /* Lanes past a leaf's last triangle are never tested */
+    if (!this->compressed) {
+        this->blocks.assign(n_blocks, TriangleBlock());
+        this->blocks.shrink_to_fit();
+    } else {
+        this->quantized_blocks.assign(n_blocks, QuantizedTriangleBlock());
+        this->quantized_blocks.shrink_to_fit();
+        if (!this->norm_indices.empty()) {
+            this->slot_normals.assign(3 * TRIANGLE_BLOCK_SIZE * n_blocks, NO_OCT_NORMAL);
+            this->slot_normals.shrink_to_fit();
+        }
+        if (this->parts.size() > 1) {
+            this->slot_mats.assign(TRIANGLE_BLOCK_SIZE * n_blocks, 0);
+            this->slot_mats.shrink_to_fit();
+        }
+    }
+    this->leaf_blocks.assign(tris.size(), 0);
+    this->leaf_blocks.shrink_to_fit();
+
+    uint32_t block = 0;
+    for (auto& node : nodes) {
+        if (!node.IsLeaf()) {
+            continue;
+        }
+
+        this->leaf_blocks[node.offset] = block;
+        for (uint32_t i = 0; i < node.count; i++) {
+            uint32_t tri = tris[node.offset + i];
+            uint32_t dest = block + i / TRIANGLE_BLOCK_SIZE;
+            int lane = i % TRIANGLE_BLOCK_SIZE;
+
+            if (!this->compressed) {
+                for (int k = 0; k < 3; k++) {
+                    const Vector3D& vert = Vertex(tri, k);
+                    for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                        this->blocks[dest].verts[k][axis][lane] = vert.GetValue(axis);
+                    }
+                }
+                continue;
+            }
+
+            uint32_t slot = TRIANGLE_BLOCK_SIZE * dest + lane;
+            for (int k = 0; k < 3; k++) {
+                const Vector3D& vert = (*verts)[this->vert_indices[3 * tri + k]];
+                for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                    this->quantized_blocks[dest].verts[k][axis][lane] = Quantize(vert, axis);
+                }
+            }
+            if (!this->slot_normals.empty() && this->norm_indices[3 * tri] != NO_NORMAL) {
+                for (int k = 0; k < 3; k++) {
+                    this->slot_normals[3 * slot + k] =
+                        oct_encode((*norms)[this->norm_indices[3 * tri + k]]);
+                }
+            }
+            if (!this->slot_mats.empty()) {
+                this->slot_mats[slot] = this->mat_ids[tri];
+            }
+        }
+        block += (node.count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+    }
+
+    /* Everything a compressed mesh needs is in its slots now, and the
+       shared buffers go once no mesh refers to them */
+    if (this->compressed) {
+        this->verts.reset();
+        this->norms.reset();
+        std::vector<uint32_t>().swap(this->vert_indices);
+        std::vector<uint32_t>().swap(this->norm_indices);
+        std::vector<uint32_t>().swap(this->mat_ids);
+    }
+}
+
+bool TriangleMesh::Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const
+{
+    assert(this->bvh);
+
+    TriangleRay tri_ray(ray);
+    const std::vector<uint32_t>& tris = this->bvh->GetIndices();
+    hit.dist = INFINITY;
+
+    bool found = this->bvh->TraverseClosest(0, ray, max_dist, [&](uint32_t first, uint32_t count,
+                                                                  double& max_dist) {
+            bool found = false;
+            uint32_t block = this->leaf_blocks[first];
+            TriangleBlock scratch;
+
+            for (uint32_t base = first; base < first + count;
+                 base += TRIANGLE_BLOCK_SIZE, block++) {
+                double t[TRIANGLE_BLOCK_SIZE], u[TRIANGLE_BLOCK_SIZE], v[TRIANGLE_BLOCK_SIZE];
+                int mask = hit_triangle4(tri_ray, GetBlock(block, scratch),
+                                         block_lanes(first + count - base),
+                                         max_dist, t, u, v);
+
+                /* All lanes were tested against the same max_dist, so
+                   a later one may still be further than an earlier */
+                for (int i = 0; i < TRIANGLE_BLOCK_SIZE; i++) {
+                    if (!(mask & (1 << i)) || !(t[i] < hit.dist)) {
+                        continue;
+                    }
+
+                    hit.dist = t[i];
+                    hit.u = u[i];
+                    hit.v = v[i];
+                    hit.index = this->compressed ? TRIANGLE_BLOCK_SIZE * block + i
+                                                 : tris[base + i];
+                    max_dist = t[i];
+                    found = true;
+                }
+            }
+            return found;
+        });
+
+    hit.part = this;
+    return found;
+}
+
+SceneObjectIntersection TriangleMesh::Finalize(const Ray3D& ray, const PrimHit& hit) const
+{
+    if (this->compressed) {
+        return FinalizeCompressed(ray, hit);
+    }
+
+    uint32_t tri = hit.index;
+    Vector3D normal;
+
+    if (!this->norm_indices.empty() && this->norm_indices[3 * tri] != NO_NORMAL) {
+        /* The same weights as NormalTriangle */
+        const uint32_t* n = &this->norm_indices[3 * tri];
+        normal = (*norms)[n[0]] * (1 - hit.u - hit.v)
+            + (*norms)[n[1]] * hit.u
+            + (*norms)[n[2]] * hit.v;
+    } else {
+        /* The same side as Triangle's */
+        const Vector3D& a = Vertex(tri, 0);
+        normal = a.To(Vertex(tri, 2)).Cross(a.To(Vertex(tri, 1)));
+    }
+
+    return SceneObjectIntersection(this->parts[this->mat_ids[tri]],
+                                   true,
+                                   ray,
+                                   INC_INWARD,
+                                   ray.Point(hit.dist),
+                                   normal);
+}
+
+SceneObjectIntersection TriangleMesh::FinalizeCompressed(const Ray3D& ray,
+                                                        const PrimHit& hit) const
+{
+    uint32_t slot = hit.index;
+    Vector3D normal;
+
+    if (!this->slot_normals.empty() && this->slot_normals[3 * slot] != NO_OCT_NORMAL) {
+        const uint32_t* n = &this->slot_normals[3 * slot];
+        normal = oct_decode(n[0]) * (1 - hit.u - hit.v)
+            + oct_decode(n[1]) * hit.u
+            + oct_decode(n[2]) * hit.v;
+    } else {
+        const QuantizedTriangleBlock& block = this->quantized_blocks[slot / TRIANGLE_BLOCK_SIZE];
+        int lane = slot % TRIANGLE_BLOCK_SIZE;
+
+        double p[3][N_AXES];
+        for (int k = 0; k < 3; k++) {
+            for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                p[k][axis] = this->grid_lo[axis] + block.verts[k][axis][lane] * this->grid_step[axis];
+            }
+        }
+        Vector3D a(p[0][AXIS_X], p[0][AXIS_Y], p[0][AXIS_Z]);
+        normal = a.To(Vector3D(p[2][AXIS_X], p[2][AXIS_Y], p[2][AXIS_Z]))
+            .Cross(a.To(Vector3D(p[1][AXIS_X], p[1][AXIS_Y], p[1][AXIS_Z])));
+    }
+
+    uint32_t mat = this->slot_mats.empty() ? 0 : this->slot_mats[slot];
+    return SceneObjectIntersection(this->parts[mat],
+                                   true,
+                                   ray,
+                                   INC_INWARD,
+                                   ray.Point(hit.dist),
+                                   normal);
+}
+
+SceneObjectIntersection TriangleMesh::Intersects(const Ray3D& ray, double max_dist) const
+{
+    return this->HitThenFinalize(ray, max_dist);
+}
+
+bool TriangleMesh::Occludes(const Ray3D& ray, double max_dist) const
+{
+    assert(this->bvh);
+
+    TriangleRay tri_ray(ray);
+
+    return this->bvh->TraverseAny(ray, max_dist, [&](uint32_t first, uint32_t count) {
+            uint32_t block = this->leaf_blocks[first];
+            TriangleBlock scratch;
+
+            for (uint32_t base = first; base < first + count;
+                 base += TRIANGLE_BLOCK_SIZE, block++) {
+                double t[TRIANGLE_BLOCK_SIZE], u[TRIANGLE_BLOCK_SIZE], v[TRIANGLE_BLOCK_SIZE];
+                if (hit_triangle4(tri_ray, GetBlock(block, scratch),
+                                  block_lanes(first + count - base),
+                                  max_dist, t, u, v)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+}
+
+Box TriangleMesh::GetBoundingBox() const
+{
+    return this->bounds.ToBox();
+}
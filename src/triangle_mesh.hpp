@@ -0,0 +1,188 @@
+#ifndef TRIANGLE_MESH_HPP_
+#define TRIANGLE_MESH_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+#include "bounds.hpp"
+#include "box.hpp"
+#include "bvh.hpp"
+#include "intersection.hpp"
+#include "object_part.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+#include "triangle_block.hpp"
+#include "vector.hpp"
+
+typedef std::vector<Vector3D> VertexPool;
+
+/* Many triangles as a single object. A triangle is three indices into
+ * a vertex buffer shared with other meshes, optionally three into a
+ * shared normal buffer, and a material id, so each costs a few words
+ * instead of a whole SceneObject on the heap. The mesh has its own BVH
+ * over (this mesh, triangle index) references, which it traverses with
+ * the same watertight test as Triangle. Once the BVH is known, the
+ * triangles' vertices are also copied into blocks in the order the
+ * leaves refer to them, so a leaf's triangles are read from one place
+ * and tested several at a time.
+ *
+ * For very big meshes, Compress() trades a little precision for about
+ * a quarter of the memory its triangles take. The vertices are snapped
+ * to a 16-bit grid over the mesh's bounds, which the BVH is then built
+ * over, and the blocks keep them in that form, to be decoded as they
+ * are tested. Once packed, the mesh lets go of the shared buffers and
+ * keeps its vertex normals oct-encoded, 32 bits each, by block lane.
+ */
+class TriangleMesh : public SceneObject {
+public:
+    TriangleMesh(const std::shared_ptr<const VertexPool>& verts,
+                 const std::shared_ptr<const VertexPool>& norms);
+    virtual ~TriangleMesh();
+
+    /* Give the triangles added from now on material mat */
+    void SetMaterial(const Material& mat);
+
+    /* Add the triangle between vertices a, b and c, with the vertex
+       normals na, nb and nc if given. SetMaterial() must have been
+       called first. */
+    void AddTriangle(uint32_t a, uint32_t b, uint32_t c);
+    void AddTriangle(uint32_t a, uint32_t b, uint32_t c,
+                     uint32_t na, uint32_t nb, uint32_t nc);
+
+    /* Store the mesh compressed. Only valid once all its triangles
+       are added, and before the BVH is built or set. Returns false,
+       and leaves the mesh as it is, if the grid would be too coarse
+       for its triangles. */
+    bool Compress();
+
+    /* Build the mesh's BVH. Does nothing if it is already built;
+       triangles can't be added afterwards. */
+    void Build(const BVHOptions& options = BVHOptions());
+
+    /* Use a BVH built elsewhere over the triangles, e.g. one read from
+       a cache, instead of building one. The mesh takes ownership. A
+       compressed mesh only has its triangles until they are packed
+       for one BVH, so if it already has one it keeps it and deletes
+       bvh. */
+    void SetBVH(BVH* bvh);
+
+    /* Catch up with vertices moved in the shared buffer since the BVH
+       was built, by refitting it, or rebuilding it once refitting has
+       made it too loose. Returns whether it was rebuilt. Only valid
+       for a built mesh that isn't compressed. */
+    bool UpdateBVH(const BVHOptions& options = BVHOptions());
+
+    inline const BVH* GetBVH() const {
+        return bvh;
+    }
+
+    inline size_t Size() const {
+        return n_tris;
+    }
+
+    /* Vertex k of triangle tri, snapped to the grid if the mesh is
+       compressed. Only valid before a compressed mesh is packed. */
+    inline Vector3D Vertex(uint32_t tri, int k) const {
+        const Vector3D& vert = (*verts)[vert_indices[3 * tri + k]];
+        if (!compressed) {
+            return vert;
+        }
+
+        double pt[N_AXES];
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            pt[axis] = grid_lo[axis] + Quantize(vert, axis) * grid_step[axis];
+        }
+        return Vector3D(pt[AXIS_X], pt[AXIS_Y], pt[AXIS_Z]);
+    }
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    /* hit.index is the triangle that was hit, or for a compressed
+       mesh the block lane it is in, and u and v are the barycentric
+       coordinates of its second and third vertices */
+    virtual bool Hit(const Ray3D& ray, double max_dist, PrimHit& hit) const override;
+    virtual SceneObjectIntersection Finalize(const Ray3D& ray,
+                                             const PrimHit& hit) const override;
+
+    virtual bool Occludes(const Ray3D& ray, double max_dist) const override;
+
+    virtual Box GetBoundingBox() const override;
+
+private:
+    /* norm_indices entry of triangles without vertex normals */
+    static const uint32_t NO_NORMAL = UINT32_MAX;
+
+    /* Compress() wants at least this many grid steps along the mean
+       edge of the mesh's triangles */
+    static constexpr double MIN_STEPS_PER_EDGE = 16;
+
+    /* Append a triangle's vertex indices and grow the bounds */
+    void AddVertices(uint32_t a, uint32_t b, uint32_t c);
+
+    /* Fill blocks and leaf_blocks from the BVH's leaves. A compressed
+       mesh fills quantized_blocks, slot_normals and slot_mats instead,
+       then frees what it was packed from. */
+    void PackBlocks();
+
+    /* Finalize() for a compressed mesh */
+    SceneObjectIntersection FinalizeCompressed(const Ray3D& ray, const PrimHit& hit) const;
+
+    /* The grid coordinate nearest vert's on axis */
+    inline uint16_t Quantize(const Vector3D& vert, int axis) const {
+        double q = std::round((vert.GetValue(axis) - grid_lo[axis]) / grid_step[axis]);
+        return (uint16_t) std::max(0.0, std::min(65535.0, q));
+    }
+
+    /* The vertices of the block, decoded into scratch if compressed */
+    inline const TriangleBlock& GetBlock(uint32_t block, TriangleBlock& scratch) const {
+        if (!compressed) {
+            return blocks[block];
+        }
+
+        dequantize_block(quantized_blocks[block], grid_lo, grid_step, scratch);
+        return scratch;
+    }
+
+    std::shared_ptr<const VertexPool> verts, norms;
+    size_t n_tris;
+
+    /* Three entries per triangle. norm_indices stays empty until a
+       triangle with normals is added. */
+    std::vector<uint32_t> vert_indices, norm_indices;
+
+    /* Index into parts of each triangle's material */
+    std::vector<uint32_t> mat_ids;
+    std::vector<const ObjectPart*> parts;
+
+    Bounds bounds;
+    BVH* bvh;
+
+    /* The vertices of each leaf's triangles, in as few blocks as hold
+       them. leaf_blocks maps the first slot of a leaf in the BVH's
+       GetIndices() to its first block. */
+    std::vector<TriangleBlock> blocks;
+    std::vector<uint32_t> leaf_blocks;
+
+    /* The grid a compressed mesh's vertices are snapped to: steps are
+       powers of two, and the lowest point a multiple of them */
+    bool compressed;
+    double grid_lo[N_AXES], grid_step[N_AXES];
+
+    /* A compressed mesh's blocks, and its triangles' vertex normals
+       (three per lane, or none if no triangle has any) and material
+       ids (none if it has a single material) by block lane */
+    std::vector<QuantizedTriangleBlock> quantized_blocks;
+    std::vector<uint32_t> slot_normals, slot_mats;
+
+    /* Normals are only known at hits, and are reported by Finalize */
+    virtual inline Vector3D NormalAtPoint(const Vector3D& v) const override
+    {
+        return Vector3D();
+    };
+};
+
+#endif
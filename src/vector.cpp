@@ -19,11 +19,6 @@ Vector3D::Vector3D(const SceneComponent* sc, int start_val)
     }
 }
 
-double Vector3D::GetValue(int axis) const
-{
-    return this->vals[axis];
-}
-
 double Vector3D::GetX() const
 {
     return this->GetValue(AXIS_X);
@@ -21,7 +21,9 @@ public:
     double GetX() const;
     double GetY() const;
     double GetZ() const;
-    double GetValue(int axis) const;
+    inline double GetValue(int axis) const {
+        return vals[axis];
+    }
 
     /* Vector from this to v */
     Vector3D To(const Vector3D& v) const;
@@ -0,0 +1,249 @@
+#include <cmath>
+
+#include "bounds.hpp"
+#include "bvh.hpp"
+#include "slab_test.hpp"
+#include "wide_bvh.hpp"
+
+template <int W>
+WideBVH<W>::WideBVH(const BVH& bvh) :
+    nodes(),
+    prims(bvh.GetPrimitives())
+{
+    /* An empty tree's root is a leaf without objects, which can't be
+       told from an interior node, so it becomes a node of no children */
+    if (bvh.NumRefs() == 0) {
+        nodes.push_back(Node());
+    } else {
+        Collapse(bvh.GetNodes(), 0);
+    }
+}
+
+template <int W>
+uint32_t WideBVH<W>::Collapse(const BVHNodeArray& bin, uint32_t index)
+{
+    /* Start from the binary node itself and keep opening up the
+       largest interior node among the gathered ones until there are W
+       of them; big boxes are the ones most worth testing together. */
+    uint32_t children[W];
+    int n_children = 1;
+    children[0] = index;
+
+    while (n_children < W) {
+        int best = -1;
+        double best_area = -1;
+
+        for (int i = 0; i < n_children; i++) {
+            const LinearBVHNode& child = bin[children[i]];
+            if (!child.IsLeaf() && child.SurfaceArea() > best_area) {
+                best = i;
+                best_area = child.SurfaceArea();
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        uint32_t first = bin[children[best]].offset;
+        children[best] = first;
+        children[n_children++] = first + 1;
+    }
+
+    uint32_t node_index = nodes.size();
+    nodes.push_back(Node());
+    nodes[node_index].n_children = n_children;
+
+    for (int i = 0; i < W; i++) {
+        Node& node = nodes[node_index];
+
+        if (i >= n_children) {
+            for (int axis = AXIS_X; axis < N_AXES; axis++) {
+                node.lo[axis][i] = INFINITY;
+                node.hi[axis][i] = -INFINITY;
+            }
+            node.offset[i] = 0;
+            node.count[i] = 0;
+            continue;
+        }
+
+        const LinearBVHNode& child = bin[children[i]];
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            node.lo[axis][i] = child.bounds[BE_MIN_EXTENT][axis];
+            node.hi[axis][i] = child.bounds[BE_MAX_EXTENT][axis];
+        }
+
+        if (child.IsLeaf()) {
+            node.offset[i] = child.offset;
+            node.count[i] = child.count;
+        } else {
+            /* Careful: this may reallocate nodes */
+            uint32_t child_index = Collapse(bin, children[i]);
+            nodes[node_index].offset[i] = child_index;
+            nodes[node_index].count[i] = 0;
+        }
+    }
+
+    return node_index;
+}
+
+template <int W>
+SceneObjectIntersection WideBVH<W>::Intersects(const Ray3D& ray, double max_dist) const
+{
+    const SceneObject* closest = nullptr;
+    PrimHit hit;
+    hit.dist = INFINITY;
+
+    BVHRay bvh_ray(ray);
+    TriangleRay tri_ray(ray);
+    float t_max = round_up(max_dist);
+
+    /* Children still to visit, nearest on top */
+    struct StackEntry {
+        uint32_t offset;
+        uint32_t count;
+        float t_entry;
+    } to_check[STACK_SIZE];
+    int stack_size = 0;
+
+    to_check[stack_size++] = {0, 0, 0};
+
+    while (stack_size > 0) {
+        StackEntry entry = to_check[--stack_size];
+
+        /* Something closer was found since this was pushed */
+        if (entry.t_entry > t_max) {
+            continue;
+        }
+
+        if (entry.count > 0) {
+            for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                PrimHit prim_hit;
+                if (prims.Hit(i, ray, tri_ray, max_dist, prim_hit) && prim_hit.dist < hit.dist) {
+                    closest = prims[i];
+                    hit = prim_hit;
+                    max_dist = hit.dist;
+                    t_max = round_up(max_dist);
+                }
+            }
+            continue;
+        }
+
+        const Node& node = nodes[entry.offset];
+
+        const float* near[N_AXES];
+        const float* far[N_AXES];
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            near[axis] = bvh_ray.dir_neg[axis] ? node.hi[axis] : node.lo[axis];
+            far[axis] = bvh_ray.dir_neg[axis] ? node.lo[axis] : node.hi[axis];
+        }
+
+        float t_entry[W];
+        int mask;
+#if defined(__AVX__)
+        if (W == 8) {
+            mask = slab_test8(near, far, bvh_ray, t_max, t_entry);
+        } else
+#endif
+        {
+            mask = 0;
+            for (int base = 0; base < W; base += 4) {
+                mask |= slab_test4(near, far, base, bvh_ray, t_max, t_entry + base) << base;
+            }
+        }
+
+        /* Push the hit children farthest first, so the nearest is
+           popped next. A small insertion sort is plenty for W <= 8. */
+        int first = stack_size;
+        for (int i = 0; i < node.n_children; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+
+            StackEntry child = {node.offset[i], node.count[i], t_entry[i]};
+            int j = stack_size++;
+            while (j > first && to_check[j - 1].t_entry < child.t_entry) {
+                to_check[j] = to_check[j - 1];
+                j--;
+            }
+            to_check[j] = child;
+        }
+    }
+
+    return FinalizeHit(closest, ray, hit);
+}
+
+template <int W>
+bool WideBVH<W>::Occluded(const Ray3D& ray, double max_dist) const
+{
+    BVHRay bvh_ray(ray);
+    TriangleRay tri_ray(ray);
+    float t_max = round_up(max_dist);
+
+    /* Same as Intersects, but any hit ends the search, so children
+       are pushed unsorted and t_max never shrinks. */
+    struct StackEntry {
+        uint32_t offset;
+        uint32_t count;
+    } to_check[STACK_SIZE];
+    int stack_size = 0;
+
+    to_check[stack_size++] = {0, 0};
+
+    while (stack_size > 0) {
+        StackEntry entry = to_check[--stack_size];
+
+        if (entry.count > 0) {
+            for (uint32_t i = entry.offset; i < entry.offset + entry.count; i++) {
+                if (prims.Occludes(i, ray, tri_ray, max_dist)) {
+                    return true;
+                }
+            }
+            continue;
+        }
+
+        const Node& node = nodes[entry.offset];
+
+        const float* near[N_AXES];
+        const float* far[N_AXES];
+        for (int axis = AXIS_X; axis < N_AXES; axis++) {
+            near[axis] = bvh_ray.dir_neg[axis] ? node.hi[axis] : node.lo[axis];
+            far[axis] = bvh_ray.dir_neg[axis] ? node.lo[axis] : node.hi[axis];
+        }
+
+        float t_entry[W];
+        int mask;
+#if defined(__AVX__)
+        if (W == 8) {
+            mask = slab_test8(near, far, bvh_ray, t_max, t_entry);
+        } else
+#endif
+        {
+            mask = 0;
+            for (int base = 0; base < W; base += 4) {
+                mask |= slab_test4(near, far, base, bvh_ray, t_max, t_entry + base) << base;
+            }
+        }
+
+        for (int i = 0; i < node.n_children; i++) {
+            if (mask & (1 << i)) {
+                to_check[stack_size++] = {node.offset[i], node.count[i]};
+            }
+        }
+    }
+
+    return false;
+}
+
+template <int W>
+AccelStats WideBVH<W>::GetStats() const
+{
+    AccelStats stats;
+    stats.n_nodes = nodes.size();
+    stats.n_refs = prims.Size();
+    stats.bytes = nodes.size() * sizeof(Node) + prims.Bytes();
+    return stats;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
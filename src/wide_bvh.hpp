@@ -0,0 +1,61 @@
+#ifndef WIDE_BVH_HPP_
+#define WIDE_BVH_HPP_
+
+#include <vector>
+#include <stdint.h>
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "intersection.hpp"
+#include "primitive_list.hpp"
+#include "ray.hpp"
+#include "scene_object.hpp"
+
+/* A BVH with W children per node (W = 4 or 8), made by collapsing a
+ * binary BVH. Each node keeps its children's bounds in SoA form so a
+ * ray can be tested against all of them with one SIMD slab test.
+ */
+template <int W>
+class WideBVH : public Accelerator {
+public:
+    WideBVH(const BVH& bvh);
+
+    virtual SceneObjectIntersection Intersects(const Ray3D& ray,
+                                               double max_dist) const override;
+
+    virtual bool Occluded(const Ray3D& ray, double max_dist) const override;
+
+    virtual AccelStats GetStats() const override;
+
+private:
+    struct Node {
+        /* Child bounds; unused slots have inverted bounds, so the slab
+           tests can run over all W of them */
+        float lo[N_AXES][W];
+        float hi[N_AXES][W];
+
+        /* Leaf children: first object and object count. Interior
+           children: index of the child node and a count of zero. */
+        uint32_t offset[W];
+        uint32_t count[W];
+
+        /* Children occupy the first n_children slots */
+        uint8_t n_children;
+    };
+
+    /* Collapse the binary subtree rooted at index into a new node and
+       return the new node's index */
+    uint32_t Collapse(const BVHNodeArray& bin, uint32_t index);
+
+    /* Worst-case traversal stack: each level can leave W - 1 siblings
+       behind. */
+    static const int STACK_SIZE = (W - 1) * BVH::MAX_DEPTH + 1;
+
+    std::vector<Node> nodes;
+    PrimitiveList prims;
+};
+
+typedef WideBVH<4> BVH4;
+typedef WideBVH<8> BVH8;
+
+#endif